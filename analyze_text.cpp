@@ -33,7 +33,44 @@
 #include <vector>
 #include <algorithm>
 #include <utility>
-#include <openai.hpp>
+#include <deque>
+#include <condition_variable>
+#include <functional>
+#include <chrono>
+#include <stdexcept>
+#include <iomanip>
+#include <cctype>
+#include <future>
+#include <memory>
+#include <exception>
+#include <cstdint>
+#include <filesystem>
+#include <set>
+#include <limits>
+#include <cmath>
+#include <list>
+#include <optional>
+#include <queue>
+#include <ctime>
+#include <csignal>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <curl/curl.h>
+#include <nlohmann/json.hpp>
+#ifdef WITH_LLAMA
+#include "llama.h"
+#endif
+#if defined(__AVX2__) && defined(__FMA__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 using json = nlohmann::json;
 
@@ -44,33 +81,103 @@ std::string MODEL_NAME;
 std::string KNOWLEDGE_BASE_IDS;
 std::string PROMPT;
 std::string TEMP_PROMPT;
-std::string TRIGGER_START;
-std::string TRIGGER_STOP;
-std::string TRIGGER_TEMP_CHECK;
+std::map<std::string, std::string> TRIGGERS;  // command name -> '|'-separated phrases
+size_t TRIGGER_MAX_EDITS = 1;
+std::map<std::string, size_t> TRIGGER_COMMAND_MAX_EDITS;  // command name -> max_edits overriding the default
 std::string TTS_COMMAND;
+std::string TTS_MODE = "spawn";
+std::string TTS_WORKER_COMMAND;
+size_t TTS_MAX_CHARS = 600;
+std::string TTS_RENDER_COMMAND;
+std::string TTS_PLAY_COMMAND;
+std::string TTS_CACHE_DIR = "tts_cache";
+std::string RESULTS_DIR = "results";
+size_t RESULTS_SEGMENT_BYTES = 64 * 1024 * 1024;
+std::string RESULTS_FSYNC = "batch";
+std::string SESSION_ID;
 
-std::mutex analysis_mutex;
-std::atomic<int> counter_value{0};
-std::atomic<int> temp_counter_value{0};
-std::atomic<int> active_analyses{0};
-std::mutex tts_mutex;
-std::once_flag openai_init_flag;
+// Announcements whose wording never changes; they are pre-rendered into the
+// TTS audio cache when tts.render_command and tts.play_command are set.
+namespace Announcements {
+    const std::string LISTENING = "Listening for input...\n";
+    const std::string RECORDING_STARTED = "Recording started ------------------->>>\n";
+    const std::string RECORDING_ALREADY_STARTED = "Recording has already been started ------------------->>>\n";
+    const std::string RECORDING_STOPPED = "Recording stopped ------------------->>>\n";
+    const std::string NO_RECORDING = "No recording is currently running ------------------->>>\n";
+    const std::string TEMP_CHECK_REQUESTED = "Temporary check requested ------------------->>>\n";
+    const std::string ANALYSIS_QUEUED = "Another analysis is running; this one will start once it finishes ------------------->>>\n";
+    const std::string ANALYSIS_CANCELLED = "Cancelling the analysis ------------------->>>\n";
+    const std::string NOTHING_TO_CANCEL = "No analysis to cancel ------------------->>>\n";
 
-class AnalysisSession {
-public:
-    AnalysisSession(std::mutex& mutex, std::atomic<int>& active_count)
-        : lock_(mutex), active_count_(active_count) {
-        ++active_count_;
-    }
-
-    ~AnalysisSession() {
-        --active_count_;
-    }
+    const std::vector<std::string> FIXED = {
+        LISTENING, RECORDING_STARTED, RECORDING_ALREADY_STARTED, RECORDING_STOPPED,
+        NO_RECORDING, TEMP_CHECK_REQUESTED, ANALYSIS_QUEUED, ANALYSIS_CANCELLED, NOTHING_TO_CANCEL
+    };
+}
+size_t ANALYSIS_WORKERS = 1;
+size_t ANALYSIS_QUEUE_CAPACITY = 16;
+bool STREAM_RESPONSES = true;
+bool INCREMENTAL_TEMP_CHECKS = true;
+size_t ANALYSIS_CHUNK_TOKENS = 0;  // 0 sends every recording in one request
+size_t ANALYSIS_CHUNK_OVERLAP_LINES = 1;
+bool PREEMPT_TEMP_CHECKS = true;
+bool SPECULATIVE_ANALYSIS = false;
+size_t SPECULATIVE_INTERVAL_S = 60;   // 0 disables interval passes
+size_t SPECULATIVE_PAUSE_MS = 0;      // 0 disables passes on pauses
+size_t SPECULATIVE_MIN_TOKENS = 200;  // new transcript needed before another pass
+bool FHIR_RESPONSE_FORMAT = false;
+bool FHIR_VALIDATE = false;
+std::string SUMMARY_MODE = "extractive";  // extractive | llm
+size_t SUMMARY_SENTENCES = 3;
+size_t SUMMARY_MAX_ITEMS = 5;             // key values read out per FHIR resource type
+bool RESPONSE_CACHE = false;
+bool RESPONSE_CACHE_ON_DISK = true;
+std::string RESPONSE_CACHE_DIR = "response_cache";
+size_t RESPONSE_CACHE_MEMORY_ENTRIES = 64;
+size_t RESPONSE_CACHE_DISK_ENTRIES = 1024;
+size_t RESPONSE_CACHE_TTL_S = 0;                     // 0 never expires answers
+std::string RETRIEVAL_INDEX;                         // empty uses the remote knowledge bases
+size_t RETRIEVAL_TOP_K = 4;
+size_t RETRIEVAL_NPROBE = 4;
+size_t RETRIEVAL_DIMENSIONS = 1024;                  // used when building the index
+size_t RETRIEVAL_CHUNK_CHARS = 800;
+bool RETRIEVAL_PREFETCH = false;
+size_t RETRIEVAL_PREFETCH_TOKENS = 100;              // new transcript between prefetch passes
+size_t RETRIEVAL_PREFETCH_TIMEOUT_MS = 10000;
+bool PROMPT_CACHE_LAYOUT = false;
+size_t PROMPT_CACHE_SLOTS = 0;
+size_t HTTP_MAX_HOST_CONNECTIONS = 8;
+std::string LOCAL_LLM_MODEL;                         // GGUF file; empty disables the "local" backend
+size_t LOCAL_LLM_THREADS = 0;                        // 0 uses every core
+size_t LOCAL_LLM_CONTEXT = 8192;                     // tokens, shared by all slots
+size_t LOCAL_LLM_SLOTS = 4;
+size_t LOCAL_LLM_BATCH = 512;
+size_t LOCAL_LLM_MAX_TOKENS = 1024;
+bool TRANSCRIPT_NORMALIZE = false;
+std::string TRANSCRIPT_FILLERS = "uh, uhm, um, umm, er, erm, ah, eh, ehm, hmm, mm, mhm";
+bool TRANSCRIPT_REMOVE_REPEATS = true;
+bool TRANSCRIPT_DEDUPE_LINES = true;
+size_t TRANSCRIPT_DEDUPE_WINDOW = 5;                 // earlier lines a new line is compared with
+bool TRANSCRIPT_NUMBERS = true;
+bool TRANSCRIPT_TRIGGER_FRAGMENTS = true;
 
-private:
-    std::unique_lock<std::mutex> lock_;
-    std::atomic<int>& active_count_;
+// An OpenAI-compatible endpoint; "openai" is the one configured in [openai] and
+// "local" the in-process model of [local_llm], which has a model_path instead of a url.
+struct BackendConfig {
+    std::string url;
+    std::string api_key;
+    std::string model;
+    std::string model_path;
 };
+std::map<std::string, BackendConfig> BACKENDS;
+std::map<std::string, std::vector<std::string>> ROUTES;  // request class -> backends in order of preference
+std::map<std::string, size_t> ROUTE_DEADLINES_MS;        // request class -> deadline, 0 for none
+size_t HEDGE_PERCENTILE = 0;                             // 0 disables hedged requests
+size_t HEDGE_MIN_SAMPLES = 20;
+size_t BACKEND_FAILURE_THRESHOLD = 3;
+size_t BACKEND_COOLDOWN_MS = 30000;
+
+extern char** environ;
 
 std::string strip_trailing_newlines(std::string text) {
     while (!text.empty() && (text.back() == '\n' || text.back() == '\r')) {
@@ -79,31 +186,509 @@ std::string strip_trailing_newlines(std::string text) {
     return text;
 }
 
-std::string escape_for_quotes(const std::string& text) {
-    std::string escaped;
-    escaped.reserve(text.size());
-    for (char c : text) {
-        if (c == '\\' || c == '\"') {
-            escaped.push_back('\\');
+std::string trim(const std::string& text) {
+    const size_t first = text.find_first_not_of(" \t\r\n");
+    if (first == std::string::npos) {
+        return "";
+    }
+    return text.substr(first, text.find_last_not_of(" \t\r\n") - first + 1);
+}
+
+// Splits a separated list, trimming blanks around the items and dropping empty ones.
+std::vector<std::string> split_list(const std::string& text, char separator) {
+    std::vector<std::string> items;
+    std::stringstream stream(text);
+    std::string item;
+    while (std::getline(stream, item, separator)) {
+        item = trim(item);
+        if (!item.empty()) {
+            items.push_back(item);
         }
-        escaped.push_back(c);
     }
-    return escaped;
+    return items;
 }
 
-void speak_text(const std::string& text) {
-    std::string trimmed = strip_trailing_newlines(text);
-    if (trimmed.empty()) {
-        return;
+// 64-bit FNV-1a hash, used for cache keys and prompt fingerprints.
+uint64_t fnv1a_64(const std::string& data, uint64_t hash = 0xcbf29ce484222325ULL) {
+    for (unsigned char c : data) {
+        hash ^= c;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+std::string to_hex(uint64_t value) {
+    std::ostringstream oss;
+    oss << std::hex << std::setw(16) << std::setfill('0') << value;
+    return oss.str();
+}
+
+// Removes the console separators ("------------------->>>") so they are not read aloud.
+std::string strip_separators(const std::string& text) {
+    std::string out;
+    out.reserve(text.size());
+    for (size_t i = 0; i < text.size();) {
+        size_t j = i;
+        while (j < text.size() && text[j] == '-') {
+            ++j;
+        }
+        if (j - i >= 3) {
+            while (j < text.size() && text[j] == '>') {
+                ++j;
+            }
+            while (!out.empty() && out.back() == ' ') {
+                out.pop_back();
+            }
+            i = j;
+            continue;
+        }
+        out.push_back(text[i]);
+        ++i;
+    }
+    return out;
+}
+
+// The exact text handed to the TTS engine for a console message.
+std::string spoken_form(const std::string& message) {
+    const std::string trimmed = strip_separators(strip_trailing_newlines(message));
+    return trimmed.empty() ? trimmed : "Announciator: " + trimmed;
+}
+
+// Splits a command line into arguments, honouring single quotes, double quotes
+// and backslash escapes, so configured commands run without a shell.
+std::vector<std::string> split_command(const std::string& command) {
+    std::vector<std::string> args;
+    std::string current;
+    bool in_word = false;
+    char quote = 0;
+    for (size_t i = 0; i < command.size(); ++i) {
+        const char c = command[i];
+        if (quote) {
+            if (c == quote) {
+                quote = 0;
+            } else if (c == '\\' && quote == '"' && i + 1 < command.size()) {
+                current.push_back(command[++i]);
+            } else {
+                current.push_back(c);
+            }
+        } else if (c == '\'' || c == '"') {
+            quote = c;
+            in_word = true;
+        } else if (c == '\\' && i + 1 < command.size()) {
+            current.push_back(command[++i]);
+            in_word = true;
+        } else if (std::isspace(static_cast<unsigned char>(c))) {
+            if (in_word) {
+                args.push_back(std::move(current));
+                current.clear();
+                in_word = false;
+            }
+        } else {
+            current.push_back(c);
+            in_word = true;
+        }
+    }
+    if (in_word) {
+        args.push_back(std::move(current));
+    }
+    return args;
+}
+
+// Starts argv[0] via PATH lookup with stdout/stderr discarded. When stdin_fd is
+// not -1 it becomes the child's stdin. Returns the pid, or -1 on failure.
+pid_t spawn_process(const std::vector<std::string>& args, int stdin_fd = -1, int close_fd = -1) {
+    if (args.empty()) {
+        return -1;
+    }
+    std::vector<char*> argv;
+    argv.reserve(args.size() + 1);
+    for (const auto& arg : args) {
+        argv.push_back(const_cast<char*>(arg.c_str()));
+    }
+    argv.push_back(nullptr);
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    if (stdin_fd != -1) {
+        posix_spawn_file_actions_adddup2(&actions, stdin_fd, STDIN_FILENO);
+        posix_spawn_file_actions_addclose(&actions, stdin_fd);
+    }
+    if (close_fd != -1) {
+        posix_spawn_file_actions_addclose(&actions, close_fd);
+    }
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+    posix_spawn_file_actions_adddup2(&actions, STDOUT_FILENO, STDERR_FILENO);
+
+    // Each child leads its own process group so it can be interrupted together
+    // with any audio player it starts.
+    posix_spawnattr_t attributes;
+    posix_spawnattr_init(&attributes);
+    posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETPGROUP);
+    posix_spawnattr_setpgroup(&attributes, 0);
+
+    pid_t pid = -1;
+    const int rc = posix_spawnp(&pid, argv[0], &actions, &attributes, argv.data(), environ);
+    posix_spawnattr_destroy(&attributes);
+    posix_spawn_file_actions_destroy(&actions);
+    return rc == 0 ? pid : -1;
+}
+
+// Spoken output classes, most urgent first.
+enum class TtsPriority {
+    Error = 0,    // failures and warnings
+    Command = 1,  // confirmations of voice commands
+    Result = 2,   // analysis summaries and temporary-check answers
+    Status = 3    // progress announcements
+};
+
+// Cuts text longer than max_chars at the last sentence end, or else the last
+// word boundary, within the limit.
+std::string truncate_for_speech(const std::string& text, size_t max_chars) {
+    if (max_chars == 0 || text.size() <= max_chars) {
+        return text;
+    }
+    size_t cut = std::string::npos;
+    for (size_t i = max_chars; i > max_chars / 2; --i) {
+        const char c = text[i - 1];
+        if (c == '.' || c == '!' || c == '?') {
+            cut = i;
+            break;
+        }
+    }
+    if (cut == std::string::npos) {
+        cut = text.rfind(' ', max_chars);
+        if (cut == std::string::npos || cut == 0) {
+            cut = max_chars;
+        }
+    }
+    return text.substr(0, cut) + " ...";
+}
+
+// Speaks queued utterances one at a time on its own thread, so callers never
+// block on speech synthesis and announcements no longer talk over each other.
+//  - spawn mode runs tts.command with the utterance as its last argument via
+//    posix_spawn, without a shell, and waits for it to finish;
+//  - pipe mode starts tts.worker_command once (so it loads its voice once) and
+//    writes one utterance per line to its stdin, restarting it if it exits.
+// The queue is ordered by priority, then arrival. Utterances may carry a
+// supersede key and generation: a newer generation of the same key drops
+// queued older ones and, in spawn mode, interrupts the one being spoken.
+// With tts.render_command and tts.play_command set, the fixed announcements are
+// rendered once into tts.cache_dir and played from there instead of synthesised.
+class TtsWorker {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    ~TtsWorker() {
+        shutdown();
+    }
+
+    void start() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (thread_.joinable()) {
+            return;
+        }
+        pipe_mode_ = TTS_MODE == "pipe";
+        args_ = split_command(pipe_mode_ ? TTS_WORKER_COMMAND : TTS_COMMAND);
+        play_args_ = split_command(TTS_PLAY_COMMAND);
+        stopping_ = false;
+        thread_ = std::thread(&TtsWorker::run, this);
+        if (!TTS_RENDER_COMMAND.empty() && !play_args_.empty()) {
+            render_thread_ = std::thread(&TtsWorker::render_fixed_announcements, this);
+        }
+    }
+
+    // Queues an utterance. Utterances queued before start() are spoken once it runs.
+    void speak(std::string text, TtsPriority priority = TtsPriority::Status,
+               const std::string& supersede_key = {}, int generation = 0) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (stopping_) {
+                return;
+            }
+            if (!supersede_key.empty()) {
+                int& latest = latest_generation_[supersede_key];
+                if (generation < latest) {
+                    ++superseded_;  // an answer to a newer request is already known
+                    return;
+                }
+                latest = generation;
+                const size_t before = queue_.size();
+                queue_.erase(std::remove_if(queue_.begin(), queue_.end(), [&](const Utterance& queued) {
+                    return queued.supersede_key == supersede_key && queued.generation < generation;
+                }), queue_.end());
+                superseded_ += before - queue_.size();
+                if (current_pid_ > 0 && current_key_ == supersede_key && current_generation_ < generation) {
+                    kill(-current_pid_, SIGTERM);
+                    current_superseded_ = true;
+                    ++superseded_;
+                }
+            }
+            Utterance utterance{truncate_for_speech(text, TTS_MAX_CHARS), priority, supersede_key,
+                                generation, Clock::now()};
+            auto position = std::find_if(queue_.begin(), queue_.end(), [priority](const Utterance& queued) {
+                return queued.priority > priority;
+            });
+            queue_.insert(position, std::move(utterance));
+            max_depth_ = std::max(max_depth_, queue_.size());
+        }
+        cv_.notify_one();
+    }
+
+    // Drops the newest generation remembered for a supersede key that will not be
+    // used again, so keys of finished recordings do not accumulate.
+    void forget(const std::string& supersede_key) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        latest_generation_.erase(supersede_key);
+    }
+
+    // Speaks whatever is still queued, then stops the worker process and thread.
+    void shutdown() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!thread_.joinable() || stopping_) {
+                return;
+            }
+            stopping_ = true;
+        }
+        cv_.notify_all();
+        thread_.join();
+        if (render_thread_.joinable()) {
+            render_thread_.join();
+        }
+        stop_pipe_worker();
+    }
+
+    std::string stats() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::ostringstream oss;
+        oss << "[tts] utterances=" << spoken_
+            << " failed=" << failed_
+            << " superseded=" << superseded_
+            << " cache_hits=" << cache_hits_
+            << " max_depth=" << max_depth_
+            << " avg_queue_ms=" << (spoken_ ? total_queue_ms_ / static_cast<long long>(spoken_) : 0)
+            << " max_queue_ms=" << max_queue_ms_ << "\n";
+        return oss.str();
+    }
+
+private:
+    struct Utterance {
+        std::string text;
+        TtsPriority priority = TtsPriority::Status;
+        std::string supersede_key;
+        int generation = 0;
+        Clock::time_point enqueued;
+    };
+
+    void run() {
+        for (;;) {
+            Utterance utterance;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                cv_.wait(lock, [this] { return stopping_ || !queue_.empty(); });
+                if (queue_.empty()) {
+                    return;
+                }
+                utterance = std::move(queue_.front());
+                queue_.pop_front();
+            }
+
+            const auto started = Clock::now();
+            const long long queue_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                started - utterance.enqueued).count();
+            std::string cached_file;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                auto it = rendered_.find(utterance.text);
+                if (it != rendered_.end()) {
+                    cached_file = it->second;
+                }
+            }
+            const bool from_cache = !cached_file.empty();
+            bool ok = false;
+            if (from_cache) {
+                ok = run_once(utterance, play_args_, cached_file);
+            } else {
+                ok = pipe_mode_ ? write_to_pipe_worker(utterance.text) : run_once(utterance, args_, utterance.text);
+            }
+            const long long speak_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                Clock::now() - started).count();
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!ok) {
+                ++failed_;
+                continue;
+            }
+            ++spoken_;
+            cache_hits_ += from_cache ? 1 : 0;
+            total_queue_ms_ += queue_ms;
+            max_queue_ms_ = std::max(max_queue_ms_, queue_ms);
+            std::cout << "[tts] priority " << static_cast<int>(utterance.priority) << " queued " << queue_ms << " ms, "
+                      << (from_cache ? "played from cache in " : pipe_mode_ ? "handed over in " : "spoken in ")
+                      << speak_ms << " ms\n";
+        }
+    }
+
+    // Runs base_args plus last_arg and waits for it; supersede() may interrupt it.
+    bool run_once(const Utterance& utterance, const std::vector<std::string>& base_args, const std::string& last_arg) {
+        std::vector<std::string> args = base_args;
+        args.push_back(last_arg);
+        pid_t pid = -1;
+        {
+            // Spawned under the lock so speak() sees the pid before it can supersede it.
+            std::lock_guard<std::mutex> lock(mutex_);
+            pid = spawn_process(args);
+            current_pid_ = pid;
+            current_key_ = utterance.supersede_key;
+            current_generation_ = utterance.generation;
+            current_superseded_ = false;
+        }
+        if (pid < 0) {
+            return false;
+        }
+        int status = 0;
+        while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+        }
+        bool superseded = false;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            current_pid_ = -1;
+            superseded = current_superseded_;
+        }
+        // Only the SIGTERM sent by speak() is expected; any other signal is a crash.
+        return superseded || (WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+
+    // Renders each fixed announcement once into the cache directory; files from
+    // earlier runs are reused. The key covers the render command (voice) and text.
+    void render_fixed_announcements() {
+        namespace fs = std::filesystem;
+        std::error_code ec;
+        fs::create_directories(TTS_CACHE_DIR, ec);
+        const std::vector<std::string> render_args = split_command(TTS_RENDER_COMMAND);
+        for (const auto& announcement : Announcements::FIXED) {
+            const std::string text = spoken_form(announcement);
+            const std::string key = to_hex(fnv1a_64(text, fnv1a_64(TTS_RENDER_COMMAND)));
+            const fs::path target = fs::path(TTS_CACHE_DIR) / (key + ".wav");
+            if (!fs::exists(target, ec)) {
+                const fs::path partial = fs::path(TTS_CACHE_DIR) / (key + ".partial.wav");
+                std::vector<std::string> args;
+                for (const auto& arg : render_args) {
+                    args.push_back(arg == "{output}" ? partial.string() : arg);
+                }
+                args.push_back(text);
+                const pid_t pid = spawn_process(args);
+                int status = 0;
+                while (pid > 0 && waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+                }
+                if (pid < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0 || !fs::exists(partial, ec)) {
+                    std::cerr << "[tts] Unable to render \"" << text << "\" into the audio cache\n";
+                    continue;
+                }
+                fs::rename(partial, target, ec);
+                if (ec) {
+                    continue;
+                }
+            }
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (stopping_) {
+                return;
+            }
+            rendered_[text] = target.string();
+        }
+    }
+
+    bool start_pipe_worker() {
+        int fds[2];
+        if (pipe2(fds, O_CLOEXEC) != 0) {
+            return false;
+        }
+        worker_pid_ = spawn_process(args_, fds[0], fds[1]);
+        close(fds[0]);
+        if (worker_pid_ < 0) {
+            close(fds[1]);
+            return false;
+        }
+        worker_stdin_ = fds[1];
+        return true;
+    }
+
+    void stop_pipe_worker() {
+        if (worker_stdin_ != -1) {
+            close(worker_stdin_);  // EOF lets the worker finish its last utterance
+            worker_stdin_ = -1;
+        }
+        if (worker_pid_ > 0) {
+            int status = 0;
+            while (waitpid(worker_pid_, &status, 0) < 0 && errno == EINTR) {
+            }
+            worker_pid_ = -1;
+        }
+    }
+
+    bool write_to_pipe_worker(std::string text) {
+        std::replace(text.begin(), text.end(), '\n', ' ');
+        text.push_back('\n');
+        for (int attempt = 0; attempt < 2; ++attempt) {
+            if (worker_stdin_ == -1 && !start_pipe_worker()) {
+                return false;
+            }
+            size_t written = 0;
+            while (written < text.size()) {
+                const ssize_t n = write(worker_stdin_, text.data() + written, text.size() - written);
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (n <= 0) {
+                    break;
+                }
+                written += static_cast<size_t>(n);
+            }
+            if (written == text.size()) {
+                return true;
+            }
+            stop_pipe_worker();  // the worker died; restart it once
+        }
+        return false;
     }
 
-    trimmed = "Announciator: " + trimmed;
+    mutable std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<Utterance> queue_;
+    std::thread thread_;
+    std::thread render_thread_;
+    bool stopping_ = false;
+    bool pipe_mode_ = false;
+    std::vector<std::string> args_;
+    std::vector<std::string> play_args_;
+    std::map<std::string, std::string> rendered_;  // spoken text -> cached audio file
+    pid_t worker_pid_ = -1;
+    int worker_stdin_ = -1;
+    pid_t current_pid_ = -1;
+    bool current_superseded_ = false;  // speak() terminated current_pid_
+    std::string current_key_;
+    int current_generation_ = 0;
+    std::map<std::string, int> latest_generation_;
+    size_t spoken_ = 0;
+    size_t failed_ = 0;
+    size_t superseded_ = 0;
+    size_t cache_hits_ = 0;
+    size_t max_depth_ = 0;
+    long long total_queue_ms_ = 0;
+    long long max_queue_ms_ = 0;
+};
+
+TtsWorker tts_worker;
 
-    const std::string escaped = escape_for_quotes(trimmed);
-    const std::string cmd = TTS_COMMAND + " \"" + escaped + "\" >/dev/null 2>&1 &";
+void speak_text(const std::string& text, TtsPriority priority = TtsPriority::Status,
+                const std::string& supersede_key = {}, int generation = 0) {
+    std::string spoken = spoken_form(text);
+    if (spoken.empty()) {
+        return;
+    }
 
-    std::lock_guard<std::mutex> lock(tts_mutex);
-    std::system(cmd.c_str());
+    tts_worker.speak(std::move(spoken), priority, supersede_key, generation);
 }
 
 void say_info(const std::string& message) {
@@ -111,9 +696,15 @@ void say_info(const std::string& message) {
     speak_text(message);
 }
 
+// Confirms a voice command; spoken ahead of progress announcements.
+void say_command(const std::string& message) {
+    std::cout << message;
+    speak_text(message, TtsPriority::Command);
+}
+
 void say_error(const std::string& message) {
     std::cerr << message;
-    speak_text(message);
+    speak_text(message, TtsPriority::Error);
 }
 
 // Simple INI parser
@@ -149,336 +740,6849 @@ std::map<std::string, std::string> parse_ini(const std::string& filename) {
         }
     }
 
-    return config;
-}
+    return config;
+}
+
+// Load config
+bool load_config(const std::string& path) {
+    std::ifstream file_check(path);
+    if (!file_check.is_open()) {
+        say_error("Unable to open config file: " + path + "\n");
+        return false;
+    }
+    file_check.close();
+
+    auto config = parse_ini(path);
+
+    std::vector<std::string> missing_keys;
+    auto require_value = [&](const std::string& key, std::string& destination) {
+        auto it = config.find(key);
+        if (it == config.end() || it->second.empty()) {
+            missing_keys.push_back(key);
+            return;
+        }
+        destination = it->second;
+    };
+
+    require_value("openai.base_url", OPENWEBUI_URL);
+    require_value("openai.api_key", API_KEY);
+    require_value("openai.model_name", MODEL_NAME);
+    require_value("prompts.prompt", PROMPT);
+    require_value("prompts.temp_prompt", TEMP_PROMPT);
+    require_value("triggers.start", TRIGGERS["start"]);
+    require_value("triggers.stop", TRIGGERS["stop"]);
+    require_value("triggers.temp_check", TRIGGERS["temp_check"]);
+    require_value("tts.command", TTS_COMMAND);
+
+    auto optional_value = [&](const std::string& key, std::string& destination) {
+        auto it = config.find(key);
+        if (it != config.end() && !it->second.empty()) {
+            destination = it->second;
+        }
+    };
+
+    // tts.mode = pipe keeps one tts.worker_command process (default: tts.command)
+    // running and feeds it one utterance per line on stdin.
+    optional_value("tts.mode", TTS_MODE);
+    TTS_WORKER_COMMAND = TTS_COMMAND;
+    optional_value("tts.worker_command", TTS_WORKER_COMMAND);
+
+    auto kb_it = config.find("analysis.knowledge_base_ids");
+    KNOWLEDGE_BASE_IDS = (kb_it != config.end()) ? kb_it->second : std::string{};
+
+    std::vector<std::string> invalid_keys;
+    auto optional_size = [&](const std::string& key, size_t& destination, size_t minimum) {
+        auto it = config.find(key);
+        if (it == config.end() || it->second.empty()) {
+            return;
+        }
+        try {
+            size_t consumed = 0;
+            const unsigned long value = std::stoul(it->second, &consumed);
+            if (consumed != it->second.size() || value < minimum) {
+                invalid_keys.push_back(key);
+                return;
+            }
+            destination = static_cast<size_t>(value);
+        } catch (const std::exception&) {
+            invalid_keys.push_back(key);
+        }
+    };
+
+    // Number of analyses sent to the LLM endpoint concurrently, and how many
+    // triggered analyses may wait for a free worker before new ones are refused.
+    optional_size("analysis.workers", ANALYSIS_WORKERS, 1);
+    optional_size("analysis.queue_capacity", ANALYSIS_QUEUE_CAPACITY, 1);
+
+    auto optional_bool = [&](const std::string& key, bool& destination) {
+        auto it = config.find(key);
+        if (it == config.end() || it->second.empty()) {
+            return;
+        }
+        std::string value = it->second;
+        std::transform(value.begin(), value.end(), value.begin(), ::tolower);
+        if (value == "true" || value == "yes" || value == "on" || value == "1") {
+            destination = true;
+        } else if (value == "false" || value == "no" || value == "off" || value == "0") {
+            destination = false;
+        } else {
+            invalid_keys.push_back(key);
+        }
+    };
+
+    // Stream completions over SSE so results are written as they arrive.
+    optional_bool("openai.stream", STREAM_RESPONSES);
+
+    // Audio cache for fixed announcements: render_command writes the text (last
+    // argument) to the file given by its {output} argument, play_command plays a file.
+    optional_value("tts.render_command", TTS_RENDER_COMMAND);
+    optional_value("tts.play_command", TTS_PLAY_COMMAND);
+    optional_value("tts.cache_dir", TTS_CACHE_DIR);
+
+    // Structured result store: JSONL segments rotated at segment_bytes plus an
+    // index; fsync = none | batch (once per written batch) | always (every record).
+    optional_value("results.dir", RESULTS_DIR);
+    optional_size("results.segment_bytes", RESULTS_SEGMENT_BYTES, 4096);
+    optional_value("results.fsync", RESULTS_FSYNC);
+    if (RESULTS_FSYNC != "none" && RESULTS_FSYNC != "batch" && RESULTS_FSYNC != "always") {
+        invalid_keys.push_back("results.fsync");
+    }
+
+    // Longer utterances are cut at a sentence or word boundary; 0 disables the limit.
+    optional_size("tts.max_chars", TTS_MAX_CHARS, 0);
+
+    if (TTS_MODE != "spawn" && TTS_MODE != "pipe") {
+        invalid_keys.push_back("tts.mode");
+    }
+
+    // Send temporary checks only the transcript added since the previous check,
+    // together with that check's answer, instead of the whole recording.
+    optional_bool("analysis.incremental_temp_checks", INCREMENTAL_TEMP_CHECKS);
+
+    // Stopping a recording aborts its temporary check in flight as well as the
+    // queued ones, so the final analysis gets the backend without waiting.
+    optional_bool("analysis.preempt_temp_checks", PREEMPT_TEMP_CHECKS);
+
+    // Recordings estimated above chunk_tokens are analysed in windows of that size
+    // concurrently and the partial results merged (map-reduce).
+    optional_size("analysis.chunk_tokens", ANALYSIS_CHUNK_TOKENS, 0);
+    optional_size("analysis.chunk_overlap_lines", ANALYSIS_CHUNK_OVERLAP_LINES, 0);
+
+    // Analyse a running recording in the background every speculative_interval_s
+    // seconds or after speculative_pause_ms without a new line, so that the
+    // analysis on stop only covers the rest of the transcript.
+    optional_bool("analysis.speculative", SPECULATIVE_ANALYSIS);
+    optional_size("analysis.speculative_interval_s", SPECULATIVE_INTERVAL_S, 0);
+    optional_size("analysis.speculative_pause_ms", SPECULATIVE_PAUSE_MS, 0);
+    optional_size("analysis.speculative_min_tokens", SPECULATIVE_MIN_TOKENS, 1);
+
+    // fhir.response_format constrains extraction requests to a FHIR Bundle JSON
+    // schema; fhir.validate parses the answer as it streams, repairs invalid
+    // entries and stores the valid Bundle next to the results file.
+    optional_bool("fhir.response_format", FHIR_RESPONSE_FORMAT);
+    optional_bool("fhir.validate", FHIR_VALIDATE);
+
+    // The spoken summary is extracted locally (a FHIR Bundle is read out by
+    // resource type, other answers reduced to their summary.sentences most
+    // central sentences); summary.mode = llm asks the model for it instead.
+    optional_value("summary.mode", SUMMARY_MODE);
+    if (SUMMARY_MODE != "extractive" && SUMMARY_MODE != "llm") {
+        invalid_keys.push_back("summary.mode");
+    }
+    optional_size("summary.sentences", SUMMARY_SENTENCES, 1);
+    optional_size("summary.max_items", SUMMARY_MAX_ITEMS, 1);
+
+    // Answer byte-identical requests (same route, prompt, knowledge bases and
+    // transcript) from a cache kept in memory and, unless on_disk is false, in dir.
+    optional_bool("response_cache.enabled", RESPONSE_CACHE);
+    optional_bool("response_cache.on_disk", RESPONSE_CACHE_ON_DISK);
+    optional_value("response_cache.dir", RESPONSE_CACHE_DIR);
+    optional_size("response_cache.memory_entries", RESPONSE_CACHE_MEMORY_ENTRIES, 1);
+    optional_size("response_cache.disk_entries", RESPONSE_CACHE_DISK_ENTRIES, 1);
+    optional_size("response_cache.ttl_s", RESPONSE_CACHE_TTL_S, 0);
+
+    // Local protocol retrieval: retrieval.index is built with --build-index DIR;
+    // when it loads, the top_k passages of the nprobe nearest lists are put into
+    // the prompt and analysis.knowledge_base_ids is only sent when none match.
+    optional_value("retrieval.index", RETRIEVAL_INDEX);
+    optional_size("retrieval.top_k", RETRIEVAL_TOP_K, 1);
+    optional_size("retrieval.nprobe", RETRIEVAL_NPROBE, 1);
+    optional_size("retrieval.dimensions", RETRIEVAL_DIMENSIONS, 64);
+    optional_size("retrieval.chunk_chars", RETRIEVAL_CHUNK_CHARS, 100);
+    // Without a local index, query the knowledge bases of analysis.knowledge_base_ids
+    // (comma-separated, searched concurrently) while recording, every
+    // prefetch_tokens of new transcript, and send their passages with the analyses.
+    optional_bool("retrieval.prefetch", RETRIEVAL_PREFETCH);
+    optional_size("retrieval.prefetch_tokens", RETRIEVAL_PREFETCH_TOKENS, 1);
+    optional_size("retrieval.prefetch_timeout_ms", RETRIEVAL_PREFETCH_TIMEOUT_MS, 100);
+
+    // Opt-in request layout for servers with a prompt (KV) cache such as llama.cpp
+    // or vLLM: static instructions as a stable prefix, plus cache_prompt/id_slot hints.
+    optional_bool("prompt_cache.enabled", PROMPT_CACHE_LAYOUT);
+    optional_size("prompt_cache.slots", PROMPT_CACHE_SLOTS, 0);
+
+    // transcript.normalize cleans each transcript line before it is added to the
+    // recording (see TranscriptNormalizer); the other keys switch its steps.
+    optional_bool("transcript.normalize", TRANSCRIPT_NORMALIZE);
+    optional_value("transcript.fillers", TRANSCRIPT_FILLERS);
+    optional_bool("transcript.remove_repeats", TRANSCRIPT_REMOVE_REPEATS);
+    optional_bool("transcript.dedupe_lines", TRANSCRIPT_DEDUPE_LINES);
+    optional_size("transcript.dedupe_window", TRANSCRIPT_DEDUPE_WINDOW, 1);
+    optional_bool("transcript.numbers", TRANSCRIPT_NUMBERS);
+    optional_bool("transcript.trigger_fragments", TRANSCRIPT_TRIGGER_FRAGMENTS);
+
+    // triggers.cancel aborts the queued and running analyses of the latest recording.
+    // It destroys work, so its default phrase is far from clinical vocabulary
+    // ("cancel" is one edit from "cancer") and it is matched exactly.
+    TRIGGERS["cancel"] = "discard analysis";
+    TRIGGER_COMMAND_MAX_EDITS["cancel"] = 0;
+
+    // Any other key in [triggers] defines an additional command; each value may list
+    // several phrases separated by '|'. max_edits is the per-word edit distance
+    // tolerated for words longer than three letters, max_edits.COMMAND overrides
+    // it for one command.
+    const std::string trigger_prefix = "triggers.";
+    const std::string command_edits_prefix = "triggers.max_edits.";
+    for (const auto& [key, value] : config) {
+        if (key.compare(0, trigger_prefix.size(), trigger_prefix) != 0 || value.empty()) {
+            continue;
+        }
+        if (key.compare(0, command_edits_prefix.size(), command_edits_prefix) == 0) {
+            optional_size(key, TRIGGER_COMMAND_MAX_EDITS[key.substr(command_edits_prefix.size())], 0);
+            continue;
+        }
+        const std::string name = key.substr(trigger_prefix.size());
+        if (name != "max_edits") {
+            TRIGGERS[name] = value;
+        }
+    }
+    optional_size("triggers.max_edits", TRIGGER_MAX_EDITS, 0);
+
+    // Upper bound on parallel connections to the LLM host; HTTP/2 requests beyond
+    // it are multiplexed over the open connections.
+    optional_size("http.max_host_connections", HTTP_MAX_HOST_CONNECTIONS, 1);
+
+    // Each [backend.NAME] section adds an endpoint (base_url, model_name, api_key
+    // defaulting to [openai]'s); [openai] itself is the backend "openai".
+    // [routing] lists the backends tried in order for each request class.
+    // [local_llm] model_path runs a GGUF model in-process as the backend "local"
+    // (builds with WITH_LLAMA only); slots requests are decoded together in
+    // batches of up to batch tokens and share the context of context tokens.
+    optional_value("local_llm.model_path", LOCAL_LLM_MODEL);
+    optional_size("local_llm.threads", LOCAL_LLM_THREADS, 0);
+    optional_size("local_llm.context", LOCAL_LLM_CONTEXT, 512);
+    optional_size("local_llm.slots", LOCAL_LLM_SLOTS, 1);
+    optional_size("local_llm.batch", LOCAL_LLM_BATCH, 32);
+    optional_size("local_llm.max_tokens", LOCAL_LLM_MAX_TOKENS, 1);
+    if (LOCAL_LLM_SLOTS > LOCAL_LLM_BATCH) {
+        invalid_keys.push_back("local_llm.slots");
+    }
+#ifndef WITH_LLAMA
+    if (!LOCAL_LLM_MODEL.empty()) {
+        say_error("Error: local_llm.model_path needs analyze_text built with WITH_LLAMA (make analyze_text_llama.exe).\n");
+        invalid_keys.push_back("local_llm.model_path");
+    }
+#endif
+
+    BACKENDS.clear();
+    BACKENDS["openai"] = BackendConfig{OPENWEBUI_URL, API_KEY, MODEL_NAME, ""};
+    if (!LOCAL_LLM_MODEL.empty()) {
+        BACKENDS["local"] = BackendConfig{"", "", std::filesystem::path(LOCAL_LLM_MODEL).stem().string(), LOCAL_LLM_MODEL};
+    }
+    const std::string backend_prefix = "backend.";
+    for (const auto& [key, value] : config) {
+        const size_t dot = key.rfind('.');
+        if (key.compare(0, backend_prefix.size(), backend_prefix) != 0 || dot <= backend_prefix.size()) {
+            continue;
+        }
+        const std::string name = key.substr(backend_prefix.size(), dot - backend_prefix.size());
+        if (BACKENDS.count(name)) {
+            continue;
+        }
+        BackendConfig backend{{}, API_KEY, MODEL_NAME, ""};
+        require_value(backend_prefix + name + ".base_url", backend.url);
+        optional_value(backend_prefix + name + ".api_key", backend.api_key);
+        optional_value(backend_prefix + name + ".model_name", backend.model);
+        BACKENDS[name] = backend;
+    }
+
+    ROUTES.clear();
+    size_t default_deadline_ms = 300000;
+    optional_size("routing.deadline_ms", default_deadline_ms, 0);
+    for (const std::string request_class : {"temp_check", "analysis", "summary"}) {
+        std::string route = "openai";
+        optional_value("routing." + request_class, route);
+        const std::vector<std::string> names = split_list(route, ',');
+        const bool known = std::all_of(names.begin(), names.end(), [](const std::string& name) {
+            return BACKENDS.count(name) > 0;
+        });
+        if (names.empty() || !known) {
+            invalid_keys.push_back("routing." + request_class);
+        }
+        ROUTES[request_class] = names;
+        ROUTE_DEADLINES_MS[request_class] = default_deadline_ms;
+        optional_size("routing." + request_class + "_deadline_ms", ROUTE_DEADLINES_MS[request_class], 0);
+    }
+
+    // A request still waiting for its first token after the hedge_percentile of its
+    // backend's recent latencies is duplicated to the next backend of its route.
+    optional_size("routing.hedge_percentile", HEDGE_PERCENTILE, 0);
+    if (HEDGE_PERCENTILE > 99) {
+        invalid_keys.push_back("routing.hedge_percentile");
+    }
+    optional_size("routing.hedge_min_samples", HEDGE_MIN_SAMPLES, 1);
+    // After failure_threshold consecutive failures a backend is skipped for cooldown_ms.
+    optional_size("routing.failure_threshold", BACKEND_FAILURE_THRESHOLD, 1);
+    optional_size("routing.cooldown_ms", BACKEND_COOLDOWN_MS, 0);
+
+    if (!missing_keys.empty()) {
+        std::ostringstream oss;
+        oss << "Missing required config values:";
+        for (const auto& key : missing_keys) {
+            oss << ' ' << key;
+        }
+        oss << "\n";
+        say_error(oss.str());
+        return false;
+    }
+
+    if (!invalid_keys.empty()) {
+        std::ostringstream oss;
+        oss << "Invalid config values:";
+        for (const auto& key : invalid_keys) {
+            oss << ' ' << key;
+        }
+        oss << "\n";
+        say_error(oss.str());
+        return false;
+    }
+
+    if (KNOWLEDGE_BASE_IDS.empty() && RETRIEVAL_INDEX.empty()) {
+        say_error("Warning: analysis.knowledge_base_ids is not set; knowledge base lookups will be skipped.\n");
+    }
+
+    return true;
+}
+
+// =======================
+// Trigger matching
+// =======================
+
+// Decodes UTF-8 into code points; invalid bytes are passed through as Latin-1.
+std::u32string decode_utf8(const std::string& text) {
+    std::u32string out;
+    out.reserve(text.size());
+    for (size_t i = 0; i < text.size();) {
+        const unsigned char c = static_cast<unsigned char>(text[i]);
+        size_t length = c < 0x80 ? 1 : (c >> 5) == 0x6 ? 2 : (c >> 4) == 0xE ? 3 : (c >> 3) == 0x1E ? 4 : 0;
+        if (length == 0 || i + length > text.size()) {
+            out.push_back(c);
+            ++i;
+            continue;
+        }
+        char32_t cp = length == 1 ? c : c & (0x7F >> length);
+        bool valid = true;
+        for (size_t k = 1; k < length; ++k) {
+            const unsigned char cc = static_cast<unsigned char>(text[i + k]);
+            if ((cc & 0xC0) != 0x80) {
+                valid = false;
+                break;
+            }
+            cp = (cp << 6) | (cc & 0x3F);
+        }
+        if (!valid) {
+            out.push_back(c);
+            ++i;
+            continue;
+        }
+        out.push_back(cp);
+        i += length;
+    }
+    return out;
+}
+
+// Simple case folding for the Latin, Greek and Cyrillic scripts, which covers the
+// languages Whisper is used with here.
+char32_t fold_case(char32_t c) {
+    if (c >= U'A' && c <= U'Z') return c + 32;
+    if (c < 0x80) return c;
+    if ((c >= 0xC0 && c <= 0xDE && c != 0xD7)) return c + 32;                  // Latin-1
+    if (c == 0x178) return 0xFF;                                               // Y with diaeresis
+    if (c >= 0x100 && c <= 0x17F && c != 0x130 && c != 0x138 && c != 0x149) {  // Latin Extended-A
+        const bool odd_upper = (c >= 0x139 && c <= 0x148) || (c >= 0x179 && c <= 0x17E);
+        if (odd_upper) return (c % 2 == 1) ? c + 1 : c;
+        return (c % 2 == 0) ? c + 1 : c;
+    }
+    if (c >= 0x391 && c <= 0x3AB && c != 0x3A2) return c + 32;               // Greek
+    if (c >= 0x410 && c <= 0x42F) return c + 32;                              // Cyrillic
+    if (c >= 0x400 && c <= 0x40F) return c + 80;
+    return c;
+}
+
+bool is_word_char(char32_t c) {
+    if (c < 0x80) {
+        return std::isalnum(static_cast<unsigned char>(c)) != 0;
+    }
+    if (c == 0xD7 || c == 0xF7) return false;                   // multiplication/division signs
+    if (c >= 0x2000 && c <= 0x206F) return false;               // general punctuation
+    return c >= 0xC0;
+}
+
+// Splits text into case-folded words, dropping punctuation.
+std::vector<std::u32string> fold_words(const std::string& text) {
+    std::vector<std::u32string> words;
+    std::u32string current;
+    for (char32_t c : decode_utf8(text)) {
+        if (is_word_char(c)) {
+            current.push_back(fold_case(c));
+        } else if (!current.empty()) {
+            words.push_back(std::move(current));
+            current.clear();
+        }
+    }
+    if (!current.empty()) {
+        words.push_back(std::move(current));
+    }
+    return words;
+}
+
+// Function words ignored when comparing texts (English and Italian).
+bool is_stop_word(const std::u32string& word) {
+    static const std::set<std::u32string> words = [] {
+        std::set<std::u32string> folded;
+        for (const char* w : {"the", "and", "was", "were", "with", "for", "that", "this", "are", "has",
+                              "have", "had", "from", "not", "but", "been", "which", "its", "into", "also",
+                              "all", "any", "per", "there", "their", "they", "she", "his", "her", "would",
+                              "should", "could", "will", "can", "than", "then", "did", "does", "about",
+                              "che", "con", "una", "del", "della", "dei", "delle", "gli", "nel", "nella",
+                              "alla", "non", "sono", "come", "anche", "stato", "stata"}) {
+            folded.insert(decode_utf8(w));
+        }
+        return folded;
+    }();
+    return words.count(word) > 0;
+}
+
+// Levenshtein distance between a and b, or limit + 1 once it is known to exceed limit.
+size_t bounded_edit_distance(const std::u32string& a, const std::u32string& b, size_t limit) {
+    const size_t length_gap = a.size() > b.size() ? a.size() - b.size() : b.size() - a.size();
+    if (length_gap > limit) {
+        return limit + 1;
+    }
+    std::vector<size_t> previous(b.size() + 1), current(b.size() + 1);
+    for (size_t j = 0; j <= b.size(); ++j) {
+        previous[j] = j;
+    }
+    for (size_t i = 1; i <= a.size(); ++i) {
+        current[0] = i;
+        size_t row_min = current[0];
+        for (size_t j = 1; j <= b.size(); ++j) {
+            const size_t substitution = previous[j - 1] + (a[i - 1] == b[j - 1] ? 0 : 1);
+            current[j] = std::min({previous[j] + 1, current[j - 1] + 1, substitution});
+            row_min = std::min(row_min, current[j]);
+        }
+        if (row_min > limit) {
+            return limit + 1;
+        }
+        std::swap(previous, current);
+    }
+    return previous[b.size()];
+}
+
+// Multi-pattern matcher for spoken commands, compiled once from the configured
+// trigger phrases into a word trie. Input is consumed as a stream of case-folded
+// words, so a phrase split over two transcript lines still matches, and every
+// word longer than three letters tolerates a bounded edit distance ("star
+// recordings" matches "start recording"); a word shared by several phrases
+// tolerates the smallest distance any of them allows.
+class TriggerMatcher {
+public:
+    explicit TriggerMatcher(size_t max_edits) : max_edits_(max_edits), nodes_(1) {}
+
+    void add(const std::string& command, const std::string& phrase) {
+        add(command, phrase, max_edits_);
+    }
+
+    void add(const std::string& command, const std::string& phrase, size_t max_edits) {
+        const auto words = fold_words(phrase);
+        if (words.empty()) {
+            return;
+        }
+        size_t node = 0;
+        for (const auto& word : words) {
+            size_t next = 0;
+            for (auto& edge : nodes_[node].edges) {
+                if (edge.word == word) {
+                    next = edge.target;
+                    edge.max_edits = std::min(edge.max_edits, max_edits);
+                    break;
+                }
+            }
+            if (next == 0) {
+                next = nodes_.size();
+                const size_t depth = nodes_[node].depth + 1;
+                nodes_[node].edges.push_back(Edge{word, next, max_edits});
+                nodes_.emplace_back();
+                nodes_.back().depth = depth;
+            }
+            node = next;
+        }
+        auto& commands = nodes_[node].commands;
+        if (std::find(commands.begin(), commands.end(), command) == commands.end()) {
+            commands.push_back(command);
+        }
+    }
+
+    // Adds every '|'-separated phrase of a configured trigger.
+    void add_phrases(const std::string& command, const std::string& phrases, size_t max_edits) {
+        std::stringstream stream(phrases);
+        std::string phrase;
+        while (std::getline(stream, phrase, '|')) {
+            add(command, phrase, max_edits);
+        }
+    }
+
+    // Feeds the next transcript line and returns the commands whose phrase ended in it.
+    std::vector<std::string> feed(const std::string& line) {
+        std::vector<std::string> matched;
+        carried_words_ = 0;
+        const auto words = fold_words(line);
+        for (size_t index = 0; index < words.size(); ++index) {
+            const auto& word = words[index];
+            std::vector<size_t> next;
+            auto advance = [&](size_t node) {
+                for (const auto& edge : nodes_[node].edges) {
+                    const size_t allowed = edge.word.size() > 3 ? edge.max_edits : 0;
+                    if (bounded_edit_distance(word, edge.word, allowed) > allowed) {
+                        continue;
+                    }
+                    if (std::find(next.begin(), next.end(), edge.target) == next.end()) {
+                        next.push_back(edge.target);
+                    }
+                    const size_t depth = nodes_[edge.target].depth;
+                    for (const auto& command : nodes_[edge.target].commands) {
+                        if (std::find(matched.begin(), matched.end(), command) == matched.end()) {
+                            matched.push_back(command);
+                        }
+                        carried_words_ = std::max(carried_words_, depth > index + 1 ? depth - index - 1 : 0);
+                    }
+                }
+            };
+            advance(0);
+            for (size_t node : active_) {
+                advance(node);
+            }
+            active_.swap(next);
+        }
+        return matched;
+    }
+
+    // Words of the phrases matched by the last feed() that were spoken at the
+    // end of earlier lines.
+    size_t carried_words() const { return carried_words_; }
+
+private:
+    struct Edge {
+        std::u32string word;
+        size_t target;
+        size_t max_edits;
+    };
+
+    struct Node {
+        std::vector<Edge> edges;
+        std::vector<std::string> commands;
+        size_t depth = 0;  // words of the phrases ending here
+    };
+
+    const size_t max_edits_;
+    std::vector<Node> nodes_;
+    std::vector<size_t> active_;  // trie nodes reached by partial matches so far
+    size_t carried_words_ = 0;
+};
+
+// =======================
+// Transcript normalisation
+// =======================
+
+// What the normaliser removed from one recording's transcript so far.
+struct NormalizationStats {
+    size_t raw_chars = 0;  // as transcribed; 0 when transcript.normalize is off
+    size_t kept_chars = 0;
+    size_t fillers = 0;
+    size_t repeated_words = 0;
+    size_t duplicate_lines = 0;
+    size_t seam_words = 0;
+    size_t numbers = 0;
+    size_t units = 0;
+    size_t trigger_words = 0;
+
+    json to_json() const {
+        return {
+            {"raw_chars", raw_chars},
+            {"kept_chars", kept_chars},
+            {"fillers", fillers},
+            {"repeated_words", repeated_words},
+            {"duplicate_lines", duplicate_lines},
+            {"seam_words", seam_words},
+            {"numbers", numbers},
+            {"units", units},
+            {"trigger_words", trigger_words}
+        };
+    }
+};
+
+// Cleans transcript lines before they are added to a recording, so that every
+// analysis of it sends fewer tokens: whitespace is compacted, fillers and
+// Whisper's [bracketed] non-speech tags are dropped, stuttered words and
+// phrases ("the the", "he was he was") are collapsed, lines repeating one of
+// the last transcript.dedupe_window lines are dropped, and words repeated
+// across the seam with the previous line are cut. Spoken numbers become digits
+// ("one hundred and twenty" -> 120, "four point two" -> 4.2, "one twenty" ->
+// 120) and units after them are abbreviated ("milligrams per kilogram" ->
+// mg/kg). Each step is a [transcript] option. A lone "one" is left alone
+// unless a unit follows, and repeated numbers are never collapsed.
+class TranscriptNormalizer {
+public:
+    TranscriptNormalizer() {
+        for (const auto& filler : split_list(TRANSCRIPT_FILLERS, ',')) {
+            std::u32string key;
+            for (const auto& word : fold_words(filler)) {
+                key += word;
+            }
+            fillers_.insert(key);
+        }
+    }
+
+    // Starts a new recording.
+    void reset() {
+        recent_.clear();
+        last_line_.clear();
+        last_line_kept_ = false;
+        stats_ = {};
+    }
+
+    // The line to add to the transcript, or an empty string to drop it.
+    std::string normalize(const std::string& line) {
+        stats_.raw_chars += line.size() + 1;
+        std::vector<Token> tokens = tokenize(line);
+        remove_fillers(tokens);
+        if (TRANSCRIPT_REMOVE_REPEATS) {
+            remove_repeats(tokens);
+        }
+        if (TRANSCRIPT_NUMBERS) {
+            normalize_numbers(tokens);
+        }
+        std::vector<std::u32string> keys;
+        for (const auto& token : tokens) {
+            keys.push_back(token.key);
+        }
+        if (TRANSCRIPT_DEDUPE_LINES && !keys.empty()) {
+            if (std::find(recent_.begin(), recent_.end(), keys) != recent_.end()) {
+                ++stats_.duplicate_lines;
+                keys.clear();
+                tokens.clear();
+            } else if (!recent_.empty()) {
+                const auto& previous = recent_.back();
+                for (size_t k = std::min(previous.size(), keys.size()); k >= 2; --k) {
+                    if (std::equal(keys.begin(), keys.begin() + static_cast<long>(k), previous.end() - static_cast<long>(k))) {
+                        tokens.erase(tokens.begin(), tokens.begin() + static_cast<long>(k));
+                        keys.erase(keys.begin(), keys.begin() + static_cast<long>(k));
+                        stats_.seam_words += k;
+                        break;
+                    }
+                }
+            }
+        }
+        last_line_kept_ = !tokens.empty();
+        if (!last_line_kept_) {
+            return "";
+        }
+        recent_.push_back(keys);
+        while (recent_.size() > TRANSCRIPT_DEDUPE_WINDOW) {
+            recent_.pop_front();
+        }
+        last_line_ = join(tokens);
+        stats_.kept_chars += last_line_.size() + 1;
+        return last_line_;
+    }
+
+    // The last line added, if the line just normalised was added.
+    const std::string& last_line() const { return last_line_; }
+
+    // Called for a line consumed as a trigger line instead of being normalised:
+    // it was not added, so a phrase begun in it must not cut the line before.
+    void skip_line() { last_line_kept_ = false; }
+
+    // Drops the last words of the line just added, the start of a trigger
+    // phrase finished on the next line. Returns the shortened line, empty when
+    // nothing is left of it, or nothing when that line was not added.
+    std::optional<std::string> drop_trailing_words(size_t words) {
+        if (!last_line_kept_ || words == 0) {
+            return std::nullopt;
+        }
+        std::vector<Token> tokens = tokenize(last_line_);
+        words = std::min(words, tokens.size());
+        tokens.resize(tokens.size() - words);
+        stats_.trigger_words += words;
+        stats_.kept_chars -= last_line_.size() + 1;
+        last_line_ = join(tokens);
+        if (tokens.empty()) {
+            recent_.pop_back();
+            last_line_kept_ = false;
+        } else {
+            recent_.back().clear();
+            for (const auto& token : tokens) {
+                recent_.back().push_back(token.key);
+            }
+            stats_.kept_chars += last_line_.size() + 1;
+        }
+        return last_line_;
+    }
+
+    const NormalizationStats& stats() const { return stats_; }
+
+private:
+    struct Token {
+        std::string lead;   // punctuation before the word
+        std::string core;
+        std::string trail;  // punctuation after it
+        std::u32string key; // case-folded letters and digits, for comparisons
+        bool attach = false; // written without a space after the previous token ("/kg", "%")
+        bool unit = false;
+    };
+
+    static std::u32string key_of(const std::string& text) {
+        std::u32string key;
+        for (const auto& word : fold_words(text)) {
+            key += word;
+        }
+        return key;
+    }
+
+    static bool is_punctuation(char c) {
+        return static_cast<unsigned char>(c) < 0x80 && !std::isalnum(static_cast<unsigned char>(c));
+    }
+
+    static std::vector<Token> tokenize(const std::string& line) {
+        std::vector<Token> tokens;
+        std::istringstream stream(line);
+        std::string word;
+        while (stream >> word) {
+            Token token;
+            size_t first = 0;
+            size_t last = word.size();
+            while (first < last && is_punctuation(word[first])) {
+                ++first;
+            }
+            while (last > first && is_punctuation(word[last - 1])) {
+                --last;
+            }
+            token.lead = word.substr(0, first);
+            token.core = word.substr(first, last - first);
+            token.trail = word.substr(last);
+            token.key = key_of(token.core);
+            tokens.push_back(std::move(token));
+        }
+        return tokens;
+    }
+
+    static std::string join(const std::vector<Token>& tokens) {
+        std::string line;
+        for (const auto& token : tokens) {
+            if (!line.empty() && !token.attach) {
+                line += ' ';
+            }
+            line += token.lead + token.core + token.trail;
+        }
+        return line;
+    }
+
+    void remove_fillers(std::vector<Token>& tokens) {
+        std::vector<Token> kept;
+        for (size_t i = 0; i < tokens.size(); ++i) {
+            if (tokens[i].lead.find('[') != std::string::npos) {
+                size_t end = i;
+                while (end < tokens.size() && tokens[end].trail.find(']') == std::string::npos) {
+                    ++end;
+                }
+                if (end < tokens.size()) {
+                    ++stats_.fillers;
+                    i = end;
+                    continue;
+                }
+            }
+            if (!tokens[i].key.empty() && fillers_.count(tokens[i].key)) {
+                ++stats_.fillers;
+                continue;
+            }
+            kept.push_back(std::move(tokens[i]));
+        }
+        tokens.swap(kept);
+    }
+
+    static bool is_numeric(const Token& token) {
+        return std::any_of(token.core.begin(), token.core.end(), [](char c) { return std::isdigit(static_cast<unsigned char>(c)); }) ||
+               number_value(token.key) >= 0 || token.key == U"hundred" || token.key == U"thousand";
+    }
+
+    // Collapses a word or phrase of up to three words said twice in a row,
+    // keeping the second one.
+    void remove_repeats(std::vector<Token>& tokens) {
+        for (size_t n = 3; n >= 1; --n) {
+            for (size_t i = 0; i + 2 * n <= tokens.size();) {
+                bool repeated = true;
+                for (size_t k = 0; k < n && repeated; ++k) {
+                    const Token& first = tokens[i + k];
+                    repeated = !first.key.empty() && first.key == tokens[i + n + k].key && !is_numeric(first) &&
+                               first.trail.find_first_of(".!?") == std::string::npos;
+                }
+                if (repeated) {
+                    tokens.erase(tokens.begin() + static_cast<long>(i), tokens.begin() + static_cast<long>(i + n));
+                    stats_.repeated_words += n;
+                } else {
+                    ++i;
+                }
+            }
+        }
+    }
+
+    // 0-19 and the tens as numbers, anything else as -1.
+    static int number_value(const std::u32string& key) {
+        static const std::map<std::u32string, int> values = [] {
+            std::map<std::u32string, int> map;
+            const char* small[] = {"zero", "one", "two", "three", "four", "five", "six", "seven", "eight", "nine",
+                                   "ten", "eleven", "twelve", "thirteen", "fourteen", "fifteen", "sixteen",
+                                   "seventeen", "eighteen", "nineteen"};
+            for (int i = 0; i < 20; ++i) {
+                map[decode_utf8(small[i])] = i;
+            }
+            const char* tens[] = {"twenty", "thirty", "forty", "fifty", "sixty", "seventy", "eighty", "ninety"};
+            for (int i = 0; i < 8; ++i) {
+                map[decode_utf8(tens[i])] = 20 + 10 * i;
+            }
+            return map;
+        }();
+        const auto it = values.find(key);
+        return it == values.end() ? -1 : it->second;
+    }
+
+    // Reads spoken number words from tokens[i]; returns how many were used
+    // and their value as text, or 0.
+    static size_t parse_number(const std::vector<Token>& tokens, size_t i, std::string& text) {
+        enum class Last { None, Digit, Teen, Tens, Hundred, Thousand } last = Last::None;
+        long total = 0;
+        long group = 0;
+        size_t end = i;
+        for (size_t j = i; j < tokens.size(); ++j) {
+            const Token& token = tokens[j];
+            if (j > i && (!tokens[j - 1].trail.empty() || !token.lead.empty())) {
+                break;  // punctuation ends the number
+            }
+            const int value = number_value(token.key);
+            if (token.key == U"and" && (last == Last::Hundred || last == Last::Thousand)) {
+                continue;
+            }
+            if (value >= 0 && value < 10) {
+                if (last == Last::Digit || last == Last::Teen) {
+                    break;
+                }
+                group += value;
+                last = Last::Digit;
+            } else if (value >= 10) {
+                if (last == Last::Digit && j == i + 1) {
+                    group = group * 100 + value;  // "one twenty", as blood pressures are read
+                } else if (last == Last::None || last == Last::Hundred || last == Last::Thousand) {
+                    group += value;
+                } else {
+                    break;
+                }
+                last = value < 20 ? Last::Teen : Last::Tens;
+            } else if (token.key == U"hundred" && last != Last::None && group > 0 && group < 100) {
+                group *= 100;
+                last = Last::Hundred;
+            } else if (token.key == U"thousand" && last != Last::None && last != Last::Thousand && group > 0) {
+                total += group * 1000;
+                group = 0;
+                last = Last::Thousand;
+            } else {
+                break;
+            }
+            end = j + 1;
+        }
+        if (end == i) {
+            return 0;
+        }
+        text = std::to_string(total + group);
+        if (end + 1 < tokens.size() && tokens[end - 1].trail.empty() && tokens[end].key == U"point" &&
+            tokens[end].lead.empty() && tokens[end].trail.empty()) {
+            std::string decimals;
+            size_t k = end + 1;
+            while (k < tokens.size() && tokens[k].lead.empty()) {
+                const int digit = number_value(tokens[k].key);
+                if (digit < 0 || digit > 9) {
+                    break;
+                }
+                decimals += static_cast<char>('0' + digit);
+                if (!tokens[k++].trail.empty()) {
+                    break;
+                }
+            }
+            if (!decimals.empty()) {
+                text += "." + decimals;
+                end = k;
+            }
+        }
+        if (end == i + 1 && tokens[i].key == U"one" && tokens[i].trail.empty()) {
+            // More often a pronoun than a quantity, unless a unit follows.
+            Token digit;
+            digit.core = "1";
+            Token unit;
+            if (end >= tokens.size() || parse_unit(tokens, end, digit, unit) == 0) {
+                return 0;
+            }
+        } else if (end == i + 1 && tokens[i].key == U"one") {
+            return 0;
+        }
+        return end - i;
+    }
+
+    // Abbreviates the unit spoken at tokens[i] after a number; returns how
+    // many tokens it used, or 0.
+    static size_t parse_unit(const std::vector<Token>& tokens, size_t i, const Token& previous, Token& unit) {
+        static const std::vector<std::pair<std::vector<std::u32string>, std::string>> units = [] {
+            const std::pair<const char*, const char*> table[] = {
+                {"beats per minute", "bpm"}, {"breaths per minute", "breaths/min"},
+                {"millimeters of mercury", "mmHg"}, {"millimetres of mercury", "mmHg"},
+                {"degrees celsius", "°C"}, {"degrees centigrade", "°C"}, {"degrees fahrenheit", "°F"},
+                {"per cent", "%"}, {"percent", "%"}, {"per hour", "/h"}, {"per minute", "/min"},
+                {"per kilogram", "/kg"}, {"per kilo", "/kg"}, {"per kg", "/kg"},
+                {"milligrams", "mg"}, {"milligram", "mg"}, {"micrograms", "mcg"}, {"microgram", "mcg"},
+                {"grams", "g"}, {"gram", "g"}, {"kilograms", "kg"}, {"kilogram", "kg"}, {"kilos", "kg"},
+                {"milliliters", "ml"}, {"millilitres", "ml"}, {"milliliter", "ml"}, {"millilitre", "ml"},
+                {"liters", "l"}, {"litres", "l"}, {"liter", "l"}, {"litre", "l"},
+                {"milliequivalents", "mEq"}, {"millimoles", "mmol"}};
+            std::vector<std::pair<std::vector<std::u32string>, std::string>> parsed;
+            for (const auto& [words, abbreviation] : table) {
+                parsed.emplace_back(fold_words(words), abbreviation);
+            }
+            return parsed;
+        }();
+        const bool after_number = !previous.core.empty() && std::isdigit(static_cast<unsigned char>(previous.core.back()));
+        for (const auto& [words, abbreviation] : units) {
+            const bool per = abbreviation[0] == '/';
+            if (i + words.size() > tokens.size() || !(after_number || (per && previous.unit))) {
+                continue;
+            }
+            bool match = true;
+            for (size_t k = 0; k < words.size() && match; ++k) {
+                const Token& token = tokens[i + k];
+                match = token.key == words[k] && (k == 0 || token.lead.empty()) &&
+                        (k + 1 == words.size() || token.trail.empty());
+            }
+            if (match) {
+                unit.lead = tokens[i].lead;
+                unit.core = abbreviation;
+                unit.trail = tokens[i + words.size() - 1].trail;
+                unit.key = key_of(abbreviation);
+                unit.attach = per || abbreviation == "%";
+                unit.unit = true;
+                return words.size();
+            }
+        }
+        return 0;
+    }
+
+    void normalize_numbers(std::vector<Token>& tokens) {
+        std::vector<Token> out;
+        for (size_t i = 0; i < tokens.size();) {
+            std::string text;
+            if (const size_t used = parse_number(tokens, i, text)) {
+                Token number;
+                number.lead = tokens[i].lead;
+                number.core = text;
+                number.trail = tokens[i + used - 1].trail;
+                number.key = key_of(text);
+                out.push_back(std::move(number));
+                ++stats_.numbers;
+                i += used;
+                continue;
+            }
+            Token unit;
+            if (!out.empty() && out.back().trail.empty()) {
+                if (const size_t used = parse_unit(tokens, i, out.back(), unit)) {
+                    out.push_back(std::move(unit));
+                    ++stats_.units;
+                    i += used;
+                    continue;
+                }
+            }
+            out.push_back(std::move(tokens[i++]));
+        }
+        tokens.swap(out);
+    }
+
+    std::set<std::u32string> fillers_;
+    std::deque<std::vector<std::u32string>> recent_;  // keys of the last lines added
+    std::string last_line_;
+    bool last_line_kept_ = false;
+    NormalizationStats stats_;
+};
+
+// =======================
+// Transcript buffer
+// =======================
+
+// Immutable view of a transcript at one point in time. Copies share the
+// underlying segments, so handing a snapshot to an analysis costs O(segments).
+class TranscriptSnapshot {
+public:
+    using Segment = std::shared_ptr<const std::string>;
+
+    TranscriptSnapshot() = default;
+    TranscriptSnapshot(std::vector<Segment> segments, size_t size, int recording = 0)
+        : segments_(std::move(segments)), size_(size), recording_(recording) {}
+
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+    // The recording the text belongs to, 0 when none was running.
+    int recording() const { return recording_; }
+
+    // Copies the text from pos to the end into one string.
+    std::string substr(size_t pos = 0) const {
+        std::string out;
+        if (pos >= size_) {
+            return out;
+        }
+        out.reserve(size_ - pos);
+        size_t offset = 0;
+        for (const auto& segment : segments_) {
+            const size_t end = offset + segment->size();
+            if (end > pos) {
+                const size_t from = pos > offset ? pos - offset : 0;
+                out.append(*segment, from, std::string::npos);
+            }
+            offset = end;
+        }
+        return out;
+    }
+
+    std::string str() const { return substr(0); }
+
+    friend std::ostream& operator<<(std::ostream& out, const TranscriptSnapshot& snapshot) {
+        for (const auto& segment : snapshot.segments_) {
+            out << *segment;
+        }
+        return out;
+    }
+
+private:
+    std::vector<Segment> segments_;
+    size_t size_ = 0;
+    int recording_ = 0;
+};
+
+// Append-only transcript of the running recording. Lines are appended to a
+// private tail that is sealed into an immutable, reference-counted segment when
+// it grows past SEGMENT_SIZE or when a snapshot is taken. A short tail is merged
+// with a short last segment, so frequent snapshots do not leave one segment per line.
+class TranscriptBuffer {
+public:
+    static constexpr size_t SEGMENT_SIZE = 16 * 1024;
+
+    void append_line(const std::string& line) {
+        tail_ += line;
+        tail_ += '\n';
+        size_ += line.size() + 1;
+        if (tail_.size() >= SEGMENT_SIZE) {
+            seal();
+        }
+    }
+
+    TranscriptSnapshot snapshot() {
+        seal();
+        return TranscriptSnapshot(segments_, size_, recording_);
+    }
+
+    // Empties the buffer for the next lines of recording (0 while none is running).
+    void clear(int recording = 0) {
+        segments_.clear();
+        tail_.clear();
+        size_ = 0;
+        recording_ = recording;
+    }
+
+    // Cuts the transcript back to size chars. Snapshots taken before keep their text.
+    void truncate(size_t size) {
+        seal();
+        while (size_ > size && !segments_.empty()) {
+            const size_t last = segments_.back()->size();
+            if (size_ - last >= size) {
+                segments_.pop_back();
+                size_ -= last;
+            } else {
+                tail_ = segments_.back()->substr(0, last - (size_ - size));
+                segments_.pop_back();
+                size_ = size;
+            }
+        }
+    }
+
+    size_t size() const { return size_; }
+
+private:
+    void seal() {
+        if (tail_.empty()) {
+            return;
+        }
+        // Segments are exact-size copies; tail_ keeps its buffer for the next lines.
+        // Snapshots holding the replaced last segment keep their own reference to it.
+        if (!segments_.empty() && segments_.back()->size() + tail_.size() <= SEGMENT_SIZE) {
+            std::string merged;
+            merged.reserve(segments_.back()->size() + tail_.size());
+            merged += *segments_.back();
+            merged += tail_;
+            segments_.back() = std::make_shared<const std::string>(std::move(merged));
+        } else {
+            segments_.push_back(std::make_shared<const std::string>(tail_));
+        }
+        tail_.clear();
+    }
+
+    std::vector<TranscriptSnapshot::Segment> segments_;
+    std::string tail_;
+    size_t size_ = 0;
+    int recording_ = 0;
+};
+
+// Safely extract a textual message content from an OpenAI-style response
+std::string extract_message_content(const json& response) {
+    const auto choices_it = response.find("choices");
+    if (choices_it == response.end() || !choices_it->is_array() || choices_it->empty()) {
+        return {};
+    }
+
+    const auto& first_choice = (*choices_it)[0];
+    if (!first_choice.is_object()) {
+        return {};
+    }
+
+    const auto message_it = first_choice.find("message");
+    if (message_it == first_choice.end() || !message_it->is_object()) {
+        return {};
+    }
+
+    const auto content_it = message_it->find("content");
+    if (content_it == message_it->end()) {
+        return {};
+    }
+
+    if (content_it->is_string()) {
+        return content_it->get<std::string>();
+    }
+
+    if (content_it->is_array()) {
+        std::string combined;
+        for (const auto& part : *content_it) {
+            if (!combined.empty()) {
+                combined.push_back('\n');
+            }
+            combined += part.is_string() ? part.get<std::string>() : part.dump();
+        }
+        return combined;
+    }
+
+    return {};
+}
+
+// Where the time of one HTTP request went, from libcurl's transfer info.
+struct RequestTiming {
+    double dns_ms = 0.0;
+    double connect_ms = 0.0;   // TCP handshake
+    double tls_ms = 0.0;       // TLS handshake, 0 for plain HTTP
+    double server_ms = 0.0;    // request sent until first response byte
+    double transfer_ms = 0.0;  // first byte until the response was complete
+    bool reused_connection = false;
+    long http_version = 0;
+    bool in_process = false;   // answered by the local model; only server and transfer apply
+};
+
+// Result of one chat completion request, streamed or not.
+struct ChatResult {
+    std::string content;
+    json payload;            // full response, or the last SSE chunk when streaming
+    json usage;              // token usage reported by the server, if any
+    double first_token_ms = -1.0;
+    double total_ms = 0.0;
+    RequestTiming timing;      // of the attempt that produced the answer
+    std::string backend;       // backend that produced the answer
+    std::string model;
+    size_t attempts = 0;       // requests sent, including hedges and failovers
+    bool hedged = false;
+    bool cached = false;       // answered from the response cache
+};
+
+using DeltaCallback = std::function<void(const std::string&)>;
+
+std::string chat_completions_url(const std::string& base_url) {
+    std::string url = base_url;
+    while (!url.empty() && url.back() == '/') {
+        url.pop_back();
+    }
+    return url + "/chat/completions";
+}
+
+// Splits a text/event-stream body into events and hands each event's data to a callback.
+class SseParser {
+public:
+    explicit SseParser(std::function<void(const std::string&)> on_event)
+        : on_event_(std::move(on_event)) {}
+
+    void feed(const char* data, size_t size) {
+        buffer_.append(data, size);
+        size_t start = 0;
+        for (size_t nl = buffer_.find('\n', start); nl != std::string::npos; nl = buffer_.find('\n', start)) {
+            std::string line = buffer_.substr(start, nl - start);
+            start = nl + 1;
+            if (!line.empty() && line.back() == '\r') {
+                line.pop_back();
+            }
+            handle_line(line);
+        }
+        buffer_.erase(0, start);
+    }
+
+    void finish() {
+        if (!buffer_.empty()) {
+            handle_line(buffer_);
+            buffer_.clear();
+        }
+        dispatch();
+    }
+
+private:
+    void handle_line(const std::string& line) {
+        if (line.empty()) {
+            dispatch();
+            return;
+        }
+        if (line.compare(0, 5, "data:") != 0) {
+            return; // comments, event names and ids are not used by chat completions
+        }
+        size_t value_start = 5;
+        if (value_start < line.size() && line[value_start] == ' ') {
+            ++value_start;
+        }
+        if (!data_.empty()) {
+            data_.push_back('\n');
+        }
+        data_.append(line, value_start, std::string::npos);
+        has_data_ = true;
+    }
+
+    void dispatch() {
+        if (has_data_) {
+            on_event_(data_);
+        }
+        data_.clear();
+        has_data_ = false;
+    }
+
+    std::function<void(const std::string&)> on_event_;
+    std::string buffer_;
+    std::string data_;
+    bool has_data_ = false;
+};
+
+// Extracts the incremental text of a streamed chat completion chunk.
+std::string extract_delta_content(const json& chunk) {
+    const auto choices_it = chunk.find("choices");
+    if (choices_it == chunk.end() || !choices_it->is_array() || choices_it->empty()) {
+        return {};
+    }
+    const auto& first_choice = (*choices_it)[0];
+    if (!first_choice.is_object()) {
+        return {};
+    }
+    const auto delta_it = first_choice.find("delta");
+    if (delta_it == first_choice.end() || !delta_it->is_object()) {
+        return {};
+    }
+    const auto content_it = delta_it->find("content");
+    if (content_it == delta_it->end() || !content_it->is_string()) {
+        return {};
+    }
+    return content_it->get<std::string>();
+}
+
+// Single-threaded HTTP engine on top of curl_multi. One event-loop thread drives
+// every outstanding transfer, so concurrent requests cost sockets rather than
+// threads. Connections are kept alive in the multi handle's shared cache and
+// HTTP/2 streams are multiplexed over one connection where the server supports it.
+// Callbacks and timers run on the event-loop thread and must not block.
+class HttpEngine {
+public:
+    using Clock = std::chrono::steady_clock;
+    using RequestId = uint64_t;
+    using DataCallback = std::function<void(const char*, size_t)>;
+
+    struct Request {
+        std::string url;
+        std::vector<std::string> headers;
+        std::string body;     // POSTed when not empty
+        long timeout_ms = 0;  // whole transfer, 0 for no limit
+    };
+
+    struct Response {
+        CURLcode code = CURLE_OK;
+        long status = 0;
+        std::string body;  // whole body, or only its first bytes when a data callback was given
+        RequestTiming timing;
+    };
+
+    using DoneCallback = std::function<void(Response&&)>;
+
+    HttpEngine() : multi_(curl_multi_init()) {
+        if (!multi_) {
+            throw std::runtime_error("curl_multi_init failed");
+        }
+        curl_multi_setopt(multi_, CURLMOPT_PIPELINING, static_cast<long>(CURLPIPE_MULTIPLEX));
+        curl_multi_setopt(multi_, CURLMOPT_MAX_HOST_CONNECTIONS, static_cast<long>(HTTP_MAX_HOST_CONNECTIONS));
+        loop_ = std::thread(&HttpEngine::run, this);
+    }
+
+    ~HttpEngine() {
+        shutdown();
+        for (CURL* easy : idle_handles_) {
+            curl_easy_cleanup(easy);
+        }
+        curl_multi_cleanup(multi_);
+    }
+
+    HttpEngine(const HttpEngine&) = delete;
+    HttpEngine& operator=(const HttpEngine&) = delete;
+
+    // Queues a request; on_done is always called exactly once. Thread-safe.
+    RequestId submit(Request request, DataCallback on_data, DoneCallback on_done) {
+        auto transfer = std::make_unique<Transfer>();
+        transfer->request = std::move(request);
+        transfer->on_data = std::move(on_data);
+        transfer->on_done = std::move(on_done);
+        RequestId id = 0;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (stopping_) {
+                Response refused;
+                refused.code = CURLE_ABORTED_BY_CALLBACK;
+                transfer->on_done(std::move(refused));
+                return 0;
+            }
+            id = ++last_id_;
+            transfer->id = id;
+            pending_.push_back(std::move(transfer));
+            ++submitted_;
+        }
+        curl_multi_wakeup(multi_);
+        return id;
+    }
+
+    // Aborts a submitted transfer; its on_done sees CURLE_ABORTED_BY_CALLBACK.
+    // Unknown or already finished requests are ignored. Thread-safe.
+    void cancel(RequestId id) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            cancelled_ids_.push_back(id);
+        }
+        curl_multi_wakeup(multi_);
+    }
+
+    // Runs fn on the event-loop thread after delay. Timers still pending when the
+    // engine shuts down are dropped. Thread-safe.
+    void schedule(std::chrono::milliseconds delay, std::function<void()> fn) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            timers_.emplace(Clock::now() + delay, std::move(fn));
+        }
+        curl_multi_wakeup(multi_);
+    }
+
+    // Lets outstanding transfers finish, then stops the event loop.
+    void shutdown() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (stopping_) {
+                return;
+            }
+            stopping_ = true;
+        }
+        curl_multi_wakeup(multi_);
+        if (loop_.joinable()) {
+            loop_.join();
+        }
+    }
+
+    std::string stats() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::ostringstream oss;
+        oss << "[http] submitted=" << submitted_
+            << " failed=" << failed_
+            << " cancelled=" << cancelled_
+            << " in_flight=" << in_flight_
+            << " max_in_flight=" << max_in_flight_
+            << " new_connections=" << new_connections_ << "\n";
+        return oss.str();
+    }
+
+private:
+    struct Transfer {
+        RequestId id = 0;
+        Request request;
+        DataCallback on_data;
+        DoneCallback on_done;
+        CURL* easy = nullptr;
+        struct curl_slist* headers = nullptr;
+        Response response;
+    };
+
+    static constexpr size_t STREAM_BODY_LIMIT = 4096;
+
+    static size_t write_callback(char* ptr, size_t size, size_t nmemb, void* userdata) {
+        auto* transfer = static_cast<Transfer*>(userdata);
+        const size_t total = size * nmemb;
+        std::string& body = transfer->response.body;
+        if (!transfer->on_data) {
+            body.append(ptr, total);
+        } else {
+            if (body.size() < STREAM_BODY_LIMIT) {
+                body.append(ptr, std::min(total, STREAM_BODY_LIMIT - body.size()));
+            }
+            transfer->on_data(ptr, total);
+        }
+        return total;
+    }
+
+    CURL* acquire_handle() {
+        if (!idle_handles_.empty()) {
+            CURL* easy = idle_handles_.back();
+            idle_handles_.pop_back();
+            curl_easy_reset(easy);
+            return easy;
+        }
+        return curl_easy_init();
+    }
+
+    void start(std::unique_ptr<Transfer> transfer) {
+        CURL* easy = acquire_handle();
+        if (!easy) {
+            transfer->response.code = CURLE_FAILED_INIT;
+            transfer->on_done(std::move(transfer->response));
+            return;
+        }
+        transfer->easy = easy;
+        for (const auto& header : transfer->request.headers) {
+            transfer->headers = curl_slist_append(transfer->headers, header.c_str());
+        }
+        curl_easy_setopt(easy, CURLOPT_URL, transfer->request.url.c_str());
+        curl_easy_setopt(easy, CURLOPT_HTTPHEADER, transfer->headers);
+        if (!transfer->request.body.empty()) {
+            curl_easy_setopt(easy, CURLOPT_POSTFIELDS, transfer->request.body.c_str());
+            curl_easy_setopt(easy, CURLOPT_POSTFIELDSIZE, static_cast<long>(transfer->request.body.size()));
+        }
+        curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, &HttpEngine::write_callback);
+        curl_easy_setopt(easy, CURLOPT_WRITEDATA, transfer.get());
+        curl_easy_setopt(easy, CURLOPT_PRIVATE, transfer.get());
+        curl_easy_setopt(easy, CURLOPT_NOSIGNAL, 1L);
+        curl_easy_setopt(easy, CURLOPT_HTTP_VERSION, static_cast<long>(CURL_HTTP_VERSION_2TLS));
+        curl_easy_setopt(easy, CURLOPT_PIPEWAIT, 1L);
+        curl_easy_setopt(easy, CURLOPT_TCP_KEEPALIVE, 1L);
+        curl_easy_setopt(easy, CURLOPT_TCP_KEEPIDLE, 30L);
+        curl_easy_setopt(easy, CURLOPT_TCP_KEEPINTVL, 15L);
+        if (transfer->request.timeout_ms > 0) {
+            curl_easy_setopt(easy, CURLOPT_TIMEOUT_MS, transfer->request.timeout_ms);
+        }
+        curl_multi_add_handle(multi_, easy);
+        active_.emplace(easy, std::move(transfer));
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        ++in_flight_;
+        max_in_flight_ = std::max(max_in_flight_, in_flight_);
+    }
+
+    void finish(CURL* easy, CURLcode code) {
+        auto it = active_.find(easy);
+        if (it == active_.end()) {
+            return;
+        }
+        std::unique_ptr<Transfer> transfer = std::move(it->second);
+        active_.erase(it);
+        curl_multi_remove_handle(multi_, easy);
+
+        transfer->response.code = code;
+        curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE, &transfer->response.status);
+        transfer->response.timing = read_timing(easy);
+        curl_slist_free_all(transfer->headers);
+        idle_handles_.push_back(easy);
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            --in_flight_;
+            if (code == CURLE_ABORTED_BY_CALLBACK) {
+                ++cancelled_;
+            } else if (code != CURLE_OK || transfer->response.status >= 400) {
+                ++failed_;
+            }
+            if (!transfer->response.timing.reused_connection) {
+                ++new_connections_;
+            }
+        }
+        transfer->on_done(std::move(transfer->response));
+    }
+
+    static RequestTiming read_timing(CURL* easy) {
+        curl_off_t namelookup = 0, connect = 0, appconnect = 0, pretransfer = 0, starttransfer = 0, total = 0;
+        curl_easy_getinfo(easy, CURLINFO_NAMELOOKUP_TIME_T, &namelookup);
+        curl_easy_getinfo(easy, CURLINFO_CONNECT_TIME_T, &connect);
+        curl_easy_getinfo(easy, CURLINFO_APPCONNECT_TIME_T, &appconnect);
+        curl_easy_getinfo(easy, CURLINFO_PRETRANSFER_TIME_T, &pretransfer);
+        curl_easy_getinfo(easy, CURLINFO_STARTTRANSFER_TIME_T, &starttransfer);
+        curl_easy_getinfo(easy, CURLINFO_TOTAL_TIME_T, &total);
+        long new_connections = 0;
+        curl_easy_getinfo(easy, CURLINFO_NUM_CONNECTS, &new_connections);
+
+        // libcurl reports cumulative microseconds since the start of the transfer.
+        auto ms = [](curl_off_t us) { return static_cast<double>(us) / 1000.0; };
+        RequestTiming timing;
+        timing.dns_ms = ms(namelookup);
+        timing.connect_ms = connect > namelookup ? ms(connect - namelookup) : 0.0;
+        timing.tls_ms = appconnect > connect ? ms(appconnect - connect) : 0.0;
+        timing.server_ms = starttransfer > pretransfer ? ms(starttransfer - pretransfer) : 0.0;
+        timing.transfer_ms = total > starttransfer ? ms(total - starttransfer) : 0.0;
+        timing.reused_connection = new_connections == 0;
+        curl_easy_getinfo(easy, CURLINFO_HTTP_VERSION, &timing.http_version);
+        return timing;
+    }
+
+    void cancel_active(RequestId id) {
+        for (const auto& [easy, transfer] : active_) {
+            if (transfer->id == id) {
+                finish(easy, CURLE_ABORTED_BY_CALLBACK);
+                return;
+            }
+        }
+    }
+
+    void run_due_timers() {
+        std::vector<std::function<void()>> due;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            const auto now = Clock::now();
+            while (!timers_.empty() && timers_.begin()->first <= now) {
+                due.push_back(std::move(timers_.begin()->second));
+                timers_.erase(timers_.begin());
+            }
+        }
+        for (auto& fn : due) {
+            fn();
+        }
+    }
+
+    int poll_timeout_ms() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (timers_.empty()) {
+            return 1000;
+        }
+        const auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(timers_.begin()->first - Clock::now());
+        return static_cast<int>(std::clamp<long long>(wait.count() + 1, 0, 1000));
+    }
+
+    void run() {
+        for (;;) {
+            run_due_timers();
+
+            std::vector<std::unique_ptr<Transfer>> starting;
+            std::vector<RequestId> cancelling;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                starting.swap(pending_);
+                cancelling.swap(cancelled_ids_);
+                if (stopping_ && starting.empty() && active_.empty()) {
+                    return;
+                }
+            }
+            for (auto& transfer : starting) {
+                start(std::move(transfer));
+            }
+            for (RequestId id : cancelling) {
+                cancel_active(id);
+            }
+
+            int running = 0;
+            curl_multi_perform(multi_, &running);
+
+            int queued_messages = 0;
+            while (CURLMsg* message = curl_multi_info_read(multi_, &queued_messages)) {
+                if (message->msg == CURLMSG_DONE) {
+                    finish(message->easy_handle, message->data.result);
+                }
+            }
+
+            curl_multi_poll(multi_, nullptr, 0, poll_timeout_ms(), nullptr);
+        }
+    }
+
+    CURLM* multi_;
+    std::thread loop_;
+    mutable std::mutex mutex_;
+    std::vector<std::unique_ptr<Transfer>> pending_;
+    std::vector<RequestId> cancelled_ids_;
+    std::multimap<Clock::time_point, std::function<void()>> timers_;
+    bool stopping_ = false;
+    RequestId last_id_ = 0;
+
+    // Owned by the event-loop thread.
+    std::map<CURL*, std::unique_ptr<Transfer>> active_;
+    std::vector<CURL*> idle_handles_;
+
+    size_t submitted_ = 0;
+    size_t failed_ = 0;
+    size_t cancelled_ = 0;
+    size_t in_flight_ = 0;
+    size_t max_in_flight_ = 0;
+    size_t new_connections_ = 0;
+};
+
+// =======================
+// In-process LLM
+// =======================
+
+#ifdef WITH_LLAMA
+// Runs the GGUF model of local_llm.model_path on the CPU through llama.cpp, as
+// the backend "local". It takes the same chat completion bodies as the HTTP
+// backends and answers like one, with SSE chunks when streaming, so LlmClient
+// treats it as just another endpoint. One worker thread decodes all requests
+// with continuous batching: every llama_decode() carries the next token of each
+// request that is generating plus prompt tokens of newly admitted ones, so a
+// new analysis starts without waiting for the others to finish. Each of the
+// local_llm.slots requests runs in its own KV sequence, which keeps its tokens
+// after the request ends; a new prompt reuses the longest prefix found in any
+// sequence (copied when it is another one), or waits for a request admitted
+// before it to decode their common prefix, so the static instructions are
+// decoded once rather than on every request. When the cache runs out of room,
+// idle sequences are evicted least recently used first, and a request that
+// does not fit next to the running ones waits for them. Callbacks run on the
+// engine thread, like those of HttpEngine. response_format is not enforced.
+class LocalLlm {
+public:
+    using Clock = std::chrono::steady_clock;
+    using RequestId = HttpEngine::RequestId;
+
+    // Loads the model; throws std::runtime_error when it cannot.
+    LocalLlm(HttpEngine& engine, const std::string& model_path) : engine_(engine) {
+        llama_backend_init();
+        llama_model_params model_params = llama_model_default_params();
+        model_params.n_gpu_layers = 0;
+        model_ = llama_model_load_from_file(model_path.c_str(), model_params);
+        if (!model_) {
+            llama_backend_free();
+            throw std::runtime_error("unable to load model " + model_path);
+        }
+        vocab_ = llama_model_get_vocab(model_);
+        chat_template_ = llama_model_chat_template(model_, nullptr);
+
+        const unsigned threads = LOCAL_LLM_THREADS > 0 ? static_cast<unsigned>(LOCAL_LLM_THREADS)
+                                                       : std::max(1u, std::thread::hardware_concurrency());
+        llama_context_params context_params = llama_context_default_params();
+        context_params.n_ctx = static_cast<uint32_t>(LOCAL_LLM_CONTEXT);
+        context_params.n_batch = static_cast<uint32_t>(LOCAL_LLM_BATCH);
+        context_params.n_ubatch = static_cast<uint32_t>(LOCAL_LLM_BATCH);
+        context_params.n_seq_max = static_cast<uint32_t>(LOCAL_LLM_SLOTS);
+        context_params.kv_unified = true;  // one cache for all sequences, so prefixes can be shared
+        context_params.n_threads = static_cast<int32_t>(threads);
+        context_params.n_threads_batch = static_cast<int32_t>(threads);
+        context_ = llama_init_from_model(model_, context_params);
+        if (!context_) {
+            llama_model_free(model_);
+            llama_backend_free();
+            throw std::runtime_error("unable to create a llama.cpp context for " + model_path);
+        }
+        memory_ = llama_get_memory(context_);
+        batch_ = llama_batch_init(static_cast<int32_t>(LOCAL_LLM_BATCH), 0, 1);
+        slots_.resize(LOCAL_LLM_SLOTS);
+        for (size_t i = 0; i < slots_.size(); ++i) {
+            slots_[i].seq = static_cast<llama_seq_id>(i);
+        }
+        worker_ = std::thread(&LocalLlm::run, this);
+    }
+
+    ~LocalLlm() {
+        shutdown();
+        for (Slot& slot : slots_) {
+            if (slot.sampler) {
+                llama_sampler_free(slot.sampler);
+            }
+        }
+        llama_batch_free(batch_);
+        llama_free(context_);
+        llama_model_free(model_);
+        llama_backend_free();
+    }
+
+    LocalLlm(const LocalLlm&) = delete;
+    LocalLlm& operator=(const LocalLlm&) = delete;
+
+    // Queues a chat completion body; like HttpEngine::submit(), on_done is
+    // always called exactly once. timeout_ms of 0 means no limit. Thread-safe.
+    RequestId submit(json body, long timeout_ms, HttpEngine::DataCallback on_data, HttpEngine::DoneCallback on_done) {
+        auto job = std::make_unique<Job>();
+        job->body = std::move(body);
+        job->on_data = std::move(on_data);
+        job->on_done = std::move(on_done);
+        job->submitted = Clock::now();
+        if (timeout_ms > 0) {
+            job->deadline = job->submitted + std::chrono::milliseconds(timeout_ms);
+        }
+        RequestId id = 0;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!stopping_) {
+                id = ++last_id_;
+                job->id = id;
+                pending_.push_back(std::move(job));
+                ++submitted_;
+            }
+        }
+        if (id == 0) {
+            HttpEngine::Response refused;
+            refused.code = CURLE_ABORTED_BY_CALLBACK;
+            job->on_done(std::move(refused));
+            return 0;
+        }
+        wakeup_.notify_one();
+        return id;
+    }
+
+    // Stops a submitted request, freeing its slot; its on_done sees
+    // CURLE_ABORTED_BY_CALLBACK. Unknown or finished requests are ignored. Thread-safe.
+    void cancel(RequestId id) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            cancelled_ids_.insert(id);
+        }
+        wakeup_.notify_one();
+    }
+
+    // Lets queued and running requests finish, then stops the worker.
+    void shutdown() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        wakeup_.notify_one();
+        if (worker_.joinable()) {
+            worker_.join();
+        }
+    }
+
+    std::string stats() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::ostringstream oss;
+        oss << "[local_llm] submitted=" << submitted_
+            << " completed=" << completed_
+            << " failed=" << failed_
+            << " cancelled=" << cancelled_
+            << " prompt_tokens=" << prompt_tokens_
+            << " reused_prompt_tokens=" << reused_tokens_
+            << " generated_tokens=" << generated_tokens_
+            << " evicted_sequences=" << evicted_
+            << " decodes=" << decodes_
+            << " avg_batch=" << std::fixed << std::setprecision(1)
+            << (decodes_ ? static_cast<double>(batched_tokens_) / static_cast<double>(decodes_) : 0.0)
+            << " max_active=" << max_active_ << "\n";
+        return oss.str();
+    }
+
+private:
+    struct Job {
+        RequestId id = 0;
+        json body;
+        HttpEngine::DataCallback on_data;
+        HttpEngine::DoneCallback on_done;
+        Clock::time_point submitted;
+        Clock::time_point deadline = Clock::time_point::max();
+    };
+
+    // One KV sequence; tokens are exactly those in the cache for seq.
+    struct Slot {
+        llama_seq_id seq = 0;
+        std::unique_ptr<Job> job;  // null when idle
+        std::vector<llama_token> tokens;
+        std::vector<llama_token> prompt;
+        size_t reused = 0;         // prompt tokens found in the cache
+        Slot* share_from = nullptr; // slot still decoding share_length tokens of this prompt
+        size_t share_length = 0;
+        llama_sampler* sampler = nullptr;
+        llama_token next = 0;      // sampled, to be decoded in the next batch
+        int32_t logits_index = -1; // row of this slot's logits in the current batch
+        size_t batched = 0;        // tokens added to the current batch
+        Clock::time_point last_used{};
+        size_t generated = 0;
+        size_t max_tokens = 0;
+        std::string content;
+        size_t streamed = 0;       // bytes of content already sent
+        Clock::time_point first_token{};
+    };
+
+    // Everything below runs on the worker thread.
+
+    void run() {
+        bool stalled = false;  // the last step had nothing to decode
+        for (;;) {
+            std::vector<std::unique_ptr<Job>> admitted;
+            std::vector<std::unique_ptr<Job>> dropped;
+            std::vector<std::unique_ptr<Job>> expired;
+            std::set<RequestId> cancelled;
+            const auto now = Clock::now();
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                if (stalled) {
+                    // Nothing could be decoded; sleep until a submit or cancel rather than spin.
+                    wakeup_.wait_for(lock, std::chrono::milliseconds(10));
+                }
+                wakeup_.wait(lock, [this] { return stopping_ || !pending_.empty() || active() > 0; });
+                if (stopping_ && pending_.empty() && active() == 0) {
+                    return;
+                }
+                cancelled.swap(cancelled_ids_);
+                for (auto it = pending_.begin(); it != pending_.end();) {
+                    if (cancelled.count((*it)->id)) {
+                        dropped.push_back(std::move(*it));
+                        it = pending_.erase(it);
+                    } else if (now >= (*it)->deadline) {
+                        expired.push_back(std::move(*it));
+                        it = pending_.erase(it);
+                    } else {
+                        ++it;
+                    }
+                }
+                while (!pending_.empty() && active() + admitted.size() < slots_.size()) {
+                    admitted.push_back(std::move(pending_.front()));
+                    pending_.pop_front();
+                }
+            }
+            for (auto& job : dropped) {
+                deliver_error(*job, CURLE_ABORTED_BY_CALLBACK, 0, "");
+                count(cancelled_);
+            }
+            for (auto& job : expired) {
+                deliver_error(*job, CURLE_OPERATION_TIMEDOUT, 0, "");
+                count(failed_);
+            }
+            for (Slot& slot : slots_) {
+                if (slot.job && cancelled.count(slot.job->id)) {
+                    count(cancelled_);
+                    release(slot, CURLE_ABORTED_BY_CALLBACK, 0, "");
+                } else if (slot.job && now >= slot.job->deadline) {
+                    count(failed_);
+                    release(slot, CURLE_OPERATION_TIMEDOUT, 0, "");
+                }
+            }
+            for (size_t i = 0; i < admitted.size(); ++i) {
+                if (!admit(admitted[i])) {
+                    // The cache is full until running requests finish; they keep their order.
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    for (size_t j = admitted.size(); j-- > i;) {
+                        pending_.push_front(std::move(admitted[j]));
+                    }
+                    break;
+                }
+            }
+            stalled = !step();
+        }
+    }
+
+    size_t active() const {
+        return static_cast<size_t>(std::count_if(slots_.begin(), slots_.end(), [](const Slot& slot) {
+            return slot.job != nullptr;
+        }));
+    }
+
+    void count(size_t& counter, size_t amount = 1) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        counter += amount;
+    }
+
+    // The chat messages rendered with the model's template and tokenized.
+    std::vector<llama_token> tokenize_prompt(const json& messages) const {
+        std::vector<std::string> contents;
+        std::vector<llama_chat_message> chat;
+        for (const auto& message : messages) {
+            const json& content = message.contains("content") ? message["content"] : json("");
+            contents.push_back(content.is_string() ? content.get<std::string>() : content.dump());
+        }
+        for (size_t i = 0; i < contents.size(); ++i) {
+            chat.push_back({messages[i].contains("role") && messages[i]["role"].is_string()
+                                ? messages[i]["role"].get_ref<const std::string&>().c_str()
+                                : "user",
+                            contents[i].c_str()});
+        }
+        std::string text(4096, '\0');
+        int32_t length = llama_chat_apply_template(chat_template_, chat.data(), chat.size(), true, text.data(),
+                                                   static_cast<int32_t>(text.size()));
+        if (length > static_cast<int32_t>(text.size())) {
+            text.resize(static_cast<size_t>(length));
+            length = llama_chat_apply_template(chat_template_, chat.data(), chat.size(), true, text.data(),
+                                               static_cast<int32_t>(text.size()));
+        }
+        if (length < 0) {
+            throw std::runtime_error("the model's chat template is not supported");
+        }
+        text.resize(static_cast<size_t>(length));
+
+        const int32_t needed = -llama_tokenize(vocab_, text.data(), static_cast<int32_t>(text.size()), nullptr, 0,
+                                               true, true);
+        std::vector<llama_token> tokens(static_cast<size_t>(std::max(needed, 0)));
+        if (llama_tokenize(vocab_, text.data(), static_cast<int32_t>(text.size()), tokens.data(),
+                           static_cast<int32_t>(tokens.size()), true, true) < 0) {
+            throw std::runtime_error("unable to tokenize the prompt");
+        }
+        return tokens;
+    }
+
+    static size_t common_prefix(const std::vector<llama_token>& a, const std::vector<llama_token>& b) {
+        const size_t limit = std::min(a.size(), b.size());
+        size_t n = 0;
+        while (n < limit && a[n] == b[n]) {
+            ++n;
+        }
+        return n;
+    }
+
+    // Puts a request into the idle slot whose cache shares most of its prompt,
+    // or copies the longest shared prefix from a busy one. Returns false, leaving
+    // job with the caller, when the cache has no room for it while others run.
+    bool admit(std::unique_ptr<Job>& job) {
+        std::vector<llama_token> prompt;
+        try {
+            if (!job->body.contains("messages") || !job->body["messages"].is_array()) {
+                throw std::runtime_error("messages missing");
+            }
+            prompt = tokenize_prompt(job->body["messages"]);
+            if (prompt.empty() || prompt.size() + 1 >= LOCAL_LLM_CONTEXT) {
+                throw std::runtime_error("prompt of " + std::to_string(prompt.size()) +
+                                         " tokens does not fit local_llm.context");
+            }
+        } catch (const std::exception& e) {
+            count(failed_);
+            deliver_error(*job, CURLE_OK, 400, e.what());
+            return true;
+        }
+
+        Slot* slot = nullptr;
+        size_t own = 0;
+        for (Slot& candidate : slots_) {
+            const size_t shared = candidate.job ? 0 : common_prefix(candidate.tokens, prompt);
+            if (!candidate.job && (!slot || shared > own)) {
+                slot = &candidate;
+                own = shared;
+            }
+        }
+        Slot* source = slot;
+        size_t reuse = own;
+        for (Slot& candidate : slots_) {
+            const size_t shared = common_prefix(candidate.tokens, prompt);
+            if (shared > reuse) {
+                source = &candidate;
+                reuse = shared;
+            }
+        }
+        reuse = std::min(reuse, prompt.size() - 1);  // the last prompt token is decoded for its logits
+
+        // Room for the prompt and the answer next to every other sequence.
+        const size_t max_tokens = job->body.value("max_tokens", LOCAL_LLM_MAX_TOKENS);
+        if (!make_room(prompt.size() + max_tokens, slot, source) && active() > 0) {
+            return false;
+        }
+        if (source == slot) {
+            if (!llama_memory_seq_rm(memory_, slot->seq, static_cast<llama_pos>(reuse), -1)) {
+                llama_memory_seq_rm(memory_, slot->seq, -1, -1);
+                reuse = 0;
+            }
+        } else {
+            llama_memory_seq_rm(memory_, slot->seq, -1, -1);
+            llama_memory_seq_cp(memory_, source->seq, slot->seq, 0, static_cast<llama_pos>(reuse));
+        }
+        slot->tokens.assign(prompt.begin(), prompt.begin() + static_cast<long>(reuse));
+        slot->reused = reuse;
+        slot->last_used = Clock::now();
+
+        // Rather than decoding a prefix another request is decoding right now,
+        // wait for it and copy it.
+        constexpr size_t MIN_SHARED_TOKENS = 16;
+        slot->share_from = nullptr;
+        slot->share_length = 0;
+        for (Slot& candidate : slots_) {
+            const size_t shared = candidate.job ? std::min(common_prefix(candidate.prompt, prompt), prompt.size() - 1) : 0;
+            if (shared >= reuse + MIN_SHARED_TOKENS && shared > slot->share_length &&
+                candidate.tokens.size() < shared) {
+                slot->share_from = &candidate;
+                slot->share_length = shared;
+            }
+        }
+
+        const float temperature = job->body.value("temperature", 0.0f);
+        slot->sampler = llama_sampler_chain_init(llama_sampler_chain_default_params());
+        if (temperature <= 0.0f) {
+            llama_sampler_chain_add(slot->sampler, llama_sampler_init_greedy());
+        } else {
+            llama_sampler_chain_add(slot->sampler, llama_sampler_init_top_k(40));
+            llama_sampler_chain_add(slot->sampler, llama_sampler_init_top_p(0.95f, 1));
+            llama_sampler_chain_add(slot->sampler, llama_sampler_init_temp(temperature));
+            llama_sampler_chain_add(slot->sampler, llama_sampler_init_dist(LLAMA_DEFAULT_SEED));
+        }
+        slot->max_tokens = max_tokens;
+        slot->prompt = std::move(prompt);
+        slot->generated = 0;
+        slot->content.clear();
+        slot->streamed = 0;
+        slot->first_token = {};
+        slot->job = std::move(job);
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        prompt_tokens_ += slot->prompt.size();
+        reused_tokens_ += reuse;
+        max_active_ = std::max(max_active_, active());
+        return true;
+    }
+
+    // Cache cells held by idle sequences plus those running requests may still
+    // fill with their answers. A prefix shared by several sequences is counted
+    // once for each, so this errs on the side of evicting.
+    size_t cached_tokens() const {
+        size_t total = 0;
+        for (const Slot& slot : slots_) {
+            total += slot.job ? std::max(slot.tokens.size(), slot.prompt.size() + slot.max_tokens) : slot.tokens.size();
+        }
+        return total;
+    }
+
+    // Drops the sequence of the least recently used idle slot other than keep
+    // and source; false when there is none left.
+    bool evict_idle(const Slot* keep = nullptr, const Slot* source = nullptr) {
+        Slot* oldest = nullptr;
+        for (Slot& slot : slots_) {
+            if (!slot.job && !slot.tokens.empty() && &slot != keep && &slot != source &&
+                (!oldest || slot.last_used < oldest->last_used)) {
+                oldest = &slot;
+            }
+        }
+        if (!oldest) {
+            return false;
+        }
+        llama_memory_seq_rm(memory_, oldest->seq, -1, -1);
+        oldest->tokens.clear();
+        count(evicted_);
+        return true;
+    }
+
+    // Evicts idle sequences until needed tokens for slot, which drops its own,
+    // fit into local_llm.context; false when they do not fit even without any.
+    bool make_room(size_t needed, const Slot* slot, const Slot* source) {
+        while (cached_tokens() - slot->tokens.size() + needed >= LOCAL_LLM_CONTEXT) {
+            if (!evict_idle(slot, source)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Copies the prefix the slot waits for once its source has decoded it;
+    // false while the slot has to keep waiting.
+    bool take_shared_prefix(Slot& slot) {
+        const Slot& source = *slot.share_from;
+        const size_t ready = common_prefix(source.tokens, slot.prompt);
+        if (ready >= slot.share_length) {
+            llama_memory_seq_rm(memory_, slot.seq, -1, -1);
+            llama_memory_seq_cp(memory_, source.seq, slot.seq, 0, static_cast<llama_pos>(slot.share_length));
+            slot.tokens.assign(slot.prompt.begin(), slot.prompt.begin() + static_cast<long>(slot.share_length));
+            count(reused_tokens_, slot.share_length - slot.reused);
+            slot.reused = slot.share_length;
+        } else if (source.job && ready == source.tokens.size()) {
+            return false;
+        }
+        slot.share_from = nullptr;  // copied, or the source went elsewhere: decode the rest here
+        return true;
+    }
+
+    void add_to_batch(llama_token token, size_t pos, llama_seq_id seq, bool logits) {
+        const int32_t i = batch_.n_tokens++;
+        batch_.token[i] = token;
+        batch_.pos[i] = static_cast<llama_pos>(pos);
+        batch_.n_seq_id[i] = 1;
+        batch_.seq_id[i][0] = seq;
+        batch_.logits[i] = logits;
+    }
+
+    // One decode: the next token of every generating slot, then as many prompt
+    // tokens of the others as fit into the batch. False when there was nothing to decode.
+    bool step() {
+        batch_.n_tokens = 0;
+        const auto budget = static_cast<int32_t>(LOCAL_LLM_BATCH);
+        for (Slot& slot : slots_) {
+            slot.logits_index = -1;
+            slot.batched = 0;
+            if (slot.job && slot.tokens.size() >= slot.prompt.size()) {
+                slot.logits_index = batch_.n_tokens;
+                add_to_batch(slot.next, slot.tokens.size(), slot.seq, true);
+                slot.tokens.push_back(slot.next);
+                ++slot.batched;
+            }
+        }
+        for (Slot& slot : slots_) {
+            if (slot.job && slot.share_from && !take_shared_prefix(slot)) {
+                continue;
+            }
+            while (slot.job && slot.tokens.size() < slot.prompt.size() && batch_.n_tokens < budget) {
+                const bool last = slot.tokens.size() + 1 == slot.prompt.size();
+                if (last) {
+                    slot.logits_index = batch_.n_tokens;
+                }
+                add_to_batch(slot.prompt[slot.tokens.size()], slot.tokens.size(), slot.seq, last);
+                slot.tokens.push_back(slot.prompt[slot.tokens.size()]);
+                ++slot.batched;
+            }
+        }
+        if (batch_.n_tokens == 0) {
+            return false;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            ++decodes_;
+            batched_tokens_ += static_cast<size_t>(batch_.n_tokens);
+        }
+        const int32_t status = llama_decode(context_, batch_);
+        if (status == 1) {
+            // No room in the KV cache, which is left as it was: take the batch back
+            // and evict an idle sequence, or fail the newest request once none is
+            // left, then retry with the next step.
+            for (Slot& slot : slots_) {
+                slot.tokens.resize(slot.tokens.size() - slot.batched);
+            }
+            if (!evict_idle()) {
+                Slot* newest = nullptr;
+                for (Slot& slot : slots_) {
+                    if (slot.job && (!newest || slot.job->submitted > newest->job->submitted)) {
+                        newest = &slot;
+                    }
+                }
+                count(failed_);
+                newest->tokens.clear();
+                llama_memory_seq_rm(memory_, newest->seq, -1, -1);
+                release(*newest, CURLE_OK, 500, "local_llm.context is full");
+            }
+            return true;
+        }
+        if (status != 0) {
+            for (Slot& slot : slots_) {
+                if (slot.job) {
+                    count(failed_);
+                    slot.tokens.clear();
+                    llama_memory_seq_rm(memory_, slot.seq, -1, -1);
+                    release(slot, CURLE_OK, 500, "llama_decode failed with status " + std::to_string(status));
+                }
+            }
+            return true;
+        }
+
+        for (Slot& slot : slots_) {
+            if (!slot.job || slot.logits_index < 0) {
+                continue;
+            }
+            const llama_token token = llama_sampler_sample(slot.sampler, context_, slot.logits_index);
+            if (slot.first_token == Clock::time_point{}) {
+                slot.first_token = Clock::now();
+            }
+            if (llama_vocab_is_eog(vocab_, token)) {
+                complete(slot, "stop");
+                continue;
+            }
+            char piece[256];
+            const int32_t length = llama_token_to_piece(vocab_, token, piece, sizeof(piece), 0, false);
+            if (length > 0) {
+                slot.content.append(piece, static_cast<size_t>(length));
+            }
+            slot.next = token;
+            ++slot.generated;
+            stream(slot);
+            if (slot.generated >= slot.max_tokens || slot.tokens.size() + 1 >= LOCAL_LLM_CONTEXT) {
+                complete(slot, "length");
+            }
+        }
+        return true;
+    }
+
+    static std::string sse(const json& chunk) {
+        return "data: " + chunk.dump(-1, ' ', false, json::error_handler_t::replace) + "\n\n";
+    }
+
+    // Sends the content generated since the last chunk, holding back a
+    // UTF-8 sequence split across tokens.
+    void stream(Slot& slot, bool flush = false) {
+        if (!slot.job->body.value("stream", false)) {
+            return;
+        }
+        size_t end = slot.content.size();
+        if (!flush) {
+            size_t start = end;  // of the last character
+            while (start > slot.streamed && end - start < 3 &&
+                   (static_cast<unsigned char>(slot.content[start - 1]) & 0xC0) == 0x80) {
+                --start;
+            }
+            if (start > slot.streamed) {
+                const auto lead = static_cast<unsigned char>(slot.content[--start]);
+                const size_t width = lead >= 0xF0 ? 4 : lead >= 0xE0 ? 3 : lead >= 0xC0 ? 2 : 1;
+                if (end - start < width) {
+                    end = start;
+                }
+            }
+        }
+        if (end <= slot.streamed) {
+            return;
+        }
+        const json chunk = {
+            {"object", "chat.completion.chunk"},
+            {"model", "local"},
+            {"choices", json::array({{{"index", 0}, {"delta", {{"content", slot.content.substr(slot.streamed, end - slot.streamed)}}}}})}
+        };
+        slot.streamed = end;
+        send_data(*slot.job, sse(chunk));
+    }
+
+    void complete(Slot& slot, const std::string& finish_reason) {
+        const json usage = {
+            {"prompt_tokens", slot.prompt.size()},
+            {"completion_tokens", slot.generated},
+            {"total_tokens", slot.prompt.size() + slot.generated},
+            {"prompt_tokens_details", {{"cached_tokens", slot.reused}}}
+        };
+        std::string body;
+        if (slot.job->body.value("stream", false)) {
+            stream(slot, true);
+            send_data(*slot.job, sse({
+                {"object", "chat.completion.chunk"},
+                {"model", "local"},
+                {"choices", json::array({{{"index", 0}, {"delta", json::object()}, {"finish_reason", finish_reason}}})}
+            }));
+            const json options = slot.job->body.value("stream_options", json::object());
+            if (options.is_object() && options.value("include_usage", false)) {
+                send_data(*slot.job, sse({{"choices", json::array()}, {"usage", usage}}));
+            }
+            send_data(*slot.job, "data: [DONE]\n\n");
+        } else {
+            body = json{
+                {"object", "chat.completion"},
+                {"model", "local"},
+                {"choices", json::array({{{"index", 0}, {"finish_reason", finish_reason},
+                                          {"message", {{"role", "assistant"}, {"content", slot.content}}}}})},
+                {"usage", usage}
+            }.dump(-1, ' ', false, json::error_handler_t::replace);
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            ++completed_;
+            generated_tokens_ += slot.generated;
+        }
+        release(slot, CURLE_OK, 200, "", std::move(body));
+    }
+
+    // Ends the slot's request; its tokens stay in the cache for later prompts
+    // until evict_idle() needs the room.
+    void release(Slot& slot, CURLcode code, long status, const std::string& error, std::string body = "") {
+        llama_sampler_free(slot.sampler);
+        slot.sampler = nullptr;
+        slot.last_used = Clock::now();
+        std::unique_ptr<Job> job = std::move(slot.job);
+        HttpEngine::Response response;
+        response.code = code;
+        response.status = status;
+        response.body = error.empty() ? std::move(body) : json{{"error", {{"message", error}}}}.dump();
+        response.timing.in_process = true;
+        const auto now = Clock::now();
+        const auto first = slot.first_token == Clock::time_point{} ? now : slot.first_token;
+        response.timing.server_ms = std::chrono::duration<double, std::milli>(first - job->submitted).count();
+        response.timing.transfer_ms = std::chrono::duration<double, std::milli>(now - first).count();
+        deliver(*job, std::move(response));
+    }
+
+    void deliver_error(Job& job, CURLcode code, long status, const std::string& error) {
+        HttpEngine::Response response;
+        response.code = code;
+        response.status = status;
+        if (!error.empty()) {
+            response.body = json{{"error", {{"message", error}}}}.dump();
+        }
+        response.timing.in_process = true;
+        deliver(job, std::move(response));
+    }
+
+    void send_data(Job& job, std::string data) {
+        if (job.on_data) {
+            engine_.schedule(std::chrono::milliseconds(0), [on_data = job.on_data, data = std::move(data)] {
+                on_data(data.data(), data.size());
+            });
+        }
+    }
+
+    void deliver(Job& job, HttpEngine::Response&& response) {
+        engine_.schedule(std::chrono::milliseconds(0),
+                         [on_done = std::move(job.on_done), response = std::move(response)]() mutable {
+                             on_done(std::move(response));
+                         });
+    }
+
+    HttpEngine& engine_;
+    llama_model* model_ = nullptr;
+    const llama_vocab* vocab_ = nullptr;
+    const char* chat_template_ = nullptr;
+    llama_context* context_ = nullptr;
+    llama_memory_t memory_ = nullptr;
+    llama_batch batch_{};
+    std::vector<Slot> slots_;  // owned by the worker
+    std::thread worker_;
+
+    mutable std::mutex mutex_;
+    std::condition_variable wakeup_;
+    std::deque<std::unique_ptr<Job>> pending_;
+    std::set<RequestId> cancelled_ids_;
+    RequestId last_id_ = 0;
+    bool stopping_ = false;
+    size_t submitted_ = 0;
+    size_t completed_ = 0;
+    size_t failed_ = 0;
+    size_t cancelled_ = 0;
+    size_t prompt_tokens_ = 0;
+    size_t reused_tokens_ = 0;
+    size_t generated_tokens_ = 0;
+    size_t decodes_ = 0;
+    size_t batched_tokens_ = 0;
+    size_t evicted_ = 0;
+    size_t max_active_ = 0;
+};
+#else
+// Built without llama.cpp: load_config() rejects local_llm.model_path, so no
+// backend is ever local.
+class LocalLlm {
+public:
+    using RequestId = HttpEngine::RequestId;
+
+    LocalLlm(HttpEngine&, const std::string&) {
+        throw std::runtime_error("built without WITH_LLAMA");
+    }
+
+    RequestId submit(json, long, HttpEngine::DataCallback, HttpEngine::DoneCallback on_done) {
+        HttpEngine::Response refused;
+        refused.code = CURLE_ABORTED_BY_CALLBACK;
+        on_done(std::move(refused));
+        return 0;
+    }
+
+    void cancel(RequestId) {}
+    void shutdown() {}
+    std::string stats() const { return ""; }
+};
+#endif
+
+// =======================
+// Response cache
+// =======================
+
+// Successful chat answers keyed by a hash of everything that determines them:
+// the route's backends and models, the messages (prompt template and
+// transcript), the knowledge-base IDs and the other request options. Recent
+// answers are kept in memory; with a directory each answer is also stored as
+// DIR/KEY.json and the least recently used files are evicted beyond
+// disk_entries, so that re-runs after a restart are answered from disk too.
+// Answers are stored from the HTTP engine thread, so files are written and
+// evicted on the cache's own writer thread.
+class ResponseCache {
+public:
+    struct Entry {
+        std::string content;
+        json usage;
+        std::string backend;
+        std::string model;
+        long long created = 0;  // seconds since the epoch
+    };
+
+    ResponseCache(std::string dir, size_t memory_entries, size_t disk_entries, size_t ttl_s)
+        : dir_(std::move(dir)), memory_entries_(memory_entries), disk_entries_(disk_entries), ttl_s_(ttl_s) {
+        if (dir_.empty()) {
+            return;
+        }
+        namespace fs = std::filesystem;
+        std::error_code ec;
+        fs::create_directories(dir_, ec);
+        if (ec) {
+            std::cerr << "[cache] Unable to create " << dir_ << ": " << ec.message() << "; caching in memory only\n";
+            dir_.clear();
+            return;
+        }
+        for (const auto& file : fs::directory_iterator(dir_, ec)) {
+            if (file.path().extension() == ".json") {
+                disk_[file.path().stem().string()] = file.last_write_time(ec);
+            }
+        }
+        remove_files(evict_disk());
+        writer_ = std::thread(&ResponseCache::write_loop, this);
+    }
+
+    // Writes the answers still queued before returning.
+    ~ResponseCache() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        write_cv_.notify_all();
+        if (writer_.joinable()) {
+            writer_.join();
+        }
+    }
+
+    ResponseCache(const ResponseCache&) = delete;
+    ResponseCache& operator=(const ResponseCache&) = delete;
+
+    // Request options that do not change the answer are left out of the key.
+    static std::string key(const std::string& route, json body) {
+        for (const char* field : {"stream", "stream_options", "cache_prompt", "id_slot"}) {
+            body.erase(field);
+        }
+        const std::string material = route + "\n" + body.dump();
+        return to_hex(fnv1a_64(material)) + to_hex(fnv1a_64(material, 0x84222325cbf29ce4ULL));
+    }
+
+    // Disk hits are read and parsed without the lock, which store() takes on the
+    // HTTP engine thread.
+    std::optional<Entry> lookup(const std::string& key) {
+        std::string file;
+        std::filesystem::file_time_type listed;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            const auto it = memory_index_.find(key);
+            if (it != memory_index_.end()) {
+                if (!expired(it->second->second)) {
+                    memory_.splice(memory_.begin(), memory_, it->second);
+                    ++memory_hits_;
+                    return it->second->second;
+                }
+                memory_.erase(it->second);
+                memory_index_.erase(it);
+            }
+            const auto disk_it = disk_.find(key);
+            if (disk_it == disk_.end()) {
+                ++misses_;
+                return std::nullopt;
+            }
+            file = path(key);
+            listed = disk_it->second;
+        }
+
+        std::optional<Entry> entry = read_entry(file);
+        const bool hit = entry && !expired(*entry);
+        const auto now = std::filesystem::file_time_type::clock::now();
+        std::error_code ec;
+        if (hit) {
+            std::filesystem::last_write_time(file, now, ec);
+        }
+        bool stale = false;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            const auto disk_it = disk_.find(key);
+            if (hit) {
+                if (disk_it != disk_.end()) {
+                    disk_it->second = now;
+                }
+                remember(key, *entry);
+                ++disk_hits_;
+                return entry;
+            }
+            // Unless the writer replaced the file meanwhile.
+            if (disk_it != disk_.end() && disk_it->second == listed) {
+                disk_.erase(disk_it);
+                stale = true;
+            }
+            ++misses_;
+        }
+        if (stale) {
+            std::filesystem::remove(file, ec);
+        }
+        return std::nullopt;
+    }
+
+    // Updates the memory LRU and queues the file write; never touches the disk itself.
+    void store(const std::string& key, Entry entry) {
+        entry.created = std::chrono::duration_cast<std::chrono::seconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            remember(key, entry);
+            ++stores_;
+            if (dir_.empty()) {
+                return;
+            }
+            writes_.emplace_back(key, json{
+                {"content", entry.content},
+                {"usage", entry.usage},
+                {"backend", entry.backend},
+                {"model", entry.model},
+                {"created", entry.created}
+            });
+        }
+        write_cv_.notify_one();
+    }
+
+    std::string stats() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::ostringstream oss;
+        oss << "[cache] hits=" << memory_hits_ + disk_hits_
+            << " memory_hits=" << memory_hits_
+            << " disk_hits=" << disk_hits_
+            << " misses=" << misses_
+            << " stores=" << stores_
+            << " evictions=" << evictions_
+            << " write_errors=" << write_errors_
+            << " memory_entries=" << memory_.size()
+            << " disk_entries=" << disk_.size() << "\n";
+        return oss.str();
+    }
+
+private:
+    std::string path(const std::string& key) const {
+        return dir_ + "/" + key + ".json";
+    }
+
+    bool expired(const Entry& entry) const {
+        if (ttl_s_ == 0) {
+            return false;
+        }
+        const long long now = std::chrono::duration_cast<std::chrono::seconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        return now - entry.created > static_cast<long long>(ttl_s_);
+    }
+
+    void remember(const std::string& key, const Entry& entry) {
+        const auto it = memory_index_.find(key);
+        if (it != memory_index_.end()) {
+            memory_.erase(it->second);
+        }
+        memory_.emplace_front(key, entry);
+        memory_index_[key] = memory_.begin();
+        while (memory_.size() > memory_entries_) {
+            memory_index_.erase(memory_.back().first);
+            memory_.pop_back();
+        }
+    }
+
+    void write_loop() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        for (;;) {
+            write_cv_.wait(lock, [this] { return stopping_ || !writes_.empty(); });
+            if (writes_.empty()) {
+                return;
+            }
+            auto [key, stored] = std::move(writes_.front());
+            writes_.pop_front();
+            lock.unlock();
+            const bool written = write_file(key, stored);
+            lock.lock();
+            if (!written) {
+                ++write_errors_;
+                continue;
+            }
+            disk_[key] = std::filesystem::file_time_type::clock::now();
+            std::vector<std::string> evicted = evict_disk();
+            lock.unlock();
+            remove_files(evicted);
+            lock.lock();
+        }
+    }
+
+    // Nothing when the file is missing, torn or not an entry.
+    static std::optional<Entry> read_entry(const std::string& file) {
+        std::ifstream in(file);
+        const json stored = json::parse(in, nullptr, false);
+        if (!stored.is_object() || !stored.contains("content") || !stored["content"].is_string()) {
+            return std::nullopt;
+        }
+        try {
+            Entry entry;
+            entry.content = stored["content"].get<std::string>();
+            entry.usage = stored.value("usage", json());
+            entry.backend = stored.value("backend", "");
+            entry.model = stored.value("model", "");
+            entry.created = stored.value("created", 0LL);
+            return entry;
+        } catch (const json::exception&) {
+            return std::nullopt;
+        }
+    }
+
+    // Written under a temporary name and renamed, so a crash never leaves a torn entry.
+    bool write_file(const std::string& key, const json& stored) const {
+        const std::string final_path = path(key);
+        const std::string temp_path = final_path + ".tmp";
+        std::ofstream out(temp_path, std::ios::trunc);
+        out << stored.dump();
+        out.close();
+        std::error_code ec;
+        if (!out) {
+            ec = std::make_error_code(std::errc::io_error);
+        } else {
+            std::filesystem::rename(temp_path, final_path, ec);
+        }
+        if (ec) {
+            std::filesystem::remove(temp_path, ec);
+            return false;
+        }
+        return true;
+    }
+
+    // Drops the least recently used files beyond disk_entries from the index and
+    // returns their paths, to be removed without holding the lock.
+    std::vector<std::string> evict_disk() {
+        std::vector<std::string> evicted;
+        while (disk_.size() > disk_entries_) {
+            const auto oldest = std::min_element(disk_.begin(), disk_.end(), [](const auto& a, const auto& b) {
+                return a.second < b.second;
+            });
+            evicted.push_back(path(oldest->first));
+            disk_.erase(oldest);
+            ++evictions_;
+        }
+        return evicted;
+    }
+
+    static void remove_files(const std::vector<std::string>& paths) {
+        for (const auto& file : paths) {
+            std::error_code ec;
+            std::filesystem::remove(file, ec);
+        }
+    }
+
+    std::string dir_;
+    size_t memory_entries_;
+    size_t disk_entries_;
+    size_t ttl_s_;
+    mutable std::mutex mutex_;
+    std::list<std::pair<std::string, Entry>> memory_;  // most recently used first
+    std::map<std::string, std::list<std::pair<std::string, Entry>>::iterator> memory_index_;
+    std::map<std::string, std::filesystem::file_time_type> disk_;  // key -> last use
+    std::deque<std::pair<std::string, json>> writes_;               // files not yet written
+    std::condition_variable write_cv_;
+    std::thread writer_;
+    bool stopping_ = false;
+
+    size_t memory_hits_ = 0;
+    size_t disk_hits_ = 0;
+    size_t misses_ = 0;
+    size_t stores_ = 0;
+    size_t evictions_ = 0;
+    size_t write_errors_ = 0;
+};
+
+// Raised by LLM requests aborted through their CancelToken.
+class RequestCancelled : public std::runtime_error {
+public:
+    RequestCancelled() : std::runtime_error("Request cancelled") {}
+};
+
+// Cancellation of one analysis job. cancel() runs the registered callbacks,
+// which abort the job's LLM requests in flight; callbacks registered later
+// run at once. Thread-safe.
+class CancelToken {
+public:
+    using Callback = std::function<void()>;
+
+    void cancel() {
+        std::map<size_t, Callback> callbacks;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (cancelled_) {
+                return;
+            }
+            cancelled_ = true;
+            callbacks.swap(callbacks_);
+        }
+        for (auto& [id, callback] : callbacks) {
+            callback();
+        }
+    }
+
+    bool cancelled() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return cancelled_;
+    }
+
+    // Returns an ID for unsubscribe(), or 0 when callback already ran.
+    size_t subscribe(Callback callback) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!cancelled_) {
+                callbacks_[++last_id_] = std::move(callback);
+                return last_id_;
+            }
+        }
+        callback();
+        return 0;
+    }
+
+    void unsubscribe(size_t id) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        callbacks_.erase(id);
+    }
+
+    // The token of the job running on this thread, if any. LLM requests issued
+    // by a job pick it up without it being passed through every call.
+    static std::shared_ptr<CancelToken>& current() {
+        thread_local std::shared_ptr<CancelToken> token;
+        return token;
+    }
+
+private:
+    mutable std::mutex mutex_;
+    bool cancelled_ = false;
+    size_t last_id_ = 0;
+    std::map<size_t, Callback> callbacks_;
+};
+
+// True when the analysis job running on this thread has been cancelled.
+bool job_cancelled() {
+    const auto& token = CancelToken::current();
+    return token && token->cancelled();
+}
+
+// Kinds of chat completion; each is routed to its own list of backends.
+enum class RequestClass { TempCheck, Analysis, Summary };
+
+const char* request_class_name(RequestClass request_class) {
+    switch (request_class) {
+    case RequestClass::TempCheck:
+        return "temp_check";
+    case RequestClass::Summary:
+        return "summary";
+    case RequestClass::Analysis:
+        break;
+    }
+    return "analysis";
+}
+
+// Chat completion client on top of the shared HttpEngine. Every request class has
+// a route of backends: healthy ones are tried in order, a request that fails
+// before its first token fails over to the next one, and with hedging enabled a
+// request still silent after the hedge percentile of its backend's recent
+// latencies is duplicated to the next backend, the first to answer winning and
+// the other being cancelled. All attempts of a request share its class deadline.
+// chat_async() never blocks and reports completion on the engine thread; chat()
+// waits for it. With a ResponseCache, repeated requests are answered from it.
+// Cancelling the request's CancelToken (by default the calling job's) aborts
+// all its attempts and fails it with RequestCancelled. Thread-safe: all
+// workers share one client.
+class LlmClient {
+public:
+    using DoneCallback = std::function<void(ChatResult&&, std::exception_ptr)>;
+
+    explicit LlmClient(HttpEngine& engine, ResponseCache* cache = nullptr, LocalLlm* local = nullptr)
+        : engine_(engine), cache_(cache), local_(local) {
+        for (const auto& [name, config] : BACKENDS) {
+            Backend& backend = backends_[name];
+            backend.name = name;
+            backend.config = config;
+            backend.local = !config.model_path.empty();
+            if (!backend.local) {
+                backend.url = chat_completions_url(config.url);
+            }
+        }
+    }
+
+    // Sends a chat completion, streaming it when openai.stream is enabled. Without
+    // streaming the whole response arrives at once and on_delta is called a single time.
+    // The model is set per backend. Failures are reported as a std::runtime_error
+    // in the exception_ptr.
+    void chat_async(RequestClass request_class, json body, DeltaCallback on_delta, DoneCallback on_done,
+                    std::shared_ptr<CancelToken> cancel = CancelToken::current()) {
+        body["stream"] = STREAM_RESPONSES;
+        if (STREAM_RESPONSES) {
+            body["stream_options"] = {{"include_usage", true}};
+        }
+        if (cache_) {
+            const std::string key = ResponseCache::key(describe_route(request_class), body);
+            if (auto entry = cache_->lookup(key)) {
+                answer_from_cache(std::move(*entry), std::move(on_delta), std::move(on_done));
+                return;
+            }
+            on_done = [cache = cache_, key, on_done = std::move(on_done)](ChatResult&& result, std::exception_ptr error) {
+                if (!error && !result.content.empty()) {
+                    cache->store(key, {result.content, result.usage, result.backend, result.model, 0});
+                }
+                on_done(std::move(result), error);
+            };
+        }
+        auto call = std::make_shared<Call>();
+        call->client = this;
+        call->request_class = request_class;
+        call->body = std::move(body);
+        call->on_delta = std::move(on_delta);
+        call->on_done = std::move(on_done);
+        call->started = Clock::now();
+        const auto deadline_it = ROUTE_DEADLINES_MS.find(request_class_name(request_class));
+        if (deadline_it != ROUTE_DEADLINES_MS.end() && deadline_it->second > 0) {
+            call->deadline = call->started + std::chrono::milliseconds(deadline_it->second);
+        }
+        if (cancel) {
+            // The abort itself runs on the engine thread like everything else in the Call.
+            std::weak_ptr<Call> weak = call;
+            call->cancel = cancel;
+            call->cancel_subscription = cancel->subscribe([this, weak] {
+                engine_.schedule(std::chrono::milliseconds(0), [weak] {
+                    if (auto aborted = weak.lock()) {
+                        aborted->abort();
+                    }
+                });
+            });
+        }
+        engine_.schedule(std::chrono::milliseconds(0), [call] { call->launch(); });
+    }
+
+    // Blocking form of chat_async(); throws std::runtime_error on failure and
+    // RequestCancelled when the calling job is cancelled.
+    ChatResult chat(RequestClass request_class, json body, const DeltaCallback& on_delta) {
+        std::promise<ChatResult> promise;
+        auto future = promise.get_future();
+        chat_async(request_class, std::move(body), on_delta,
+                   [&promise](ChatResult&& result, std::exception_ptr error) {
+                       if (error) {
+                           promise.set_exception(error);
+                       } else {
+                           promise.set_value(std::move(result));
+                       }
+                   });
+        return future.get();
+    }
+
+    // The backends of a route in order of preference, e.g. "fast (llama3:8b) -> openai (gpt-4o)".
+    std::string describe_route(RequestClass request_class) const {
+        std::string description;
+        const auto route_it = ROUTES.find(request_class_name(request_class));
+        if (route_it == ROUTES.end()) {
+            return description;
+        }
+        for (const auto& name : route_it->second) {
+            const Backend& backend = backends_.at(name);
+            description += (description.empty() ? "" : " -> ") + name + " (" + backend.config.model + ")";
+        }
+        return description;
+    }
+
+    std::string stats() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::ostringstream oss;
+        for (const auto& [name, backend] : backends_) {
+            if (backend.requests == 0) {
+                continue;
+            }
+            std::vector<double> samples;
+            for (const auto& [request_class, latencies] : backend.first_token_ms) {
+                samples.insert(samples.end(), latencies.begin(), latencies.end());
+            }
+            oss << "[llm] backend=" << name
+                << " requests=" << backend.requests
+                << " failures=" << backend.failures
+                << " hedges=" << backend.hedges
+                << " failovers=" << backend.failovers
+                << " cancelled=" << backend.cancelled
+                << " p50_first_token_ms=" << std::fixed << std::setprecision(0)
+                << (samples.empty() ? 0.0 : percentile(samples, 50))
+                << " healthy=" << (Clock::now() >= backend.unhealthy_until ? "yes" : "no") << "\n";
+        }
+        return oss.str();
+    }
+
+private:
+    using Clock = std::chrono::steady_clock;
+    static constexpr size_t LATENCY_WINDOW = 128;
+
+    struct Backend {
+        std::string name;
+        BackendConfig config;
+        std::string url;
+        bool local = false;  // served by the LocalLlm instead of over HTTP
+        // Guarded by the client's mutex.
+        size_t consecutive_failures = 0;
+        Clock::time_point unhealthy_until{};
+        std::map<RequestClass, std::deque<double>> first_token_ms;  // recent successful attempts
+        size_t requests = 0;
+        size_t failures = 0;
+        size_t hedges = 0;
+        size_t failovers = 0;
+        size_t cancelled = 0;  // attempts aborted in flight because their job was cancelled
+    };
+
+    // Hands a cached answer over on the engine thread, like a network answer.
+    void answer_from_cache(ResponseCache::Entry entry, DeltaCallback on_delta, DoneCallback on_done) {
+        const auto started = Clock::now();
+        engine_.schedule(std::chrono::milliseconds(0),
+                         [entry = std::move(entry), on_delta = std::move(on_delta), on_done = std::move(on_done), started] {
+                             ChatResult result;
+                             result.content = entry.content;
+                             result.usage = entry.usage;
+                             result.backend = entry.backend;
+                             result.model = entry.model;
+                             result.cached = true;
+                             result.first_token_ms = std::chrono::duration<double, std::milli>(Clock::now() - started).count();
+                             if (on_delta) {
+                                 on_delta(result.content);
+                             }
+                             result.total_ms = std::chrono::duration<double, std::milli>(Clock::now() - started).count();
+                             on_done(std::move(result), nullptr);
+                         });
+    }
+
+    static double percentile(std::vector<double> samples, size_t percent) {
+        const size_t rank = std::min(samples.size() - 1, samples.size() * percent / 100);
+        std::nth_element(samples.begin(), samples.begin() + static_cast<long>(rank), samples.end());
+        return samples[rank];
+    }
+
+    // The route of a request class with healthy backends first; backends cooling
+    // down after failures are kept at the end as a last resort.
+    std::vector<Backend*> route(RequestClass request_class) {
+        std::vector<Backend*> healthy, cooling_down;
+        const auto route_it = ROUTES.find(request_class_name(request_class));
+        if (route_it == ROUTES.end()) {
+            return healthy;
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        const auto now = Clock::now();
+        for (const auto& name : route_it->second) {
+            Backend& backend = backends_.at(name);
+            (now >= backend.unhealthy_until ? healthy : cooling_down).push_back(&backend);
+        }
+        healthy.insert(healthy.end(), cooling_down.begin(), cooling_down.end());
+        return healthy;
+    }
+
+    // How long to wait for a first token before hedging, or a negative value when
+    // hedging is disabled or the backend has too few samples for this class.
+    double hedge_delay_ms(Backend* backend, RequestClass request_class) {
+        if (HEDGE_PERCENTILE == 0) {
+            return -1.0;
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        const auto& samples = backend->first_token_ms[request_class];
+        if (samples.size() < HEDGE_MIN_SAMPLES) {
+            return -1.0;
+        }
+        return percentile({samples.begin(), samples.end()}, HEDGE_PERCENTILE);
+    }
+
+    void record_success(Backend* backend, RequestClass request_class, double first_token_ms) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        backend->consecutive_failures = 0;
+        auto& samples = backend->first_token_ms[request_class];
+        samples.push_back(first_token_ms);
+        if (samples.size() > LATENCY_WINDOW) {
+            samples.pop_front();
+        }
+    }
+
+    void record_failure(Backend* backend) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        ++backend->failures;
+        if (++backend->consecutive_failures == BACKEND_FAILURE_THRESHOLD) {
+            backend->unhealthy_until = Clock::now() + std::chrono::milliseconds(BACKEND_COOLDOWN_MS);
+            std::cout << "[llm] backend " << backend->name << " failed " << backend->consecutive_failures
+                      << " times in a row; skipping it for " << BACKEND_COOLDOWN_MS << " ms\n";
+            backend->consecutive_failures = 0;
+        }
+    }
+
+    void count(size_t Backend::*counter, Backend* backend) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        ++(backend->*counter);
+    }
+
+    // One request sent to one backend on behalf of a Call.
+    struct Attempt {
+        Backend* backend = nullptr;
+        HttpEngine::RequestId id = 0;
+        std::unique_ptr<SseParser> parser;
+        Clock::time_point started;
+        ChatResult result;
+        std::string server_error;
+        double first_token_ms = -1.0;  // since this attempt started
+        bool done = false;
+        bool cancelled = false;
+    };
+
+    // State of one chat_async() request. Everything after construction runs on
+    // the engine thread, so no locking is needed.
+    struct Call : std::enable_shared_from_this<Call> {
+        LlmClient* client = nullptr;
+        RequestClass request_class = RequestClass::Analysis;
+        json body;
+        DeltaCallback on_delta;
+        DoneCallback on_done;
+        Clock::time_point started;
+        Clock::time_point deadline = Clock::time_point::max();
+        std::vector<Backend*> candidates;
+        size_t next_candidate = 0;
+        std::vector<std::unique_ptr<Attempt>> attempts;
+        Attempt* winner = nullptr;  // the attempt whose answer is passed on
+        std::exception_ptr last_error;
+        std::shared_ptr<CancelToken> cancel;
+        size_t cancel_subscription = 0;
+        bool hedged = false;
+        bool finished = false;
+
+        void launch() {
+            if (finished) {
+                return;  // cancelled before it was sent
+            }
+            candidates = client->route(request_class);
+            if (!start_next()) {
+                give_up();
+                return;
+            }
+            const double delay_ms = client->hedge_delay_ms(attempts.front()->backend, request_class);
+            if (delay_ms >= 0.0) {
+                std::weak_ptr<Call> weak = shared_from_this();
+                client->engine_.schedule(std::chrono::milliseconds(std::llround(delay_ms)), [weak] {
+                    if (auto call = weak.lock()) {
+                        call->hedge();
+                    }
+                });
+            }
+        }
+
+        bool start_next() {
+            return next_candidate < candidates.size() && start_attempt(candidates[next_candidate++]);
+        }
+
+        // Sends the request to backend; false when the deadline leaves no time for it.
+        bool start_attempt(Backend* backend) {
+            const auto now = Clock::now();
+            long timeout_ms = 0;
+            if (deadline != Clock::time_point::max()) {
+                timeout_ms = static_cast<long>(std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now).count());
+                if (timeout_ms <= 0) {
+                    return false;
+                }
+            }
+            attempts.push_back(std::make_unique<Attempt>());
+            Attempt* attempt = attempts.back().get();
+            attempt->backend = backend;
+            attempt->started = now;
+            attempt->parser = std::make_unique<SseParser>([this, attempt](const std::string& data) {
+                handle_event(*attempt, data);
+            });
+
+            json request_body = body;
+            request_body["model"] = backend->config.model;
+
+            auto self = shared_from_this();
+            HttpEngine::DataCallback on_data;
+            if (STREAM_RESPONSES) {
+                on_data = [self, attempt](const char* data, size_t size) {
+                    if (!attempt->cancelled) {
+                        attempt->parser->feed(data, size);
+                    }
+                };
+            }
+            HttpEngine::DoneCallback on_done = [self, attempt](HttpEngine::Response&& response) {
+                self->attempt_done(*attempt, std::move(response));
+            };
+            client->count(&Backend::requests, backend);
+            if (backend->local) {
+                attempt->id = client->local_->submit(std::move(request_body), timeout_ms, std::move(on_data),
+                                                     std::move(on_done));
+                return true;
+            }
+            HttpEngine::Request request;
+            request.url = backend->url;
+            request.headers = {
+                "Content-Type: application/json",
+                "Authorization: Bearer " + backend->config.api_key
+            };
+            request.body = request_body.dump();
+            request.timeout_ms = timeout_ms;
+            attempt->id = client->engine_.submit(std::move(request), std::move(on_data), std::move(on_done));
+            return true;
+        }
+
+        size_t in_flight() const {
+            return static_cast<size_t>(std::count_if(attempts.begin(), attempts.end(), [](const auto& attempt) {
+                return !attempt->done && !attempt->cancelled;
+            }));
+        }
+
+        void hedge() {
+            if (finished || winner || in_flight() != 1) {
+                return;
+            }
+            Backend* backend = next_candidate < candidates.size() ? candidates[next_candidate++]
+                                                                  : attempts.front()->backend;
+            if (start_attempt(backend)) {
+                hedged = true;
+                client->count(&Backend::hedges, backend);
+            }
+        }
+
+        void cancel_others(const Attempt* keep) {
+            for (auto& attempt : attempts) {
+                if (attempt.get() != keep && !attempt->done && !attempt->cancelled) {
+                    attempt->cancelled = true;
+                    if (attempt->backend->local) {
+                        client->local_->cancel(attempt->id);
+                    } else {
+                        client->engine_.cancel(attempt->id);
+                    }
+                }
+            }
+        }
+
+        void handle_delta(Attempt& attempt, const std::string& delta) {
+            if (delta.empty()) {
+                return;
+            }
+            if (attempt.first_token_ms < 0) {
+                attempt.first_token_ms = std::chrono::duration<double, std::milli>(Clock::now() - attempt.started).count();
+            }
+            if (!winner) {
+                winner = &attempt;
+                cancel_others(winner);
+            }
+            if (winner != &attempt) {
+                return;
+            }
+            if (attempt.result.first_token_ms < 0) {
+                attempt.result.first_token_ms = std::chrono::duration<double, std::milli>(Clock::now() - started).count();
+            }
+            attempt.result.content += delta;
+            if (on_delta) {
+                on_delta(delta);
+            }
+        }
+
+        void handle_event(Attempt& attempt, const std::string& data) {
+            if (data == "[DONE]" || !attempt.server_error.empty()) {
+                return;
+            }
+            json chunk = json::parse(data, nullptr, false);
+            if (chunk.is_discarded()) {
+                return;
+            }
+            if (chunk.contains("error")) {
+                attempt.server_error = chunk["error"].dump();
+                return;
+            }
+            handle_delta(attempt, extract_delta_content(chunk));
+            if (chunk.contains("usage") && chunk["usage"].is_object()) {
+                attempt.result.usage = chunk["usage"];
+            }
+            attempt.result.payload = std::move(chunk);
+        }
+
+        // Checks the finished transfer and, without streaming, takes its answer.
+        std::exception_ptr evaluate(Attempt& attempt, HttpEngine::Response& response) {
+            attempt.parser->finish();
+            attempt.result.timing = response.timing;
+            const std::string source = "Backend " + attempt.backend->name + ": ";
+            try {
+                if (response.code != CURLE_OK) {
+                    throw std::runtime_error(source + "HTTP request failed: " + curl_easy_strerror(response.code));
+                }
+                if (response.status >= 400) {
+                    constexpr size_t ERROR_BODY_LIMIT = 4096;
+                    throw std::runtime_error(source + "HTTP " + std::to_string(response.status) + ": " +
+                                             response.body.substr(0, ERROR_BODY_LIMIT));
+                }
+                if (!attempt.server_error.empty()) {
+                    throw std::runtime_error(source + "Server error: " + attempt.server_error);
+                }
+                if (!STREAM_RESPONSES) {
+                    attempt.result.payload = json::parse(response.body, nullptr, false);
+                    if (attempt.result.payload.is_discarded()) {
+                        throw std::runtime_error(source + "Response is not valid JSON: " + response.body.substr(0, 256));
+                    }
+                    if (attempt.result.payload.contains("error")) {
+                        throw std::runtime_error(source + "Server error: " + attempt.result.payload["error"].dump());
+                    }
+                    if (attempt.result.payload.contains("usage") && attempt.result.payload["usage"].is_object()) {
+                        attempt.result.usage = attempt.result.payload["usage"];
+                    }
+                    handle_delta(attempt, extract_message_content(attempt.result.payload));
+                }
+            } catch (const std::exception&) {
+                return std::current_exception();
+            }
+            return nullptr;
+        }
+
+        void attempt_done(Attempt& attempt, HttpEngine::Response&& response) {
+            attempt.done = true;
+            if (attempt.cancelled || finished) {
+                return;
+            }
+            std::exception_ptr error = evaluate(attempt, response);
+            if (!error) {
+                if (!winner) {
+                    winner = &attempt;  // a successful but empty answer
+                }
+                client->record_success(attempt.backend, request_class,
+                                       attempt.first_token_ms >= 0 ? attempt.first_token_ms
+                                                                   : attempt.result.timing.server_ms);
+                finish(&attempt, nullptr);
+                return;
+            }
+
+            client->record_failure(attempt.backend);
+            last_error = error;
+            if (winner == &attempt) {
+                finish(&attempt, error);  // failed part way through an answer already passed on
+                return;
+            }
+            if (in_flight() > 0) {
+                return;  // a hedged attempt may still answer
+            }
+            if (start_next()) {
+                client->count(&Backend::failovers, attempts.back()->backend);
+                std::cout << "[llm] " << request_class_name(request_class) << " request failing over from "
+                          << attempt.backend->name << " to " << attempts.back()->backend->name << "\n";
+                return;
+            }
+            give_up();
+        }
+
+        // Cancels every attempt still in flight, freeing its backend slot, and
+        // fails the call.
+        void abort() {
+            if (finished) {
+                return;
+            }
+            for (auto& attempt : attempts) {
+                if (!attempt->done && !attempt->cancelled) {
+                    client->count(&Backend::cancelled, attempt->backend);
+                    std::cout << "[llm] " << request_class_name(request_class) << " request to "
+                              << attempt->backend->name << " cancelled after "
+                              << std::llround(std::chrono::duration<double, std::milli>(Clock::now() - attempt->started).count())
+                              << " ms\n";
+                }
+            }
+            finish(nullptr, std::make_exception_ptr(RequestCancelled()));
+        }
+
+        void give_up() {
+            if (!last_error) {
+                last_error = std::make_exception_ptr(std::runtime_error(
+                    Clock::now() >= deadline ? "Deadline exceeded before the request could be sent"
+                                             : "No backend configured for this request"));
+            } else if (Clock::now() >= deadline) {
+                try {
+                    std::rethrow_exception(last_error);
+                } catch (const std::exception& e) {
+                    last_error = std::make_exception_ptr(std::runtime_error(std::string{"Deadline exceeded; "} + e.what()));
+                }
+            }
+            finish(nullptr, last_error);
+        }
+
+        void finish(Attempt* attempt, std::exception_ptr error) {
+            finished = true;
+            cancel_others(attempt);
+            if (cancel) {
+                cancel->unsubscribe(cancel_subscription);
+            }
+            ChatResult result;
+            if (attempt) {
+                result = std::move(attempt->result);
+                result.backend = attempt->backend->name;
+                result.model = attempt->backend->config.model;
+            }
+            result.total_ms = std::chrono::duration<double, std::milli>(Clock::now() - started).count();
+            result.attempts = attempts.size();
+            result.hedged = hedged;
+            on_done(std::move(result), error);
+        }
+    };
+
+    HttpEngine& engine_;
+    ResponseCache* cache_;
+    LocalLlm* local_;
+    std::map<std::string, Backend> backends_;
+    mutable std::mutex mutex_;
+};
+
+// Finds the end of the first complete sentence in text, or npos. Short fragments
+// such as "Dr." are not treated as sentences.
+size_t find_sentence_end(const std::string& text, size_t min_length = 12) {
+    for (size_t i = min_length; i + 1 < text.size(); ++i) {
+        const char c = text[i];
+        if ((c == '.' || c == '!' || c == '?') && std::isspace(static_cast<unsigned char>(text[i + 1]))) {
+            return i + 1;
+        }
+        if (c == '\n' && text[i + 1] == '\n') {
+            return i;
+        }
+    }
+    return std::string::npos;
+}
+
+// Records time-to-first-token, total latency and the connection/server split of a
+// completion in the results file and on stdout.
+void report_timing(std::ostream& file, const std::string& label, const ChatResult& chat) {
+    const RequestTiming& t = chat.timing;
+    std::ostringstream oss;
+    if (chat.cached) {
+        oss << std::fixed << std::setprecision(1)
+            << "Answered from the response cache in " << chat.total_ms << " ms (originally by "
+            << chat.backend << ", " << chat.model << ")\n";
+        file << oss.str();
+        std::cout << "[timing] " << label << ": " << oss.str();
+        return;
+    }
+    oss << std::fixed << std::setprecision(0)
+        << "Time to first token: " << chat.first_token_ms << " ms, total: " << chat.total_ms << " ms\n"
+        << std::setprecision(1);
+    if (t.in_process) {
+        oss << "In-process: queue and prompt " << t.server_ms << " ms, generation " << t.transfer_ms << " ms\n";
+    } else {
+        oss << "Connection: " << (t.reused_connection ? "reused" : "new")
+            << ", HTTP " << (t.http_version == CURL_HTTP_VERSION_2_0 ? "2" : "1.1")
+            << ", dns " << t.dns_ms << " ms, connect " << t.connect_ms << " ms, tls " << t.tls_ms
+            << " ms, server " << t.server_ms << " ms, transfer " << t.transfer_ms << " ms\n";
+    }
+    oss << "Backend: " << chat.backend << " (" << chat.model << "), " << chat.attempts
+        << (chat.attempts == 1 ? " attempt" : " attempts") << (chat.hedged ? ", hedged" : "") << "\n";
+    file << oss.str();
+    std::cout << "[timing] " << label << ": " << oss.str();
+}
+
+// =======================
+// Results store
+// =======================
+
+// Local time as ISO 8601, which sorts chronologically as a string.
+std::string iso_time_now() {
+    const std::time_t now = std::time(nullptr);
+    std::tm local{};
+    localtime_r(&now, &local);
+    std::ostringstream oss;
+    oss << std::put_time(&local, "%Y-%m-%dT%H:%M:%S");
+    return oss.str();
+}
+
+bool write_all(int fd, const char* data, size_t size) {
+    while (size > 0) {
+        const ssize_t n = write(fd, data, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        data += n;
+        size -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+// Writes all result output on a dedicated thread so analyses never block on
+// disk I/O. Queued operations are drained in batches:
+//  - the human-readable results_analysisN.txt files, streamed as before;
+//  - one JSON record per analysis, appended to rotating segments
+//    RESULTS_DIR/analyses-NNNNNN.jsonl;
+//  - an index RESULTS_DIR/index.jsonl with recording ID, time, segment and byte
+//    offset of every record, for lookups without scanning the segments.
+class ResultsWriter {
+public:
+    ~ResultsWriter() {
+        shutdown();
+    }
+
+    // Opens the store and returns the highest recording ID already in it, so
+    // numbering continues across launches instead of overwriting old results.
+    int start() {
+        namespace fs = std::filesystem;
+        std::error_code ec;
+        fs::create_directories(RESULTS_DIR, ec);
+        if (ec) {
+            std::cerr << "[ERROR] Unable to create results directory " << RESULTS_DIR << ": " << ec.message() << "\n";
+        }
+
+        int last_recording = 0;
+        std::ifstream index(index_path());
+        std::string line;
+        while (std::getline(index, line)) {
+            const json entry = json::parse(line, nullptr, false);
+            if (entry.is_object()) {
+                last_recording = std::max(last_recording, entry.value("recording", 0));
+            }
+        }
+        // Results written before the store existed only left their text files.
+        for (const auto& entry : fs::directory_iterator(".", ec)) {
+            const std::string name = entry.path().filename().string();
+            const std::string prefix = "results_analysis";
+            if (name.compare(0, prefix.size(), prefix) == 0) {
+                last_recording = std::max(last_recording, std::atoi(name.c_str() + prefix.size()));
+            }
+        }
+
+        for (const auto& entry : fs::directory_iterator(RESULTS_DIR, ec)) {
+            const std::string name = entry.path().filename().string();
+            if (name.compare(0, 9, "analyses-") == 0) {
+                segment_number_ = std::max(segment_number_, std::atoi(name.c_str() + 9));
+            }
+        }
+        segment_number_ = std::max(segment_number_, 1);
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = false;
+        thread_ = std::thread(&ResultsWriter::run, this);
+        return last_recording;
+    }
+
+    // Creates (truncates) a text results file.
+    void open_file(const std::string& path) {
+        enqueue(Op{Op::Open, path, {}});
+    }
+
+    void append_file(const std::string& path, std::string data) {
+        if (!data.empty()) {
+            enqueue(Op{Op::Append, path, std::move(data)});
+        }
+    }
+
+    void close_file(const std::string& path) {
+        enqueue(Op{Op::Close, path, {}});
+    }
+
+    // Appends one structured record; it must carry "recording" and "analysis_id".
+    void record(const json& entry) {
+        enqueue(Op{Op::Record, {}, entry.dump()});
+    }
+
+    // Writes everything still queued, then stops the writer thread.
+    void shutdown() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!thread_.joinable() || stopping_) {
+                return;
+            }
+            stopping_ = true;
+        }
+        cv_.notify_all();
+        thread_.join();
+        for (auto& [path, fd] : files_) {
+            close(fd);
+        }
+        files_.clear();
+        if (segment_fd_ != -1) {
+            close(segment_fd_);
+        }
+        if (index_fd_ != -1) {
+            close(index_fd_);
+        }
+    }
+
+    std::string stats() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::ostringstream oss;
+        oss << "[results] records=" << records_
+            << " batches=" << batches_
+            << " max_batch=" << max_batch_
+            << " fsyncs=" << fsyncs_
+            << " write_errors=" << errors_ << "\n";
+        return oss.str();
+    }
+
+    // Prints the stored records of one recording (recording > 0) or of all
+    // recordings since an ISO time, using the index to seek into the segments.
+    static void lookup(int recording, const std::string& since, std::ostream& out) {
+        std::ifstream index(index_path());
+        std::string line;
+        while (std::getline(index, line)) {
+            const json entry = json::parse(line, nullptr, false);
+            if (!entry.is_object()) {
+                continue;
+            }
+            if (recording > 0 && entry.value("recording", 0) != recording) {
+                continue;
+            }
+            if (!since.empty() && entry.value("time", std::string{}) < since) {
+                continue;
+            }
+            std::ifstream segment(std::filesystem::path(RESULTS_DIR) / entry.value("segment", std::string{}),
+                                  std::ios::binary);
+            segment.seekg(static_cast<std::streamoff>(entry.value("offset", 0LL)));
+            std::string record;
+            if (std::getline(segment, record)) {
+                out << record << "\n";
+            }
+        }
+    }
+
+private:
+    struct Op {
+        enum Kind { Open, Append, Close, Record } kind;
+        std::string path;
+        std::string data;
+    };
+
+    static std::string index_path() {
+        return (std::filesystem::path(RESULTS_DIR) / "index.jsonl").string();
+    }
+
+    std::string segment_name() const {
+        std::ostringstream oss;
+        oss << "analyses-" << std::setw(6) << std::setfill('0') << segment_number_ << ".jsonl";
+        return oss.str();
+    }
+
+    void enqueue(Op op) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            queue_.push_back(std::move(op));
+        }
+        cv_.notify_one();
+    }
+
+    void run() {
+        for (;;) {
+            std::deque<Op> batch;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                cv_.wait(lock, [this] { return stopping_ || !queue_.empty(); });
+                if (queue_.empty()) {
+                    return;
+                }
+                batch.swap(queue_);
+                ++batches_;
+                max_batch_ = std::max(max_batch_, batch.size());
+            }
+
+            bool wrote_record = false;
+            for (auto& op : batch) {
+                switch (op.kind) {
+                case Op::Open:
+                    open_text_file(op.path, O_TRUNC);
+                    break;
+                case Op::Append: {
+                    const int fd = open_text_file(op.path, O_APPEND);
+                    if (fd != -1 && !write_all(fd, op.data.data(), op.data.size())) {
+                        report_error("Writing to results file " + op.path + " failed");
+                    }
+                    break;
+                }
+                case Op::Close: {
+                    auto it = files_.find(op.path);
+                    if (it != files_.end()) {
+                        close(it->second);
+                        files_.erase(it);
+                    }
+                    break;
+                }
+                case Op::Record:
+                    write_record(op.data);
+                    wrote_record = true;
+                    break;
+                }
+            }
+            if (wrote_record && RESULTS_FSYNC == "batch") {
+                sync_store();
+            }
+        }
+    }
+
+    int open_text_file(const std::string& path, int mode) {
+        auto it = files_.find(path);
+        if (it != files_.end()) {
+            if (mode == O_TRUNC) {
+                ftruncate(it->second, 0);
+            }
+            return it->second;
+        }
+        const int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC | (mode == O_TRUNC ? O_TRUNC : O_APPEND), 0644);
+        if (fd == -1) {
+            report_error("Unable to open results file: " + path);
+            return -1;
+        }
+        files_[path] = fd;
+        return fd;
+    }
+
+    void write_record(std::string line) {
+        const json entry = json::parse(line, nullptr, false);
+        line.push_back('\n');
+
+        if (segment_fd_ != -1 && segment_size_ > 0 && segment_size_ + line.size() > RESULTS_SEGMENT_BYTES) {
+            close(segment_fd_);
+            segment_fd_ = -1;
+            ++segment_number_;
+        }
+        if (segment_fd_ == -1) {
+            const std::string path = (std::filesystem::path(RESULTS_DIR) / segment_name()).string();
+            segment_fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+            if (segment_fd_ == -1) {
+                report_error("Unable to open results segment " + path);
+                return;
+            }
+            segment_size_ = static_cast<size_t>(lseek(segment_fd_, 0, SEEK_END));
+        }
+        if (index_fd_ == -1) {
+            index_fd_ = ::open(index_path().c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+            if (index_fd_ == -1) {
+                report_error("Unable to open results index " + index_path());
+                return;
+            }
+        }
+
+        const size_t offset = segment_size_;
+        if (!write_all(segment_fd_, line.data(), line.size())) {
+            report_error("Writing results record failed");
+            return;
+        }
+        segment_size_ += line.size();
+
+        const json index_entry = {
+            {"recording", entry.value("recording", 0)},
+            {"analysis_id", entry.value("analysis_id", std::string{})},
+            {"kind", entry.value("kind", std::string{})},
+            {"time", entry.value("time", std::string{})},
+            {"segment", segment_name()},
+            {"offset", offset},
+            {"length", line.size()}
+        };
+        const std::string index_line = index_entry.dump() + "\n";
+        if (!write_all(index_fd_, index_line.data(), index_line.size())) {
+            report_error("Writing results index failed");
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            ++records_;
+        }
+        if (RESULTS_FSYNC == "always") {
+            sync_store();
+        }
+    }
+
+    void sync_store() {
+        if (segment_fd_ != -1) {
+            fsync(segment_fd_);
+        }
+        if (index_fd_ != -1) {
+            fsync(index_fd_);
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        ++fsyncs_;
+    }
+
+    void report_error(const std::string& message) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            ++errors_;
+        }
+        say_error("[ERROR] " + message + "\n");
+    }
+
+    mutable std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<Op> queue_;
+    std::thread thread_;
+    bool stopping_ = false;
+
+    // Owned by the writer thread.
+    std::map<std::string, int> files_;
+    int segment_number_ = 0;
+    int segment_fd_ = -1;
+    size_t segment_size_ = 0;
+    int index_fd_ = -1;
+
+    size_t records_ = 0;
+    size_t batches_ = 0;
+    size_t max_batch_ = 0;
+    size_t fsyncs_ = 0;
+    size_t errors_ = 0;
+};
+
+ResultsWriter results_writer;
+
+// std::ostream over a text results file; whatever is written is handed to the
+// ResultsWriter on every flush and when the stream is destroyed.
+class ResultsFile : public std::ostream {
+public:
+    explicit ResultsFile(const std::string& path) : std::ostream(&buffer_), buffer_(path) {
+        results_writer.open_file(path);
+    }
+
+    ~ResultsFile() override {
+        buffer_.pubsync();
+        results_writer.close_file(buffer_.path());
+    }
+
+private:
+    class Buffer : public std::stringbuf {
+    public:
+        explicit Buffer(std::string path) : path_(std::move(path)) {}
+        const std::string& path() const { return path_; }
+
+    protected:
+        int sync() override {
+            results_writer.append_file(path_, str());
+            str({});
+            return 0;
+        }
+
+    private:
+        std::string path_;
+    };
+
+    Buffer buffer_;
+};
+
+// Timing and usage of a completion in the shape stored in result records.
+json chat_record(const ChatResult& chat) {
+    const RequestTiming& t = chat.timing;
+    return {
+        {"first_token_ms", chat.first_token_ms},
+        {"total_ms", chat.total_ms},
+        {"connect_ms", t.dns_ms + t.connect_ms + t.tls_ms},
+        {"server_ms", t.server_ms},
+        {"reused_connection", t.reused_connection},
+        {"backend", chat.backend},
+        {"model", chat.model},
+        {"attempts", chat.attempts},
+        {"hedged", chat.hedged},
+        {"cached", chat.cached},
+        {"usage", chat.usage}
+    };
+}
+
+// Fixed pool of analysis workers fed from a bounded FIFO queue. Jobs start in
+// trigger order; with more than one worker they may finish out of order. The
+// workers bound how many analyses run at once; their HTTP traffic is driven by
+// the HttpEngine behind the shared LlmClient. Jobs may carry a coalescing key:
+// a job submitted while another with the same key is still queued takes over
+// that job's place in the queue, and cancel() drops queued jobs by key and
+// optionally aborts running ones through their CancelToken.
+class AnalysisQueue {
+public:
+    using Clock = std::chrono::steady_clock;
+    using JobFn = std::function<void(LlmClient&)>;
+
+    AnalysisQueue(LlmClient& client, size_t workers, size_t capacity) : client_(client), capacity_(capacity) {
+        workers_.reserve(workers);
+        for (size_t i = 0; i < workers; ++i) {
+            workers_.emplace_back(&AnalysisQueue::worker_loop, this);
+        }
+    }
+
+    ~AnalysisQueue() {
+        shutdown();
+    }
+
+    AnalysisQueue(const AnalysisQueue&) = delete;
+    AnalysisQueue& operator=(const AnalysisQueue&) = delete;
+
+    // Returns false when the queue is full or already shutting down.
+    bool submit(std::string label, JobFn fn, std::string key = "") {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (stopping_) {
+                ++rejected_;
+                return false;
+            }
+            if (!key.empty()) {
+                const auto queued = std::find_if(jobs_.begin(), jobs_.end(), [&key](const Job& job) {
+                    return job.key == key;
+                });
+                if (queued != jobs_.end()) {
+                    std::cout << "[queue] " << label << " replaces the still queued " << queued->label << "\n";
+                    queued->label = std::move(label);
+                    queued->fn = std::move(fn);
+                    ++coalesced_;
+                    return true;
+                }
+            }
+            if (jobs_.size() >= capacity_) {
+                ++rejected_;
+                return false;
+            }
+            jobs_.push_back(Job{std::move(label), std::move(fn), Clock::now(), std::move(key),
+                                std::make_shared<CancelToken>()});
+            max_depth_ = std::max(max_depth_, jobs_.size());
+        }
+        cv_.notify_one();
+        return true;
+    }
+
+    // Drops the queued jobs with this key and, with running, aborts the running
+    // ones; returns how many jobs were affected.
+    size_t cancel(const std::string& key, bool running = false) {
+        std::vector<std::shared_ptr<CancelToken>> aborted;
+        size_t dropped = 0;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            const auto first = std::remove_if(jobs_.begin(), jobs_.end(), [&key](const Job& job) {
+                return job.key == key;
+            });
+            dropped = static_cast<size_t>(std::distance(first, jobs_.end()));
+            for (auto it = first; it != jobs_.end(); ++it) {
+                std::cout << "[queue] " << it->label << " cancelled before it started\n";
+            }
+            jobs_.erase(first, jobs_.end());
+            cancelled_ += dropped;
+            if (running) {
+                for (const auto& job : running_) {
+                    if (job.key == key && !job.cancel->cancelled()) {
+                        std::cout << "[queue] " << job.label << " aborted while running\n";
+                        aborted.push_back(job.cancel);
+                    }
+                }
+                aborted_ += aborted.size();
+            }
+        }
+        for (const auto& token : aborted) {
+            token->cancel();
+        }
+        return dropped + aborted.size();
+    }
+
+    // Stops accepting jobs, runs everything already queued, then joins the workers.
+    void shutdown() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (stopping_) {
+                return;
+            }
+            stopping_ = true;
+        }
+        cv_.notify_all();
+        for (auto& worker : workers_) {
+            if (worker.joinable()) {
+                worker.join();
+            }
+        }
+    }
+
+    size_t depth() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return jobs_.size();
+    }
+
+    size_t busy() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return busy_;
+    }
+
+    std::string stats() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::ostringstream oss;
+        oss << "[queue] workers=" << workers_.size()
+            << " completed=" << completed_
+            << " rejected=" << rejected_
+            << " coalesced=" << coalesced_
+            << " cancelled=" << cancelled_
+            << " aborted=" << aborted_
+            << " depth=" << jobs_.size()
+            << " max_depth=" << max_depth_
+            << " avg_wait_ms=" << (completed_ ? total_wait_ms_ / static_cast<long long>(completed_) : 0)
+            << " max_wait_ms=" << max_wait_ms_ << "\n";
+        return oss.str();
+    }
+
+private:
+    struct Job {
+        std::string label;
+        JobFn fn;
+        Clock::time_point enqueued;
+        std::string key;  // coalescing key, empty for none
+        std::shared_ptr<CancelToken> cancel;
+    };
+
+    struct RunningJob {
+        std::string label;
+        std::string key;
+        std::shared_ptr<CancelToken> cancel;
+    };
+
+    void worker_loop() {
+        for (;;) {
+            Job job;
+            size_t remaining = 0;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                cv_.wait(lock, [this] { return stopping_ || !jobs_.empty(); });
+                if (jobs_.empty()) {
+                    return; // stopping and drained
+                }
+                job = std::move(jobs_.front());
+                jobs_.pop_front();
+                remaining = jobs_.size();
+                ++busy_;
+                running_.push_back(RunningJob{job.label, job.key, job.cancel});
+            }
+
+            const long long wait_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                Clock::now() - job.enqueued).count();
+            std::cout << "[queue] " << job.label << " waited " << wait_ms
+                      << " ms; " << remaining << " still queued\n";
+
+            CancelToken::current() = job.cancel;
+            try {
+                job.fn(client_);
+            } catch (const std::exception& e) {
+                std::cerr << "[ERROR] " << job.label << " aborted: " << e.what() << "\n";
+            }
+            CancelToken::current().reset();
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            running_.erase(std::find_if(running_.begin(), running_.end(), [&job](const RunningJob& running) {
+                return running.cancel == job.cancel;
+            }));
+            --busy_;
+            ++completed_;
+            total_wait_ms_ += wait_ms;
+            max_wait_ms_ = std::max(max_wait_ms_, wait_ms);
+        }
+    }
+
+    LlmClient& client_;
+    const size_t capacity_;
+    std::vector<std::thread> workers_;
+    mutable std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<Job> jobs_;
+    std::vector<RunningJob> running_;
+    bool stopping_ = false;
+    size_t busy_ = 0;
+    size_t completed_ = 0;
+    size_t rejected_ = 0;
+    size_t coalesced_ = 0;
+    size_t cancelled_ = 0;  // dropped before they started
+    size_t aborted_ = 0;    // cancelled while running
+    size_t max_depth_ = 0;
+    long long total_wait_ms_ = 0;
+    long long max_wait_ms_ = 0;
+};
+
+// Rolling state of the temporary checks of one recording: the latest answer and
+// how much of the transcript it already covers.
+struct TempCheckState {
+    explicit TempCheckState(int recording) : recording_id(recording) {}
+
+    const int recording_id;
+    std::mutex mutex;
+    size_t cursor = 0;
+    std::string last_answer;
+};
+
+// Rough token estimate for logging when the server does not report usage.
+size_t estimate_tokens(size_t chars) {
+    return (chars + 3) / 4;
+}
+
+// Logs what normalisation removed from the transcript of one analysis.
+void report_normalization(std::ostream& file, const std::string& label, const NormalizationStats& stats, json& record) {
+    if (stats.raw_chars == 0) {
+        return;
+    }
+    const size_t saved = estimate_tokens(stats.raw_chars) - std::min(estimate_tokens(stats.raw_chars),
+                                                                     estimate_tokens(stats.kept_chars));
+    std::ostringstream oss;
+    oss << "Transcript normalised from " << stats.raw_chars << " to " << stats.kept_chars << " chars (~" << saved
+        << " tokens saved): fillers=" << stats.fillers << " repeated_words=" << stats.repeated_words
+        << " duplicate_lines=" << stats.duplicate_lines << " seam_words=" << stats.seam_words
+        << " numbers=" << stats.numbers << " units=" << stats.units << " trigger_words=" << stats.trigger_words << "\n";
+    file << oss.str();
+    std::cout << "[tokens] " << label << ": " << oss.str();
+    record["normalization"] = stats.to_json();
+    record["normalization"]["tokens_saved"] = saved;
+}
+
+// Prompt tokens the server served from its prompt cache, or -1 when not reported.
+// OpenAI-compatible servers (vLLM, OpenWebUI) use usage.prompt_tokens_details,
+// the llama.cpp server reports timings.cache_n.
+long long cached_prompt_tokens(const ChatResult& chat) {
+    if (chat.usage.is_object()) {
+        const auto details = chat.usage.find("prompt_tokens_details");
+        if (details != chat.usage.end() && details->is_object() && details->contains("cached_tokens")) {
+            return details->value("cached_tokens", 0LL);
+        }
+    }
+    if (chat.payload.is_object()) {
+        const auto timings = chat.payload.find("timings");
+        if (timings != chat.payload.end() && timings->is_object() && timings->contains("cache_n")) {
+            return timings->value("cache_n", 0LL);
+        }
+    }
+    return -1;
+}
+
+std::string describe_usage(const ChatResult& chat) {
+    std::ostringstream oss;
+    if (chat.usage.is_object()) {
+        oss << "prompt=" << chat.usage.value("prompt_tokens", 0)
+            << " completion=" << chat.usage.value("completion_tokens", 0);
+    } else {
+        oss << "not reported";
+    }
+    const long long cached = cached_prompt_tokens(chat);
+    if (cached >= 0) {
+        oss << " cached=" << cached;
+    }
+    if (chat.cached) {
+        oss << " (original request; answered from the response cache)";
+    }
+    return oss.str();
+}
+
+// Builds the messages for fixed instructions and the variable part of a request.
+// With the prompt cache layout the instructions become the system message, so
+// every request with the same instructions shares a byte-identical prefix the
+// server can keep in its KV cache; otherwise both go into one user message.
+json build_messages(const std::string& instructions, const std::string& content) {
+    if (PROMPT_CACHE_LAYOUT) {
+        return json::array({
+            {{"role", "system"}, {"content", instructions}},
+            {{"role", "user"}, {"content", content}}
+        });
+    }
+    return json::array({
+        {{"role", "system"}, {"content", "You are a helpful assistant."}},
+        {{"role", "user"}, {"content", instructions + "\n" + content}}
+    });
+}
+
+// Asks llama.cpp-style servers to reuse the cached prompt prefix and, when slots
+// are configured, pins every request of a recording to the same server slot.
+void apply_cache_hints(json& body, int recording_id) {
+    if (!PROMPT_CACHE_LAYOUT) {
+        return;
+    }
+    body["cache_prompt"] = true;
+    if (PROMPT_CACHE_SLOTS > 0) {
+        body["id_slot"] = static_cast<int>(static_cast<size_t>(recording_id) % PROMPT_CACHE_SLOTS);
+    }
+}
+
+// =======================
+// FHIR output
+// =======================
+
+// Resource types of the supported FHIR subset and the fields each must carry.
+const std::map<std::string, std::vector<std::string>> FHIR_REQUIRED_FIELDS = {
+    {"Patient", {}},
+    {"Encounter", {"status"}},
+    {"Observation", {"status", "code"}},
+    {"Condition", {"code"}},
+    {"Procedure", {"status", "code"}},
+    {"MedicationAdministration", {"status", "medicationCodeableConcept"}},
+    {"MedicationStatement", {"status", "medicationCodeableConcept"}},
+    {"AllergyIntolerance", {"code"}}
+};
+
+// JSON schema of a Bundle restricted to that subset, sent as response_format.
+const json& fhir_bundle_schema() {
+    static const json schema = [] {
+        json resources = json::array();
+        for (const auto& [type, fields] : FHIR_REQUIRED_FIELDS) {
+            json required = json::array({"resourceType"});
+            for (const auto& field : fields) {
+                required.push_back(field);
+            }
+            resources.push_back({
+                {"type", "object"},
+                {"properties", {{"resourceType", {{"const", type}}}}},
+                {"required", required}
+            });
+        }
+        return json{
+            {"type", "object"},
+            {"properties", {
+                {"resourceType", {{"const", "Bundle"}}},
+                {"type", {{"type", "string"}}},
+                {"entry", {
+                    {"type", "array"},
+                    {"items", {
+                        {"type", "object"},
+                        {"properties", {{"resource", {{"anyOf", resources}}}}},
+                        {"required", {"resource"}}
+                    }}
+                }}
+            }},
+            {"required", {"resourceType", "entry"}}
+        };
+    }();
+    return schema;
+}
+
+// Constrains an extraction request to the Bundle schema when fhir.response_format is on.
+void apply_response_format(json& body) {
+    if (!FHIR_RESPONSE_FORMAT) {
+        return;
+    }
+    body["response_format"] = {
+        {"type", "json_schema"},
+        {"json_schema", {{"name", "fhir_bundle"}, {"schema", fhir_bundle_schema()}}}
+    };
+}
+
+// Finds the JSON value opened by open in a model answer, which may be wrapped in
+// prose or a Markdown code fence. Returns a discarded value when there is none.
+json parse_json_answer(const std::string& text, char open = '{', char close = '}') {
+    const size_t first = text.find(open);
+    const size_t last = text.rfind(close);
+    if (first == std::string::npos || last == std::string::npos || last < first) {
+        return json(json::value_t::discarded);
+    }
+    return json::parse(text.substr(first, last - first + 1), nullptr, false);
+}
+
+json parse_json_object(const std::string& text) {
+    return parse_json_answer(text);
+}
+
+// Checks one Bundle entry against the supported subset; returns the problem, or
+// an empty string when the entry is valid.
+std::string check_bundle_entry(const json& entry) {
+    if (!entry.is_object()) {
+        return "entry is not an object";
+    }
+    const auto resource = entry.find("resource");
+    if (resource == entry.end() || !resource->is_object()) {
+        return "entry has no resource object";
+    }
+    const auto type = resource->find("resourceType");
+    if (type == resource->end() || !type->is_string()) {
+        return "resource has no resourceType";
+    }
+    const auto fields = FHIR_REQUIRED_FIELDS.find(type->get<std::string>());
+    if (fields == FHIR_REQUIRED_FIELDS.end()) {
+        return "unsupported resourceType " + type->get<std::string>();
+    }
+    for (const auto& field : fields->second) {
+        if (!resource->contains(field)) {
+            return type->get<std::string>() + " is missing " + field;
+        }
+    }
+    return {};
+}
+
+// Incremental JSON syntax checker for a streamed Bundle. Text before the first
+// '{' (prose, a code fence) is skipped. Every element of the top-level "entry"
+// array is handed to a callback as soon as it is closed, and parsing stops at
+// the first syntax error, so a broken answer is noticed while it streams.
+class BundleStreamParser {
+public:
+    using EntryCallback = std::function<void(const std::string&)>;
+
+    explicit BundleStreamParser(EntryCallback on_entry) : on_entry_(std::move(on_entry)) {}
+
+    void feed(const std::string& delta) {
+        for (char c : delta) {
+            text_.push_back(c);
+            if (failed_ || complete_) {
+                continue;
+            }
+            if (stack_.empty() && c != '{') {
+                continue;  // before the Bundle
+            }
+            step(c, text_.size() - 1);
+        }
+    }
+
+    // End of the answer; a Bundle that is still open is an error.
+    void finish() {
+        if (!failed_ && !complete_) {
+            fail(stack_.empty() ? "the answer contains no JSON object" : "the answer ends before the Bundle is closed");
+        }
+    }
+
+    bool failed() const { return failed_; }
+    bool complete() const { return complete_; }
+    const std::string& error() const { return error_; }
+    const std::string& text() const { return text_; }
+
+    // The complete Bundle text, once complete().
+    std::string bundle_text() const { return text_.substr(root_start_, root_end_ + 1 - root_start_); }
+
+    // After a failure inside the entry array: the unparsed rest of the answer from
+    // the end of the last complete entry. Empty when the failure was elsewhere.
+    std::string broken_entries() const {
+        return failed_ && in_entries_ ? text_.substr(remainder_start_) : std::string{};
+    }
+
+private:
+    enum class State {
+        ObjectKeyOrEnd, ObjectKey, ObjectColon, ObjectValue, ObjectCommaOrEnd,
+        ArrayValueOrEnd, ArrayValue, ArrayCommaOrEnd
+    };
+
+    struct Frame {
+        State state;
+        bool entries = false;  // the Bundle's entry array
+        std::string key;       // last key of an object
+    };
+
+    void fail(const std::string& message) {
+        failed_ = true;
+        error_ = "offset " + std::to_string(text_.size()) + ": " + message;
+    }
+
+    static bool valid_scalar(const std::string& token) {
+        if (token == "true" || token == "false" || token == "null") {
+            return true;
+        }
+        size_t i = token[0] == '-' ? 1 : 0;
+        auto digits = [&] {
+            const size_t from = i;
+            while (i < token.size() && std::isdigit(static_cast<unsigned char>(token[i]))) {
+                ++i;
+            }
+            return i - from;
+        };
+        const size_t integer_start = i;
+        if (digits() == 0 || (token[integer_start] == '0' && i - integer_start > 1)) {
+            return false;
+        }
+        if (i < token.size() && token[i] == '.') {
+            ++i;
+            if (digits() == 0) {
+                return false;
+            }
+        }
+        if (i < token.size() && (token[i] == 'e' || token[i] == 'E')) {
+            ++i;
+            if (i < token.size() && (token[i] == '+' || token[i] == '-')) {
+                ++i;
+            }
+            if (digits() == 0) {
+                return false;
+            }
+        }
+        return i == token.size();
+    }
+
+    void step(char c, size_t pos) {
+        if (in_string_) {
+            string_char(c);
+            if (!in_string_ && !failed_) {
+                if (string_is_key_) {
+                    stack_.back().key = key_;
+                    stack_.back().state = State::ObjectColon;
+                } else {
+                    value_done(pos);
+                }
+            }
+            return;
+        }
+        if (!scalar_.empty()) {
+            if (std::isalnum(static_cast<unsigned char>(c)) || c == '+' || c == '-' || c == '.') {
+                scalar_.push_back(c);
+                return;
+            }
+            if (!valid_scalar(scalar_)) {
+                fail("invalid value '" + scalar_ + "'");
+                return;
+            }
+            scalar_.clear();
+            value_done(pos - 1);
+        }
+        if (std::isspace(static_cast<unsigned char>(c))) {
+            return;
+        }
+        if (stack_.empty()) {
+            root_start_ = pos;
+            stack_.push_back(Frame{State::ObjectKeyOrEnd, false, {}});
+            return;
+        }
+
+        Frame& top = stack_.back();
+        switch (top.state) {
+        case State::ObjectKeyOrEnd:
+        case State::ObjectKey:
+            if (c == '}' && top.state == State::ObjectKeyOrEnd) {
+                close(pos);
+            } else if (c == '"') {
+                in_string_ = true;
+                string_is_key_ = true;
+                key_.clear();
+            } else {
+                fail(std::string{"expected a key, found '"} + c + "'");
+            }
+            break;
+        case State::ObjectColon:
+            if (c == ':') {
+                top.state = State::ObjectValue;
+            } else {
+                fail(std::string{"expected ':', found '"} + c + "'");
+            }
+            break;
+        case State::ArrayValueOrEnd:
+            if (c == ']') {
+                close(pos);
+                break;
+            }
+            [[fallthrough]];
+        case State::ObjectValue:
+        case State::ArrayValue:
+            start_value(c, pos);
+            break;
+        case State::ObjectCommaOrEnd:
+            if (c == ',') {
+                top.state = State::ObjectKey;
+            } else if (c == '}') {
+                close(pos);
+            } else {
+                fail(std::string{"expected ',' or '}', found '"} + c + "'");
+            }
+            break;
+        case State::ArrayCommaOrEnd:
+            if (c == ',') {
+                top.state = State::ArrayValue;
+            } else if (c == ']') {
+                close(pos);
+            } else {
+                fail(std::string{"expected ',' or ']', found '"} + c + "'");
+            }
+            break;
+        }
+    }
+
+    void string_char(char c) {
+        if (unicode_left_ > 0) {
+            if (!std::isxdigit(static_cast<unsigned char>(c))) {
+                fail("invalid \\u escape");
+                return;
+            }
+            --unicode_left_;
+        } else if (escape_) {
+            escape_ = false;
+            if (c == 'u') {
+                unicode_left_ = 4;
+            } else if (c == '\0' || std::string("\"\\/bfnrt").find(c) == std::string::npos) {
+                fail(std::string{"invalid escape '\\"} + c + "'");
+                return;
+            }
+        } else if (c == '\\') {
+            escape_ = true;
+        } else if (c == '"') {
+            in_string_ = false;
+            return;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            fail("control character in a string");
+            return;
+        }
+        if (string_is_key_) {
+            key_.push_back(c);
+        }
+    }
+
+    void start_value(char c, size_t pos) {
+        if (stack_.back().entries) {
+            entry_start_ = pos;
+        }
+        if (c == '{') {
+            stack_.push_back(Frame{State::ObjectKeyOrEnd, false, {}});
+        } else if (c == '[') {
+            const bool entries = stack_.size() == 1 && stack_.back().key == "entry";
+            stack_.push_back(Frame{State::ArrayValueOrEnd, entries, {}});
+            if (entries) {
+                in_entries_ = true;
+                remainder_start_ = pos + 1;
+            }
+        } else if (c == '"') {
+            in_string_ = true;
+            string_is_key_ = false;
+        } else if (c == '-' || std::isdigit(static_cast<unsigned char>(c)) || c == 't' || c == 'f' || c == 'n') {
+            scalar_.assign(1, c);
+        } else {
+            fail(std::string{"unexpected '"} + c + "'");
+        }
+    }
+
+    void close(size_t pos) {
+        if (stack_.back().entries) {
+            in_entries_ = false;
+        }
+        stack_.pop_back();
+        if (stack_.empty()) {
+            complete_ = true;
+            root_end_ = pos;
+            return;
+        }
+        value_done(pos);
+    }
+
+    // A value ending at end_pos is complete; its container expects a separator next.
+    void value_done(size_t end_pos) {
+        Frame& top = stack_.back();
+        if (top.entries) {
+            on_entry_(text_.substr(entry_start_, end_pos + 1 - entry_start_));
+            remainder_start_ = end_pos + 1;
+        }
+        const bool object = top.state == State::ObjectValue;
+        top.state = object ? State::ObjectCommaOrEnd : State::ArrayCommaOrEnd;
+    }
+
+    EntryCallback on_entry_;
+    std::string text_;  // everything fed, including text around the Bundle
+    std::vector<Frame> stack_;
+    bool in_string_ = false;
+    bool string_is_key_ = false;
+    bool escape_ = false;
+    int unicode_left_ = 0;
+    std::string key_;
+    std::string scalar_;
+    size_t root_start_ = 0;
+    size_t root_end_ = 0;
+    size_t entry_start_ = 0;
+    size_t remainder_start_ = 0;
+    bool in_entries_ = false;
+    bool complete_ = false;
+    bool failed_ = false;
+    std::string error_;
+};
+
+// Builds the valid Bundle from a streamed answer. Entries are checked as the
+// parser completes them and an invalid one is sent for a targeted repair right
+// away, so repairs overlap the rest of the stream. After a syntax error the
+// unparsed rest of the entry array (or, outside it, the whole answer) is
+// repaired in one request. Entries that are still invalid after repair are dropped.
+class FhirBundleCollector {
+public:
+    FhirBundleCollector(LlmClient& client, int analysis_id)
+        : client_(client), analysis_id_(analysis_id), cancel_(CancelToken::current()),
+          parser_([this](const std::string& raw) { on_entry(raw); }) {}
+
+    ~FhirBundleCollector() {
+        wait_for_repairs();
+    }
+
+    FhirBundleCollector(const FhirBundleCollector&) = delete;
+    FhirBundleCollector& operator=(const FhirBundleCollector&) = delete;
+
+    void feed(const std::string& delta) {
+        parser_.feed(delta);
+    }
+
+    // Ends the answer, waits for the repairs and returns the Bundle of valid
+    // entries; report describes what was repaired or dropped.
+    json finish(std::ostream& file, json& report) {
+        parser_.finish();
+        std::string bundle_type = "collection";
+        if (parser_.failed()) {
+            file << "\n[WARN] FHIR output of Analysis[" << analysis_id_ << "] is not valid JSON at "
+                 << parser_.error() << "\n";
+            report["syntax_error"] = parser_.error();
+            const std::string rest = parser_.broken_entries();
+            if (!rest.empty()) {
+                repair(new_slot(), Repair::Entries, rest, parser_.error());
+            } else {
+                repair(new_slot(), Repair::Bundle, parser_.text(), parser_.error());
+            }
+        } else {
+            const json root = json::parse(parser_.bundle_text(), nullptr, false);
+            if (root.value("resourceType", "") != "Bundle") {
+                report["syntax_error"] = "the answer is not a Bundle";
+                repair(new_slot(), Repair::Bundle, parser_.text(), "the answer is not a FHIR Bundle");
+            } else if (root.contains("type") && root["type"].is_string()) {
+                bundle_type = root["type"];
+            }
+        }
+
+        wait_for_repairs();
+        std::lock_guard<std::mutex> lock(mutex_);
+        json bundle = {{"resourceType", "Bundle"}, {"type", bundle_type}, {"entry", json::array()}};
+        for (const auto& slot : slots_) {
+            for (const auto& entry : slot) {
+                bundle["entry"].push_back(entry);
+            }
+        }
+        report["valid_entries"] = bundle["entry"].size();
+        report["repaired"] = repaired_;
+        report["dropped"] = dropped_;
+        file << "FHIR: " << bundle["entry"].size() << " valid entries, " << repaired_ << " repaired, "
+             << dropped_ << " dropped\n";
+        return bundle;
+    }
+
+private:
+    enum class Repair { Entry, Entries, Bundle };
+
+    size_t new_slot() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        slots_.emplace_back();
+        return slots_.size() - 1;
+    }
+
+    void on_entry(const std::string& raw) {
+        const size_t slot = new_slot();
+        const json entry = json::parse(raw, nullptr, false);
+        const std::string problem = entry.is_discarded() ? "not valid JSON" : check_bundle_entry(entry);
+        if (problem.empty()) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            slots_[slot].push_back(entry);
+            return;
+        }
+        repair(slot, Repair::Entry, raw, problem);
+    }
+
+    void repair(size_t slot, Repair kind, const std::string& fragment, const std::string& problem) {
+        static const std::map<Repair, std::string> instructions = {
+            {Repair::Entry, "This FHIR Bundle entry is invalid. Return only the corrected entry as one JSON "
+                            "object with a \"resource\" member."},
+            {Repair::Entries, "This is the rest of the \"entry\" array of a FHIR Bundle, starting at an entry "
+                              "that is not valid JSON. Return only the corrected entries as a JSON array."},
+            {Repair::Bundle, "This answer should have been a FHIR Bundle. Return only the corrected Bundle "
+                             "as JSON."}
+        };
+        std::string allowed;
+        for (const auto& [type, fields] : FHIR_REQUIRED_FIELDS) {
+            allowed += (allowed.empty() ? "" : ", ") + type;
+        }
+        json body = {
+            {"messages", build_messages(instructions.at(kind) + " Supported resource types: " + allowed + ".",
+                                        "Problem: " + problem + "\n\n" + fragment)},
+            {"enable_websearch", false}
+        };
+        if (kind == Repair::Bundle) {
+            apply_response_format(body);
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            ++pending_;
+        }
+        client_.chat_async(RequestClass::Analysis, std::move(body), nullptr,
+                           [this, slot, kind](ChatResult&& chat, std::exception_ptr error) {
+                               repaired(slot, kind, error ? std::string{} : chat.content);
+                           },
+                           cancel_);  // repairs are sent from the engine thread, outside the job
+    }
+
+    void repaired(size_t slot, Repair kind, const std::string& answer) {
+        json items = json::array();
+        if (kind == Repair::Entries) {
+            const json parsed = parse_json_answer(answer, '[', ']');
+            if (parsed.is_array()) {
+                items = parsed;
+            }
+        } else {
+            const json parsed = parse_json_answer(answer);
+            if (kind == Repair::Bundle && parsed.is_object() && parsed.contains("entry") && parsed["entry"].is_array()) {
+                items = parsed["entry"];
+            } else if (parsed.is_object()) {
+                items.push_back(parsed);
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (items.empty()) {
+            ++dropped_;
+        }
+        for (auto& item : items) {
+            if (item.is_object() && item.contains("resourceType") && !item.contains("resource")) {
+                item = json{{"resource", item}};  // a bare resource instead of an entry
+            }
+            if (check_bundle_entry(item).empty()) {
+                slots_[slot].push_back(std::move(item));
+                ++repaired_;
+            } else {
+                ++dropped_;
+            }
+        }
+        --pending_;
+        repairs_done_.notify_all();
+    }
+
+    void wait_for_repairs() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        repairs_done_.wait(lock, [this] { return pending_ == 0; });
+    }
+
+    LlmClient& client_;
+    const int analysis_id_;
+    const std::shared_ptr<CancelToken> cancel_;
+    BundleStreamParser parser_;
+    std::mutex mutex_;
+    std::condition_variable repairs_done_;
+    std::deque<std::vector<json>> slots_;  // valid entries in answer order
+    size_t pending_ = 0;
+    size_t repaired_ = 0;
+    size_t dropped_ = 0;
+};
+
+// =======================
+// Protocol retrieval
+// =======================
+
+// Offline retrieval of treatment-protocol passages. "analyze_text.exe
+// --build-index DIR" splits the .txt and .md files under DIR into chunks, embeds
+// them and clusters the vectors into an IVF index (inverted lists around k-means
+// centroids) written to retrieval.index. At run time that file is memory-mapped,
+// the nprobe lists nearest to the transcript are scanned and the top_k chunks
+// are put into the prompt instead of having the server consult
+// analysis.knowledge_base_ids.
+//
+// Embeddings are hashed bag-of-features vectors (words, word bigrams and
+// five-letter stems, IDF-weighted and L2-normalised), computed on the CPU with no
+// model to ship, so cosine similarity is a plain dot product.
+
+// Dot product of two float vectors, vectorised with AVX2/FMA or NEON when the
+// build targets them (e.g. make SIMD_FLAGS="-mavx2 -mfma").
+float dot_product(const float* a, const float* b, size_t n) {
+    size_t i = 0;
+    float sum = 0.0f;
+#if defined(__AVX2__) && defined(__FMA__)
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    for (; i + 16 <= n; i += 16) {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), acc1);
+    }
+    const __m256 acc = _mm256_add_ps(acc0, acc1);
+    __m128 half = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+    half = _mm_add_ps(half, _mm_movehl_ps(half, half));
+    half = _mm_add_ss(half, _mm_shuffle_ps(half, half, 1));
+    sum = _mm_cvtss_f32(half);
+#elif defined(__ARM_NEON)
+    float32x4_t acc = vdupq_n_f32(0.0f);
+    for (; i + 4 <= n; i += 4) {
+        acc = vfmaq_f32(acc, vld1q_f32(a + i), vld1q_f32(b + i));
+    }
+    sum = vaddvq_f32(acc);
+#else
+    float partial[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+    for (; i + 4 <= n; i += 4) {
+        for (size_t j = 0; j < 4; ++j) {
+            partial[j] += a[i + j] * b[i + j];
+        }
+    }
+    sum = partial[0] + partial[1] + partial[2] + partial[3];
+#endif
+    for (; i < n; ++i) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+uint64_t hash_feature(const std::u32string& feature) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (char32_t c : feature) {
+        for (int shift = 0; shift < 32; shift += 8) {
+            hash ^= (c >> shift) & 0xff;
+            hash *= 0x100000001b3ULL;
+        }
+    }
+    return hash;
+}
+
+// Hashed features of text, without IDF weights or normalisation. The top bit of
+// each hash picks the sign, so that collisions tend to cancel out.
+std::vector<float> hash_features(const std::string& text, size_t dimensions) {
+    std::vector<float> vector(dimensions, 0.0f);
+    std::vector<std::u32string> words;
+    for (auto& word : fold_words(text)) {
+        if (word.size() > 1 && !is_stop_word(word)) {
+            words.push_back(std::move(word));
+        }
+    }
+    auto add = [&vector, dimensions](const std::u32string& feature, float weight) {
+        const uint64_t hash = hash_feature(feature);
+        vector[hash % dimensions] += (hash >> 63) ? -weight : weight;
+    };
+    for (size_t i = 0; i < words.size(); ++i) {
+        add(words[i], 1.0f);
+        if (words[i].size() > 5) {
+            add(U"~" + words[i].substr(0, 5), 0.5f);
+        }
+        if (i + 1 < words.size()) {
+            add(words[i] + U" " + words[i + 1], 0.7f);
+        }
+    }
+    return vector;
+}
+
+void normalize(std::vector<float>& vector) {
+    const float norm = std::sqrt(dot_product(vector.data(), vector.data(), vector.size()));
+    if (norm > 0.0f) {
+        for (float& value : vector) {
+            value /= norm;
+        }
+    }
+}
+
+// Splits a protocol into chunks of at most max_chars, at paragraph breaks where
+// possible and otherwise at the last sentence or word end that fits.
+std::vector<std::string> chunk_protocol(const std::string& text, size_t max_chars) {
+    std::vector<std::string> chunks;
+    std::string current;
+    auto flush = [&chunks, &current] {
+        const std::string chunk = trim(current);
+        if (!chunk.empty()) {
+            chunks.push_back(chunk);
+        }
+        current.clear();
+    };
+    std::istringstream lines(text);
+    std::string paragraph;
+    for (std::string line; std::getline(lines, line) || !paragraph.empty();) {
+        if (!trim(line).empty() && lines) {
+            paragraph += line + "\n";
+            continue;
+        }
+        if (current.size() + paragraph.size() > max_chars) {
+            flush();
+        }
+        while (paragraph.size() > max_chars) {
+            size_t cut = paragraph.rfind(". ", max_chars);
+            if (cut == std::string::npos || cut < max_chars / 2) {
+                cut = paragraph.rfind(' ', max_chars);
+            }
+            cut = (cut == std::string::npos || cut == 0) ? max_chars : cut + 1;
+            current = paragraph.substr(0, cut);
+            flush();
+            paragraph.erase(0, cut);
+        }
+        current += paragraph + "\n";
+        paragraph.clear();
+        line.clear();
+        if (!lines) {
+            break;
+        }
+    }
+    flush();
+    return chunks;
+}
+
+// On-disk layout of retrieval.index; every section starts on a 64-byte boundary.
+struct ProtocolIndexHeader {
+    char magic[8];              // "PROTIDX1"
+    uint32_t dimensions;
+    uint32_t lists;
+    uint32_t chunks;
+    uint32_t reserved;
+    uint64_t idf_offset;        // float[dimensions]
+    uint64_t centroids_offset;  // float[lists][dimensions]
+    uint64_t lists_offset;      // uint32_t[lists + 1], first chunk of each list
+    uint64_t vectors_offset;    // float[chunks][dimensions], grouped by list
+    uint64_t refs_offset;       // ProtocolChunkRef[chunks]
+    uint64_t blob_offset;       // sources and texts
+    uint64_t blob_size;
+};
+
+struct ProtocolChunkRef {
+    uint64_t source_offset;  // relative to the blob
+    uint64_t text_offset;
+    uint32_t source_size;
+    uint32_t text_size;
+};
+
+constexpr char PROTOCOL_INDEX_MAGIC[8] = {'P', 'R', 'O', 'T', 'I', 'D', 'X', '1'};
+
+// Builds retrieval.index from the protocols under dir; returns false on failure.
+bool build_protocol_index(const std::string& dir, const std::string& path, size_t dimensions, size_t chunk_chars) {
+    namespace fs = std::filesystem;
+    std::vector<fs::path> files;
+    std::error_code ec;
+    for (fs::recursive_directory_iterator it(dir, ec), end; !ec && it != end; it.increment(ec)) {
+        const std::string extension = it->path().extension().string();
+        if (it->is_regular_file() && (extension == ".txt" || extension == ".md")) {
+            files.push_back(it->path());
+        }
+    }
+    if (ec) {
+        std::cerr << "[retrieval] Unable to read " << dir << ": " << ec.message() << "\n";
+        return false;
+    }
+    std::sort(files.begin(), files.end());
+
+    std::vector<std::pair<std::string, std::string>> chunks;  // source, text
+    for (const auto& file : files) {
+        std::ifstream in(file);
+        std::stringstream content;
+        content << in.rdbuf();
+        const std::string source = fs::relative(file, dir, ec).string();
+        for (auto& chunk : chunk_protocol(content.str(), chunk_chars)) {
+            chunks.emplace_back(source, std::move(chunk));
+        }
+    }
+    if (chunks.empty()) {
+        std::cerr << "[retrieval] No .txt or .md protocol text found under " << dir << "\n";
+        return false;
+    }
+    const size_t count = chunks.size();
+
+    // IDF per hashed dimension, applied to chunk and query vectors alike.
+    std::vector<std::vector<float>> vectors;
+    std::vector<size_t> document_frequency(dimensions, 0);
+    for (const auto& chunk : chunks) {
+        vectors.push_back(hash_features(chunk.second, dimensions));
+        for (size_t d = 0; d < dimensions; ++d) {
+            document_frequency[d] += vectors.back()[d] != 0.0f;
+        }
+    }
+    std::vector<float> idf(dimensions);
+    for (size_t d = 0; d < dimensions; ++d) {
+        idf[d] = static_cast<float>(std::log((1.0 + count) / (1.0 + document_frequency[d])) + 1.0);
+    }
+    for (auto& vector : vectors) {
+        for (size_t d = 0; d < dimensions; ++d) {
+            vector[d] *= idf[d];
+        }
+        normalize(vector);
+    }
+
+    // Spherical k-means with about sqrt(count) lists.
+    const size_t lists = std::max<size_t>(1, static_cast<size_t>(std::lround(std::sqrt(static_cast<double>(count)))));
+    std::vector<std::vector<float>> centroids;
+    for (size_t l = 0; l < lists; ++l) {
+        centroids.push_back(vectors[l * count / lists]);
+    }
+    std::vector<uint32_t> assignment(count, 0);
+    for (int iteration = 0; iteration < 10; ++iteration) {
+        for (size_t i = 0; i < count; ++i) {
+            float best = -2.0f;
+            for (size_t l = 0; l < lists; ++l) {
+                const float score = dot_product(vectors[i].data(), centroids[l].data(), dimensions);
+                if (score > best) {
+                    best = score;
+                    assignment[i] = static_cast<uint32_t>(l);
+                }
+            }
+        }
+        std::vector<std::vector<float>> sums(lists, std::vector<float>(dimensions, 0.0f));
+        std::vector<size_t> members(lists, 0);
+        for (size_t i = 0; i < count; ++i) {
+            ++members[assignment[i]];
+            for (size_t d = 0; d < dimensions; ++d) {
+                sums[assignment[i]][d] += vectors[i][d];
+            }
+        }
+        for (size_t l = 0; l < lists; ++l) {
+            if (members[l] > 0) {  // an empty list keeps its centroid
+                normalize(sums[l]);
+                centroids[l] = std::move(sums[l]);
+            }
+        }
+    }
+
+    std::vector<size_t> order(count);
+    for (size_t i = 0; i < count; ++i) {
+        order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(), [&assignment](size_t a, size_t b) { return assignment[a] < assignment[b]; });
+    std::vector<uint32_t> list_starts(lists + 1, 0);
+    for (size_t i = 0; i < count; ++i) {
+        ++list_starts[assignment[i] + 1];
+    }
+    for (size_t l = 0; l < lists; ++l) {
+        list_starts[l + 1] += list_starts[l];
+    }
+
+    std::string blob;
+    std::vector<ProtocolChunkRef> refs;
+    for (size_t i : order) {
+        ProtocolChunkRef ref{};
+        ref.source_offset = blob.size();
+        ref.source_size = static_cast<uint32_t>(chunks[i].first.size());
+        blob += chunks[i].first;
+        ref.text_offset = blob.size();
+        ref.text_size = static_cast<uint32_t>(chunks[i].second.size());
+        blob += chunks[i].second;
+        refs.push_back(ref);
+    }
+
+    auto align = [](uint64_t offset) { return (offset + 63) & ~uint64_t{63}; };
+    ProtocolIndexHeader header{};
+    std::memcpy(header.magic, PROTOCOL_INDEX_MAGIC, sizeof(header.magic));
+    header.dimensions = static_cast<uint32_t>(dimensions);
+    header.lists = static_cast<uint32_t>(lists);
+    header.chunks = static_cast<uint32_t>(count);
+    header.idf_offset = align(sizeof(header));
+    header.centroids_offset = align(header.idf_offset + dimensions * sizeof(float));
+    header.lists_offset = align(header.centroids_offset + lists * dimensions * sizeof(float));
+    header.vectors_offset = align(header.lists_offset + (lists + 1) * sizeof(uint32_t));
+    header.refs_offset = align(header.vectors_offset + count * dimensions * sizeof(float));
+    header.blob_offset = align(header.refs_offset + count * sizeof(ProtocolChunkRef));
+    header.blob_size = blob.size();
+
+    // Written under a temporary name so a running analyzer never maps a partial file.
+    const std::string temp_path = path + ".tmp";
+    std::ofstream out(temp_path, std::ios::binary | std::ios::trunc);
+    auto write_at = [&out](uint64_t offset, const void* data, size_t size) {
+        while (static_cast<uint64_t>(out.tellp()) < offset) {
+            out.put('\0');
+        }
+        out.write(static_cast<const char*>(data), static_cast<std::streamsize>(size));
+    };
+    write_at(0, &header, sizeof(header));
+    write_at(header.idf_offset, idf.data(), idf.size() * sizeof(float));
+    for (size_t l = 0; l < lists; ++l) {
+        write_at(header.centroids_offset + l * dimensions * sizeof(float), centroids[l].data(), dimensions * sizeof(float));
+    }
+    write_at(header.lists_offset, list_starts.data(), list_starts.size() * sizeof(uint32_t));
+    for (size_t n = 0; n < count; ++n) {
+        write_at(header.vectors_offset + n * dimensions * sizeof(float), vectors[order[n]].data(), dimensions * sizeof(float));
+    }
+    write_at(header.refs_offset, refs.data(), refs.size() * sizeof(ProtocolChunkRef));
+    write_at(header.blob_offset, blob.data(), blob.size());
+    out.close();
+    if (!out) {
+        std::cerr << "[retrieval] Unable to write " << temp_path << "\n";
+        return false;
+    }
+    fs::rename(temp_path, path, ec);
+    if (ec) {
+        std::cerr << "[retrieval] Unable to replace " << path << ": " << ec.message() << "\n";
+        return false;
+    }
+    std::cout << "[retrieval] Indexed " << count << " chunks from " << files.size() << " files into "
+              << lists << " lists (" << dimensions << " dimensions): " << path << "\n";
+    return true;
+}
+
+// Read-only view of a memory-mapped retrieval.index. search() is thread-safe.
+class ProtocolIndex {
+public:
+    struct Passage {
+        std::string source;
+        std::string text;
+        float score = 0.0f;
+    };
+
+    ProtocolIndex() = default;
+    ProtocolIndex(const ProtocolIndex&) = delete;
+    ProtocolIndex& operator=(const ProtocolIndex&) = delete;
+
+    ~ProtocolIndex() {
+        close();
+    }
+
+    // Maps path and checks its layout; on failure returns false and sets error.
+    bool open(const std::string& path, std::string& error) {
+        close();
+        const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            error = std::strerror(errno);
+            return false;
+        }
+        struct stat info {};
+        if (fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) < sizeof(ProtocolIndexHeader)) {
+            error = "file too small";
+            ::close(fd);
+            return false;
+        }
+        void* data = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (data == MAP_FAILED) {
+            error = std::strerror(errno);
+            return false;
+        }
+        data_ = static_cast<const unsigned char*>(data);
+        size_ = static_cast<size_t>(info.st_size);
+        std::memcpy(&header_, data_, sizeof(header_));
+        error = validate();
+        if (!error.empty()) {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    void close() {
+        if (data_) {
+            munmap(const_cast<unsigned char*>(data_), size_);
+            data_ = nullptr;
+            size_ = 0;
+        }
+    }
+
+    bool loaded() const {
+        return data_ != nullptr;
+    }
+
+    size_t chunks() const {
+        return loaded() ? header_.chunks : 0;
+    }
+
+    // The k chunks most similar to query among the nprobe lists whose centroids
+    // are nearest to it, best first.
+    std::vector<Passage> search(const std::string& query, size_t k, size_t nprobe) const {
+        std::vector<Passage> passages;
+        if (!loaded() || k == 0) {
+            return passages;
+        }
+        const size_t dimensions = header_.dimensions;
+        std::vector<float> vector = hash_features(query, dimensions);
+        const float* idf = at<float>(header_.idf_offset);
+        for (size_t d = 0; d < dimensions; ++d) {
+            vector[d] *= idf[d];
+        }
+        normalize(vector);
+
+        std::vector<std::pair<float, uint32_t>> lists;
+        const float* centroids = at<float>(header_.centroids_offset);
+        for (uint32_t l = 0; l < header_.lists; ++l) {
+            lists.emplace_back(dot_product(vector.data(), centroids + l * dimensions, dimensions), l);
+        }
+        const size_t probed = std::min<size_t>(std::max<size_t>(nprobe, 1), lists.size());
+        std::partial_sort(lists.begin(), lists.begin() + static_cast<std::ptrdiff_t>(probed), lists.end(),
+                          std::greater<>());
+
+        // Min-heap of the best k (score, chunk) pairs seen so far.
+        std::priority_queue<std::pair<float, uint32_t>, std::vector<std::pair<float, uint32_t>>, std::greater<>> best;
+        const uint32_t* starts = at<uint32_t>(header_.lists_offset);
+        const float* vectors = at<float>(header_.vectors_offset);
+        for (size_t p = 0; p < probed; ++p) {
+            const uint32_t list = lists[p].second;
+            for (uint32_t chunk = starts[list]; chunk < starts[list + 1]; ++chunk) {
+                const float score = dot_product(vector.data(), vectors + static_cast<size_t>(chunk) * dimensions, dimensions);
+                if (best.size() < k) {
+                    best.emplace(score, chunk);
+                } else if (score > best.top().first) {
+                    best.pop();
+                    best.emplace(score, chunk);
+                }
+            }
+        }
+
+        const ProtocolChunkRef* refs = at<ProtocolChunkRef>(header_.refs_offset);
+        const char* blob = at<char>(header_.blob_offset);
+        for (; !best.empty(); best.pop()) {
+            const ProtocolChunkRef& ref = refs[best.top().second];
+            passages.push_back({std::string(blob + ref.source_offset, ref.source_size),
+                                std::string(blob + ref.text_offset, ref.text_size), best.top().first});
+        }
+        std::reverse(passages.begin(), passages.end());
+        return passages;
+    }
+
+private:
+    template <typename T>
+    const T* at(uint64_t offset) const {
+        return reinterpret_cast<const T*>(data_ + offset);
+    }
+
+    // Checks that every section lies inside the file; returns the problem or "".
+    std::string validate() const {
+        const ProtocolIndexHeader& h = header_;
+        if (std::memcmp(h.magic, PROTOCOL_INDEX_MAGIC, sizeof(h.magic)) != 0) {
+            return "not a protocol index";
+        }
+        if (h.dimensions == 0 || h.lists == 0 || h.chunks == 0) {
+            return "empty index";
+        }
+        auto fits = [this](uint64_t offset, uint64_t bytes) {
+            return offset % alignof(float) == 0 && offset <= size_ && bytes <= size_ - offset;
+        };
+        if (!fits(h.idf_offset, uint64_t{h.dimensions} * sizeof(float)) ||
+            !fits(h.centroids_offset, uint64_t{h.lists} * h.dimensions * sizeof(float)) ||
+            !fits(h.lists_offset, (uint64_t{h.lists} + 1) * sizeof(uint32_t)) ||
+            !fits(h.vectors_offset, uint64_t{h.chunks} * h.dimensions * sizeof(float)) ||
+            h.refs_offset % alignof(ProtocolChunkRef) != 0 ||
+            !fits(h.refs_offset, uint64_t{h.chunks} * sizeof(ProtocolChunkRef)) ||
+            !fits(h.blob_offset, h.blob_size)) {
+            return "truncated or corrupt index";
+        }
+        const uint32_t* starts = at<uint32_t>(h.lists_offset);
+        for (uint32_t l = 0; l < h.lists; ++l) {
+            if (starts[l] > starts[l + 1]) {
+                return "corrupt inverted lists";
+            }
+        }
+        if (starts[0] != 0 || starts[h.lists] != h.chunks) {
+            return "corrupt inverted lists";
+        }
+        const ProtocolChunkRef* refs = at<ProtocolChunkRef>(h.refs_offset);
+        for (uint32_t c = 0; c < h.chunks; ++c) {
+            if (refs[c].source_offset + refs[c].source_size > h.blob_size ||
+                refs[c].text_offset + refs[c].text_size > h.blob_size) {
+                return "corrupt chunk table";
+            }
+        }
+        return "";
+    }
+
+    const unsigned char* data_ = nullptr;
+    size_t size_ = 0;
+    ProtocolIndexHeader header_{};
+};
+
+ProtocolIndex protocol_index;
+
+// Protocol passages retrieved for one request.
+struct RetrievedContext {
+    std::string text;                // to put before the transcript, empty when nothing was found
+    std::string origin;              // "local index" or "prefetched", empty when nothing was retrieved
+    bool replaces_knowledge_bases = false;
+    double ms = 0.0;                 // retrieval latency on the request's critical path
+    double fetch_ms = 0.0;           // duration of the prefetch, which ran before the request
+    json passages = json::array();   // source and score of each passage
+};
+
+// Formats retrieved passages as the prompt section put before the transcript.
+void set_passages(RetrievedContext& context, const std::vector<ProtocolIndex::Passage>& passages) {
+    std::ostringstream text;
+    for (size_t i = 0; i < passages.size(); ++i) {
+        text << (i == 0 ? "Relevant treatment protocol passages:\n" : "") << "[" << i + 1 << "] ("
+             << passages[i].source << ")\n" << passages[i].text << "\n\n";
+        context.passages.push_back({{"source", passages[i].source}, {"score", passages[i].score}});
+    }
+    if (!passages.empty()) {
+        text << "---\n";
+    }
+    context.text = text.str();
+}
+
+RetrievedContext retrieve_protocols(const std::string& query) {
+    RetrievedContext context;
+    if (!protocol_index.loaded()) {
+        return context;
+    }
+    const auto started = std::chrono::steady_clock::now();
+    set_passages(context, protocol_index.search(query, RETRIEVAL_TOP_K, RETRIEVAL_NPROBE));
+    context.origin = "local index";
+    // Without local passages the remote knowledge bases are still worth sending.
+    context.replaces_knowledge_bases = !context.passages.empty();
+    context.ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count();
+    return context;
+}
+
+// Logs the retrieval of one analysis to its results file, stdout and record.
+void report_retrieval(std::ostream& file, const std::string& label, const RetrievedContext& context, json& record) {
+    if (context.origin.empty()) {
+        return;
+    }
+    std::ostringstream oss;
+    oss << std::fixed << std::setprecision(2) << "Retrieval: " << context.passages.size() << " protocol passages from the "
+        << context.origin << " in " << context.ms << " ms";
+    if (context.fetch_ms > 0.0) {
+        oss << " (fetched in " << context.fetch_ms << " ms ahead of the request)";
+    }
+    oss << "\n";
+    file << oss.str();
+    std::cout << "[timing] " << label << ": " << oss.str();
+    record["retrieval"] = {
+        {"origin", context.origin},
+        {"ms", context.ms},
+        {"fetch_ms", context.fetch_ms},
+        {"passages", context.passages}
+    };
+}
+
+// The server consults the remote knowledge bases unless the passages came with the request.
+void apply_knowledge_bases(json& body, const RetrievedContext& context) {
+    const std::vector<std::string> ids = split_list(KNOWLEDGE_BASE_IDS, ',');
+    if (!context.replaces_knowledge_bases && !ids.empty()) {
+        body["knowledge_base_ids"] = ids;
+    }
+}
+
+// =======================
+// Retrieval prefetch
+// =======================
+
+// Passages prefetched from the remote knowledge bases for one recording.
+struct PrefetchState {
+    explicit PrefetchState(int recording) : recording_id(recording) {}
+
+    const int recording_id;
+    std::mutex mutex;
+    std::condition_variable settled;
+    bool in_flight = false;
+    bool prefetched = false;  // a pass succeeded and context holds its passages
+    RetrievedContext context;
+    size_t covered_chars = 0;
+    // Shortest length the transcript was cut back to while a pass was in flight.
+    size_t truncated_to = std::string::npos;
+
+    // The latest passages, after waiting for a pass still in flight when wait is
+    // set; nothing when no pass has succeeded.
+    std::optional<RetrievedContext> latest(bool wait) {
+        const auto started = std::chrono::steady_clock::now();
+        std::unique_lock<std::mutex> lock(mutex);
+        if (wait) {
+            settled.wait(lock, [this] { return !in_flight; });
+        }
+        if (!prefetched) {
+            return std::nullopt;
+        }
+        RetrievedContext result = context;
+        result.ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count();
+        return result;
+    }
+};
+
+// Queries the knowledge bases of analysis.knowledge_base_ids while a recording
+// is running, each one concurrently through OpenWebUI's retrieval API, whenever
+// retrieval.prefetch_tokens of new transcript have arrived; stopping the
+// recording starts a last pass if the transcript grew since the previous one.
+// The final analysis then only waits for a pass still in flight and sends the
+// passages with the request, leaving generation as the only remote step.
+class RetrievalPrefetcher {
+public:
+    using Clock = std::chrono::steady_clock;
+    using SnapshotFn = std::function<TranscriptSnapshot()>;
+
+    RetrievalPrefetcher(HttpEngine& engine, SnapshotFn snapshot)
+        : engine_(engine), snapshot_(std::move(snapshot)), ids_(split_list(KNOWLEDGE_BASE_IDS, ',')) {
+        std::string base = OPENWEBUI_URL;
+        while (!base.empty() && base.back() == '/') {
+            base.pop_back();
+        }
+        url_ = base + "/v1/retrieval/query/doc";
+    }
+
+    void start_recording(int recording_id) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        state_ = std::make_shared<PrefetchState>(recording_id);
+        pending_chars_ = 0;
+    }
+
+    // Called after each transcript line is appended.
+    void note_line(size_t chars) {
+        std::shared_ptr<PrefetchState> state;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            pending_chars_ += chars;
+            if (!state_ || estimate_tokens(pending_chars_) < RETRIEVAL_PREFETCH_TOKENS) {
+                return;
+            }
+            state = state_;
+        }
+        {
+            // Lines keep accumulating while a pass is in flight; no snapshot is needed until it settles.
+            std::lock_guard<std::mutex> lock(state->mutex);
+            if (state->in_flight) {
+                return;
+            }
+        }
+        if (start_pass(state, snapshot_())) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            pending_chars_ = 0;
+        }
+    }
+
+    // Called after the transcript was cut back to size chars.
+    void truncate(size_t size) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!state_) {
+            return;
+        }
+        std::lock_guard<std::mutex> state_lock(state_->mutex);
+        state_->covered_chars = std::min(state_->covered_chars, size);
+        if (state_->in_flight) {
+            state_->truncated_to = std::min(state_->truncated_to, size);
+        }
+    }
+
+    // The running recording's state, for temporary checks.
+    std::shared_ptr<PrefetchState> current() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return state_;
+    }
+
+    // Ends the recording; transcript is its final text.
+    std::shared_ptr<PrefetchState> stop_recording(const TranscriptSnapshot& transcript) {
+        std::shared_ptr<PrefetchState> state;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            state = std::exchange(state_, nullptr);
+        }
+        if (state) {
+            bool stale = false;
+            {
+                std::lock_guard<std::mutex> lock(state->mutex);
+                stale = !state->in_flight && (!state->prefetched || state->covered_chars < transcript.size());
+            }
+            if (stale) {
+                start_pass(state, transcript);
+            }
+        }
+        return state;
+    }
+
+    std::string stats() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::ostringstream oss;
+        oss << "[prefetch] passes=" << passes_ << " queries=" << queries_ << " failed_queries=" << failed_queries_
+            << " avg_pass_ms=" << std::fixed << std::setprecision(0)
+            << (passes_ ? total_pass_ms_ / static_cast<double>(passes_) : 0.0) << "\n";
+        return oss.str();
+    }
+
+private:
+    // One pass: every knowledge base queried at once, merged when the last answers.
+    struct Pass {
+        std::shared_ptr<PrefetchState> state;
+        Clock::time_point started;
+        size_t covered_chars = 0;
+        size_t remaining = 0;
+        bool any_succeeded = false;
+        std::vector<std::vector<ProtocolIndex::Passage>> results;  // per knowledge base
+    };
+
+    // Returns false when a pass for this recording is already in flight.
+    bool start_pass(const std::shared_ptr<PrefetchState>& state, const TranscriptSnapshot& transcript) {
+        if (ids_.empty()) {
+            return false;
+        }
+        {
+            std::lock_guard<std::mutex> lock(state->mutex);
+            if (state->in_flight) {
+                return false;
+            }
+            state->in_flight = true;
+        }
+        // Embedding models only read the start of long queries, so the recent transcript is sent.
+        constexpr size_t QUERY_CHARS = 4000;
+        const std::string query = transcript.substr(transcript.size() > QUERY_CHARS ? transcript.size() - QUERY_CHARS : 0);
+        auto pass = std::make_shared<Pass>();
+        pass->state = state;
+        pass->started = Clock::now();
+        pass->covered_chars = transcript.size();
+        pass->remaining = ids_.size();
+        pass->results.resize(ids_.size());
+        std::unique_lock<std::mutex> lock(mutex_);
+        queries_ += ids_.size();
+        lock.unlock();
+
+        for (size_t i = 0; i < ids_.size(); ++i) {
+            HttpEngine::Request request;
+            request.url = url_;
+            request.headers = {"Content-Type: application/json", "Authorization: Bearer " + API_KEY};
+            request.body = json{{"collection_name", ids_[i]}, {"query", query}, {"k", RETRIEVAL_TOP_K}}.dump();
+            request.timeout_ms = static_cast<long>(RETRIEVAL_PREFETCH_TIMEOUT_MS);
+            engine_.submit(std::move(request), nullptr, [this, pass, i](HttpEngine::Response&& response) {
+                query_done(*pass, i, std::move(response));
+            });
+        }
+        return true;
+    }
+
+    // Runs on the engine thread, where nothing may throw. Answers look like
+    // {"documents": [[...]], "metadatas": [[{"source": ...}]], "distances": [[...]]};
+    // the outer list (one per query) may also be missing.
+    void query_done(Pass& pass, size_t index, HttpEngine::Response&& response) {
+        const json answer = json::parse(response.body, nullptr, false);
+        const bool ok = response.code == CURLE_OK && response.status < 400 && answer.is_object() &&
+                        answer.contains("documents") && answer["documents"].is_array();
+        if (ok) {
+            const json empty = json::array();
+            auto first_row = [&answer, &empty](const char* field) -> const json& {
+                const auto it = answer.find(field);
+                if (it == answer.end() || !it->is_array()) {
+                    return empty;
+                }
+                return !it->empty() && (*it)[0].is_array() ? (*it)[0] : *it;
+            };
+            const json& documents = first_row("documents");
+            const json& metadatas = first_row("metadatas");
+            const json& distances = first_row("distances");
+            for (size_t d = 0; d < documents.size() && documents[d].is_string(); ++d) {
+                ProtocolIndex::Passage passage;
+                passage.text = documents[d].get<std::string>();
+                passage.source = ids_[index];
+                if (d < metadatas.size() && metadatas[d].is_object()) {
+                    for (const char* field : {"source", "name"}) {
+                        const auto it = metadatas[d].find(field);
+                        if (it != metadatas[d].end() && it->is_string()) {
+                            passage.source = it->get<std::string>();
+                            break;
+                        }
+                    }
+                }
+                if (d < distances.size() && distances[d].is_number()) {
+                    passage.score = distances[d].get<float>();
+                }
+                pass.results[index].push_back(std::move(passage));
+            }
+        } else {
+            std::lock_guard<std::mutex> lock(mutex_);
+            ++failed_queries_;
+            std::cout << "[prefetch] Knowledge base " << ids_[index] << " query failed: "
+                      << (response.code != CURLE_OK ? curl_easy_strerror(response.code)
+                                                    : "HTTP " + std::to_string(response.status)) << "\n";
+        }
+        pass.any_succeeded = pass.any_succeeded || ok;
+        if (--pass.remaining > 0) {
+            return;
+        }
+
+        // Interleave the knowledge bases by rank so that each contributes its best passages first.
+        std::vector<ProtocolIndex::Passage> merged;
+        for (size_t rank = 0;; ++rank) {
+            bool any = false;
+            for (const auto& results : pass.results) {
+                if (rank < results.size()) {
+                    merged.push_back(results[rank]);
+                    any = true;
+                }
+            }
+            if (!any) {
+                break;
+            }
+        }
+        const double pass_ms = std::chrono::duration<double, std::milli>(Clock::now() - pass.started).count();
+        {
+            std::lock_guard<std::mutex> lock(pass.state->mutex);
+            pass.state->in_flight = false;
+            if (pass.any_succeeded) {
+                RetrievedContext context;
+                set_passages(context, merged);
+                context.origin = "prefetched knowledge bases";
+                context.replaces_knowledge_bases = true;
+                context.fetch_ms = pass_ms;
+                pass.state->context = std::move(context);
+                pass.state->prefetched = true;
+                pass.state->covered_chars = std::min(pass.covered_chars, pass.state->truncated_to);
+            }
+            pass.state->truncated_to = std::string::npos;
+        }
+        pass.state->settled.notify_all();
+        std::lock_guard<std::mutex> lock(mutex_);
+        ++passes_;
+        total_pass_ms_ += pass_ms;
+    }
+
+    HttpEngine& engine_;
+    SnapshotFn snapshot_;
+    const std::vector<std::string> ids_;
+    std::string url_;
+    mutable std::mutex mutex_;
+    std::shared_ptr<PrefetchState> state_;
+    size_t pending_chars_ = 0;
+    size_t passes_ = 0;
+    size_t queries_ = 0;
+    size_t failed_queries_ = 0;
+    double total_pass_ms_ = 0.0;
+};
+
+// Passages for a request of a recording: from the local index when one is
+// loaded, otherwise those prefetched for the recording, after waiting for a
+// pass in flight when wait is set.
+RetrievedContext recording_protocols(const std::string& query, const std::shared_ptr<PrefetchState>& prefetched,
+                                     bool wait) {
+    RetrievedContext context = retrieve_protocols(query);
+    if (!context.replaces_knowledge_bases && prefetched) {
+        if (auto latest = prefetched->latest(wait)) {
+            context = std::move(*latest);
+        }
+    }
+    return context;
+}
+
+// =======================
+// Chunked (map-reduce) analysis
+// =======================
+
+// Splits a transcript at line boundaries into windows of at most budget_tokens
+// (estimated). Each window after the first repeats the last overlap_lines lines
+// of the previous one so statements cut by a boundary keep their context; a
+// single line longer than the budget becomes a window of its own.
+std::vector<std::string> split_windows(const std::string& transcript, size_t budget_tokens, size_t overlap_lines) {
+    std::vector<std::string> lines;
+    std::stringstream stream(transcript);
+    for (std::string line; std::getline(stream, line);) {
+        if (!line.empty()) {
+            lines.push_back(line + "\n");
+        }
+    }
+
+    std::vector<std::string> windows;
+    size_t first = 0;
+    while (first < lines.size()) {
+        size_t last = first;
+        size_t chars = 0;
+        while (last < lines.size() && (last == first || estimate_tokens(chars + lines[last].size()) <= budget_tokens)) {
+            chars += lines[last].size();
+            ++last;
+        }
+        std::string window;
+        window.reserve(chars);
+        for (size_t i = first; i < last; ++i) {
+            window += lines[i];
+        }
+        windows.push_back(std::move(window));
+        if (last == lines.size()) {
+            break;
+        }
+        // Step back for the overlap, but always make progress.
+        first = std::max(first + 1, last > overlap_lines ? last - overlap_lines : 0);
+    }
+    return windows;
+}
+
+struct WindowResult {
+    ChatResult chat;
+    std::exception_ptr error;
+};
+
+// Runs the extraction prompt on every window concurrently and waits for all of
+// them. The windows are parts first_part.. of total_parts, 0 while the recording
+// is still running and the total is not known yet. Passages come as in
+// recording_protocols(), waiting for a prefetch pass in flight when wait is set.
+std::vector<WindowResult> map_windows(LlmClient& client, const std::vector<std::string>& windows, int recording_id,
+                                      size_t first_part, size_t total_parts,
+                                      const std::shared_ptr<PrefetchState>& prefetched, bool wait) {
+    std::vector<WindowResult> results(windows.size());
+    std::mutex mutex;
+    std::condition_variable done;
+    size_t remaining = windows.size();
+
+    for (size_t i = 0; i < windows.size(); ++i) {
+        const RetrievedContext protocols = recording_protocols(windows[i], prefetched, wait && i == 0);
+        json body = {
+            {"messages", build_messages(PROMPT, protocols.text +
+                                                    "Transcript part " + std::to_string(first_part + i) +
+                                                    (total_parts ? " of " + std::to_string(total_parts)
+                                                                 : std::string{" (recording still running)"}) +
+                                                    ":\n" + windows[i])},
+            {"enable_websearch", true}
+        };
+        apply_cache_hints(body, recording_id);
+        apply_response_format(body);
+        apply_knowledge_bases(body, protocols);
+        client.chat_async(RequestClass::Analysis, std::move(body), nullptr,
+                          [&, i](ChatResult&& chat, std::exception_ptr error) {
+                              std::lock_guard<std::mutex> lock(mutex);
+                              results[i].chat = std::move(chat);
+                              results[i].error = error;
+                              if (--remaining == 0) {
+                                  done.notify_one();
+                              }
+                          });
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [&remaining] { return remaining == 0; });
+    return results;
+}
+
+// Points every "reference" inside node at its replacement in renamed, if any.
+void rewrite_references(json& node, const std::map<std::string, std::string>& renamed) {
+    if (node.is_object()) {
+        for (auto it = node.begin(); it != node.end(); ++it) {
+            if (it.key() == "reference" && it->is_string()) {
+                auto found = renamed.find(it->get<std::string>());
+                if (found != renamed.end()) {
+                    *it = found->second;
+                }
+            } else {
+                rewrite_references(*it, renamed);
+            }
+        }
+    } else if (node.is_array()) {
+        for (auto& item : node) {
+            rewrite_references(item, renamed);
+        }
+    }
+}
+
+// Merges partial FHIR answers into one Bundle. A resource that several windows
+// extracted (identical apart from its id) is kept once. Each window numbers its
+// resources itself, so an id or fullUrl an earlier window already used gets a
+// window suffix, and references to renamed or dropped resources are rewritten to
+// the kept ones. Returns false when a part is neither a Bundle nor a single
+// resource, so the caller can let the model merge.
+bool merge_bundles(const std::vector<std::string>& parts, json& merged, size_t& duplicates) {
+    merged = {{"resourceType", "Bundle"}, {"type", "collection"}, {"entry", json::array()}};
+    duplicates = 0;
+    std::map<std::string, std::pair<std::string, std::string>> seen;  // content -> kept reference, fullUrl
+    std::set<std::string> used;                                        // "Type/id" and fullUrls kept so far
+
+    for (size_t p = 0; p < parts.size(); ++p) {
+        const json parsed = parse_json_object(parts[p]);
+        if (!parsed.is_object() || !parsed.contains("resourceType") || !parsed["resourceType"].is_string()) {
+            return false;
+        }
+        json entries = json::array();
+        if (parsed["resourceType"] != "Bundle") {
+            entries.push_back({{"resource", parsed}});
+        } else {
+            if (parsed.contains("type") && parsed["type"].is_string()) {
+                merged["type"] = parsed["type"];
+            }
+            if (parsed.contains("entry")) {
+                if (!parsed["entry"].is_array()) {
+                    return false;
+                }
+                entries = parsed["entry"];
+            }
+        }
+
+        const std::string suffix = "-w" + std::to_string(p + 1);
+        auto unused = [&used, &suffix](const std::string& prefix, const std::string& name) {
+            std::string candidate = name;
+            for (size_t n = 1; used.count(prefix + candidate); ++n) {
+                candidate = name + suffix + (n > 1 ? "." + std::to_string(n) : "");
+            }
+            return candidate;
+        };
+        std::map<std::string, std::string> renamed;  // this window's references -> merged ones
+        const size_t first_kept = merged["entry"].size();
+        for (json& entry : entries) {
+            if (!entry.is_object() || !entry.contains("resource") || !entry["resource"].is_object()) {
+                return false;
+            }
+            json& resource = entry["resource"];
+            rewrite_references(resource, renamed);
+            const std::string type = resource.value("resourceType", "");
+            const std::string id = resource.contains("id") && resource["id"].is_string() ? resource["id"].get<std::string>() : "";
+            const std::string reference = id.empty() ? "" : type + "/" + id;
+            const std::string full_url = entry.contains("fullUrl") && entry["fullUrl"].is_string()
+                                             ? entry["fullUrl"].get<std::string>() : "";
+
+            json key = resource;
+            key.erase("id");
+            const std::string content = key.dump();
+            auto kept = seen.find(content);
+            if (kept != seen.end()) {
+                ++duplicates;
+                const auto& [kept_reference, kept_url] = kept->second;
+                if (!reference.empty() && !kept_reference.empty()) {
+                    renamed[reference] = kept_reference;
+                }
+                if (!full_url.empty()) {
+                    renamed[full_url] = kept_url.empty() ? kept_reference : kept_url;
+                }
+                continue;
+            }
+
+            std::string kept_reference = reference;
+            if (!id.empty()) {
+                const std::string new_id = unused(type + "/", id);
+                if (new_id != id) {
+                    resource["id"] = new_id;
+                    kept_reference = type + "/" + new_id;
+                    renamed[reference] = kept_reference;
+                }
+                used.insert(kept_reference);
+            }
+            std::string kept_url = full_url;
+            if (!full_url.empty()) {
+                kept_url = unused("", full_url);
+                if (kept_url != full_url) {
+                    entry["fullUrl"] = kept_url;
+                    renamed[full_url] = kept_url;
+                }
+                used.insert(kept_url);
+            }
+            seen.emplace(content, std::make_pair(kept_reference, kept_url));
+            merged["entry"].push_back(std::move(entry));
+        }
+        // References to resources that came later in the window.
+        for (size_t i = first_kept; i < merged["entry"].size(); ++i) {
+            rewrite_references(merged["entry"][i]["resource"], renamed);
+        }
+    }
+    return true;
+}
+
+// Reduce step: merges the partial answers locally when they are FHIR JSON and
+// otherwise asks the model to merge them. Writes the result and its timing to file.
+std::string reduce_partials(LlmClient& client, const std::vector<std::string>& parts, int recording_id,
+                            std::ostream& file, json& stages) {
+    const auto started = std::chrono::steady_clock::now();
+    json merged;
+    size_t duplicates = 0;
+    if (merge_bundles(parts, merged, duplicates)) {
+        const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count();
+        file << "Merged " << parts.size() << " partial bundles locally in " << std::fixed << std::setprecision(1)
+             << ms << " ms; " << merged["entry"].size() << " resources, " << duplicates << " duplicates removed\n";
+        stages["reduce"] = {{"mode", "local"}, {"ms", ms}, {"resources", merged["entry"].size()},
+                            {"duplicates", duplicates}};
+        return merged.dump(2);
+    }
+
+    std::string content;
+    for (size_t i = 0; i < parts.size(); ++i) {
+        content += "--- Partial result " + std::to_string(i + 1) + " ---\n" + parts[i] + "\n";
+    }
+    json body = {
+        {"messages", build_messages("The following are extraction results for consecutive parts of one transcript. "
+                                    "Merge them into a single result in the same format, keeping each finding "
+                                    "once.", content)},
+        {"enable_websearch", false}
+    };
+    apply_cache_hints(body, recording_id);
+    apply_response_format(body);
+    const ChatResult chat = client.chat(RequestClass::Analysis, body, nullptr);
+    report_timing(file, "Reduce[" + std::to_string(recording_id) + "]", chat);
+    stages["reduce"] = {{"mode", "llm"}, {"timings", chat_record(chat)}};
+    return chat.content;
+}
+
+// Map-reduce analysis of a transcript too long for one request. prior_parts are
+// answers already extracted for the first covered_chars of the transcript by
+// speculative passes; only the rest is mapped before everything is reduced.
+std::string analyze_in_windows(LlmClient& client, const std::string& transcript, int analysis_id,
+                               std::ostream& file, json& record, const std::shared_ptr<PrefetchState>& prefetched,
+                               const std::vector<std::string>& prior_parts = {}, size_t covered_chars = 0) {
+    const auto started = std::chrono::steady_clock::now();
+    const size_t budget = ANALYSIS_CHUNK_TOKENS > 0 ? ANALYSIS_CHUNK_TOKENS : std::numeric_limits<size_t>::max();
+    const std::string remainder = transcript.substr(std::min(covered_chars, transcript.size()));
+    const std::vector<std::string> windows = remainder.empty() ? std::vector<std::string>{}
+                                                               : split_windows(remainder, budget, ANALYSIS_CHUNK_OVERLAP_LINES);
+    if (!prior_parts.empty()) {
+        file << "Reusing " << prior_parts.size() << " speculative results covering " << covered_chars
+             << " transcript chars; ";
+    }
+    file << "~" << estimate_tokens(remainder.size()) << " tokens of transcript analysed in " << windows.size()
+         << " windows\n";
+
+    const std::vector<WindowResult> results =
+        map_windows(client, windows, analysis_id, prior_parts.size() + 1, prior_parts.size() + windows.size(),
+                    prefetched, true);
+    const double map_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count();
+
+    json stages = {{"windows", windows.size()}, {"speculative_parts", prior_parts.size()},
+                   {"map_ms", map_ms}, {"map", json::array()}};
+    std::vector<std::string> parts = prior_parts;
+    size_t failed = 0;
+    std::string first_error;
+    for (size_t i = 0; i < results.size(); ++i) {
+        const std::string label = "Analysis[" + std::to_string(analysis_id) + "] window " +
+                                  std::to_string(prior_parts.size() + i + 1);
+        if (results[i].error) {
+            try {
+                std::rethrow_exception(results[i].error);
+            } catch (const std::exception& e) {
+                file << "\n[ERROR] " << label << " failed: " << e.what() << "\n";
+                stages["map"].push_back({{"status", "error"}, {"error", e.what()}});
+                if (first_error.empty()) {
+                    first_error = e.what();
+                }
+            }
+            ++failed;
+            continue;
+        }
+        file << "\n" << label << " response:\n" << results[i].chat.content << "\n";
+        report_timing(file, label, results[i].chat);
+        stages["map"].push_back({{"status", "ok"}, {"timings", chat_record(results[i].chat)}});
+        parts.push_back(results[i].chat.content);
+    }
+    if (parts.empty()) {
+        throw std::runtime_error("every window failed; first error: " + first_error);
+    }
+    if (failed > 0) {
+        say_error("[WARN] Analysis[" + std::to_string(analysis_id) + "]: " + std::to_string(failed) + " of " +
+                  std::to_string(windows.size()) + " windows failed; merging the rest.\n");
+        record["status"] = "partial";
+    }
+
+    std::string merged = parts.size() == 1 ? parts.front() : reduce_partials(client, parts, analysis_id, file, stages);
+    const double total_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count();
+    std::ostringstream timing;
+    timing << std::fixed << std::setprecision(0) << "map " << map_ms << " ms, reduce " << total_ms - map_ms
+           << " ms, total " << total_ms << " ms\n";
+    file << "Stages: " << timing.str();
+    std::cout << "[timing] Analysis[" << analysis_id << "] in " << windows.size() << " windows"
+              << (prior_parts.empty() ? "" : " after " + std::to_string(prior_parts.size()) + " speculative parts")
+              << ": " << timing.str();
+    stages["total_ms"] = total_ms;
+    record["chunked"] = stages;
+    return merged;
+}
+
+// =======================
+// Speculative analysis
+// =======================
+
+// Partial results of the speculative passes over one running recording.
+struct SpeculativeState {
+    SpeculativeState(int recording, std::shared_ptr<PrefetchState> prefetch)
+        : recording_id(recording), prefetched(std::move(prefetch)) {}
+
+    const int recording_id;
+    const std::shared_ptr<PrefetchState> prefetched;  // passages of the recording, if prefetching
+    std::mutex mutex;
+    std::condition_variable idle;
+    bool busy = false;               // a pass is running
+    size_t cursor = 0;               // transcript chars covered by parts
+    std::vector<std::string> parts;  // one answer per analysed window
+    // Shortest length the transcript was cut back to while a pass was running.
+    size_t truncated_to = std::string::npos;
+    size_t passes = 0;
+
+    // Waits for a running pass and returns the parts with the chars they cover.
+    std::pair<std::vector<std::string>, size_t> settle() {
+        std::unique_lock<std::mutex> lock(mutex);
+        idle.wait(lock, [this] { return !busy; });
+        return {parts, cursor};
+    }
+};
+
+// Analyses the running recording in the background, every interval or after a
+// pause in the transcript, so that on stop only the text added since the last
+// pass is left to analyse before the partial results are merged. Passes run on
+// this class's own thread, one at a time, outside the analysis queue.
+class SpeculativeAnalyzer {
+public:
+    using Clock = std::chrono::steady_clock;
+    using SnapshotFn = std::function<TranscriptSnapshot()>;
 
-// Load config
-bool load_config(const std::string& path) {
-    std::ifstream file_check(path);
-    if (!file_check.is_open()) {
-        say_error("Unable to open config file: " + path + "\n");
-        return false;
+    SpeculativeAnalyzer(LlmClient& client, SnapshotFn snapshot) : client_(client), snapshot_(std::move(snapshot)) {
+        thread_ = std::thread(&SpeculativeAnalyzer::run, this);
     }
-    file_check.close();
 
-    auto config = parse_ini(path);
+    ~SpeculativeAnalyzer() {
+        shutdown();
+    }
 
-    std::vector<std::string> missing_keys;
-    auto require_value = [&](const std::string& key, std::string& destination) {
-        auto it = config.find(key);
-        if (it == config.end() || it->second.empty()) {
-            missing_keys.push_back(key);
+    SpeculativeAnalyzer(const SpeculativeAnalyzer&) = delete;
+    SpeculativeAnalyzer& operator=(const SpeculativeAnalyzer&) = delete;
+
+    // prefetched is the recording's prefetch state, used for the passages of the passes.
+    void start_recording(int recording_id, std::shared_ptr<PrefetchState> prefetched) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        state_ = std::make_shared<SpeculativeState>(recording_id, std::move(prefetched));
+        last_pass_ = Clock::now();
+        pending_chars_ = 0;
+    }
+
+    // Called after each transcript line is appended.
+    void note_line(size_t chars) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        last_line_ = Clock::now();
+        pending_chars_ += chars;
+    }
+
+    // Called after the transcript was cut back to size chars, so the parts never
+    // claim to cover text that is no longer there.
+    void truncate(size_t size) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!state_) {
             return;
         }
-        destination = it->second;
-    };
+        std::lock_guard<std::mutex> state_lock(state_->mutex);
+        state_->cursor = std::min(state_->cursor, size);
+        if (state_->busy) {
+            state_->truncated_to = std::min(state_->truncated_to, size);
+        }
+    }
 
-    require_value("openai.base_url", OPENWEBUI_URL);
-    require_value("openai.api_key", API_KEY);
-    require_value("openai.model_name", MODEL_NAME);
-    require_value("prompts.prompt", PROMPT);
-    require_value("prompts.temp_prompt", TEMP_PROMPT);
-    require_value("triggers.start", TRIGGER_START);
-    require_value("triggers.stop", TRIGGER_STOP);
-    require_value("triggers.temp_check", TRIGGER_TEMP_CHECK);
-    require_value("tts.command", TTS_COMMAND);
+    // Ends the recording and hands its partial results to the final analysis;
+    // a pass still running completes into the returned state.
+    std::shared_ptr<SpeculativeState> stop_recording() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return std::exchange(state_, nullptr);
+    }
 
-    auto kb_it = config.find("analysis.knowledge_base_ids");
-    KNOWLEDGE_BASE_IDS = (kb_it != config.end()) ? kb_it->second : std::string{};
+    void shutdown() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (stopping_) {
+                return;
+            }
+            stopping_ = true;
+        }
+        cv_.notify_all();
+        if (thread_.joinable()) {
+            thread_.join();
+        }
+    }
 
-    if (!missing_keys.empty()) {
+    std::string stats() const {
+        std::lock_guard<std::mutex> lock(mutex_);
         std::ostringstream oss;
-        oss << "Missing required config values:";
-        for (const auto& key : missing_keys) {
-            oss << ' ' << key;
+        oss << "[speculative] passes=" << passes_ << " failed=" << failed_passes_
+            << " chars=" << analysed_chars_ << "\n";
+        return oss.str();
+    }
+
+private:
+    // Whether enough new transcript arrived and the interval elapsed or the speaker paused.
+    bool due(Clock::time_point now) const {
+        if (!state_ || estimate_tokens(pending_chars_) < SPECULATIVE_MIN_TOKENS) {
+            return false;
+        }
+        const bool interval = SPECULATIVE_INTERVAL_S > 0 && now - last_pass_ >= std::chrono::seconds(SPECULATIVE_INTERVAL_S);
+        const bool pause = SPECULATIVE_PAUSE_MS > 0 && now - last_line_ >= std::chrono::milliseconds(SPECULATIVE_PAUSE_MS);
+        return interval || pause;
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (!stopping_) {
+            cv_.wait_for(lock, std::chrono::milliseconds(250));
+            if (stopping_ || !due(Clock::now())) {
+                continue;
+            }
+            // The state and the text are taken together; a transcript that already
+            // belongs to the next recording must not be analysed into this one.
+            std::shared_ptr<SpeculativeState> state = state_;
+            const TranscriptSnapshot text = snapshot_();
+            if (text.recording() != state->recording_id) {
+                continue;
+            }
+            {
+                std::lock_guard<std::mutex> state_lock(state->mutex);
+                state->busy = true;
+            }
+            pending_chars_ = 0;
+            last_pass_ = Clock::now();
+            lock.unlock();
+            const bool ok = run_pass(*state, text);
+            lock.lock();
+            ++(ok ? passes_ : failed_passes_);
         }
-        oss << "\n";
-        say_error(oss.str());
-        return false;
     }
 
-    std::transform(TRIGGER_START.begin(), TRIGGER_START.end(), TRIGGER_START.begin(), ::tolower);
-    std::transform(TRIGGER_STOP.begin(), TRIGGER_STOP.end(), TRIGGER_STOP.begin(), ::tolower);
-    std::transform(TRIGGER_TEMP_CHECK.begin(), TRIGGER_TEMP_CHECK.end(), TRIGGER_TEMP_CHECK.begin(), ::tolower);
+    bool run_pass(SpeculativeState& state, const TranscriptSnapshot& text) {
+        size_t cursor = 0;
+        size_t first_part = 0;
+        {
+            std::lock_guard<std::mutex> lock(state.mutex);
+            cursor = state.cursor;
+            first_part = state.parts.size() + 1;
+        }
+        const auto started = Clock::now();
+        const std::string delta = text.substr(cursor);
+        const size_t budget = ANALYSIS_CHUNK_TOKENS > 0 ? ANALYSIS_CHUNK_TOKENS : std::numeric_limits<size_t>::max();
+        const std::vector<std::string> windows = split_windows(delta, budget, ANALYSIS_CHUNK_OVERLAP_LINES);
+        const std::vector<WindowResult> results = map_windows(client_, windows, state.recording_id, first_part, 0, state.prefetched, false);
 
-    if (KNOWLEDGE_BASE_IDS.empty()) {
-        say_error("Warning: analysis.knowledge_base_ids is not set; knowledge base lookups will be skipped.\n");
+        // A failed window would leave a gap, so the whole pass is dropped and its
+        // text is analysed again by the next pass or the final analysis.
+        const bool ok = !windows.empty() && std::none_of(results.begin(), results.end(), [](const WindowResult& result) {
+            return result.error || result.chat.content.empty();
+        });
+        const double ms = std::chrono::duration<double, std::milli>(Clock::now() - started).count();
+        std::cout << "[speculative] Recording[" << state.recording_id << "] pass " << (ok ? "over " : "failed for ")
+                  << delta.size() << " chars in " << windows.size() << " windows took " << std::fixed
+                  << std::setprecision(0) << ms << " ms\n";
+        {
+            std::lock_guard<std::mutex> lock(state.mutex);
+            if (ok) {
+                for (const auto& result : results) {
+                    state.parts.push_back(result.chat.content);
+                }
+                state.cursor = std::min(text.size(), state.truncated_to);
+                ++state.passes;
+            }
+            state.truncated_to = std::string::npos;
+            state.busy = false;
+        }
+        state.idle.notify_all();
+        if (ok) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            analysed_chars_ += delta.size();
+        }
+        return ok;
     }
 
-    return true;
+    LlmClient& client_;
+    SnapshotFn snapshot_;
+    std::thread thread_;
+    mutable std::mutex mutex_;
+    std::condition_variable cv_;
+    bool stopping_ = false;
+    std::shared_ptr<SpeculativeState> state_;  // of the running recording, if any
+    Clock::time_point last_pass_;
+    Clock::time_point last_line_;
+    size_t pending_chars_ = 0;  // appended since the last pass
+    size_t passes_ = 0;
+    size_t failed_passes_ = 0;
+    size_t analysed_chars_ = 0;
+};
+
+// =======================
+// Spoken summary
+// =======================
+
+// Spoken text of a CodeableConcept: its text, else the first coding display or code.
+std::string codeable_text(const json& codeable) {
+    if (!codeable.is_object()) {
+        return "";
+    }
+    if (codeable.contains("text") && codeable["text"].is_string()) {
+        return codeable["text"].get<std::string>();
+    }
+    if (codeable.contains("coding") && codeable["coding"].is_array()) {
+        for (const auto& coding : codeable["coding"]) {
+            for (const char* field : {"display", "code"}) {
+                if (coding.is_object() && coding.contains(field) && coding[field].is_string()) {
+                    return coding[field].get<std::string>();
+                }
+            }
+        }
+    }
+    return "";
 }
 
-// Substring check
-bool contains_substring(const std::string& str, const std::string& sub) {
-    return sub.empty() || str.find(sub) != std::string::npos;
+std::string quantity_text(const json& quantity) {
+    if (!quantity.is_object() || !quantity.contains("value") || !quantity["value"].is_number()) {
+        return "";
+    }
+    std::string text = quantity["value"].dump();
+    for (const char* field : {"unit", "code"}) {
+        if (quantity.contains(field) && quantity[field].is_string()) {
+            return text + " " + quantity[field].get<std::string>();
+        }
+    }
+    return text;
 }
 
-// Safely extract a textual message content from an OpenAI-style response
-std::string extract_message_content(const json& response) {
-    const auto choices_it = response.find("choices");
-    if (choices_it == response.end() || !choices_it->is_array() || choices_it->empty()) {
-        return {};
+// The key value of one resource as it should be read out, e.g. "heart rate 80 /min".
+std::string resource_key_value(const std::string& type, const json& resource) {
+    std::string name;
+    std::string value;
+    if (type == "MedicationAdministration" || type == "MedicationStatement") {
+        name = codeable_text(resource.value("medicationCodeableConcept", json::object()));
+        const json dosage = resource.value("dosage", json::object());
+        const json& first = dosage.is_array() && !dosage.empty() ? dosage[0] : dosage;
+        if (first.is_object()) {
+            value = quantity_text(first.value("dose", json::object()));
+            if (value.empty() && first.contains("text") && first["text"].is_string()) {
+                value = first["text"].get<std::string>();
+            }
+        }
+    } else if (type != "Patient" && type != "Encounter") {
+        name = codeable_text(resource.value("code", json::object()));
+        if (resource.contains("valueQuantity")) {
+            value = quantity_text(resource["valueQuantity"]);
+        } else if (resource.contains("valueCodeableConcept")) {
+            value = codeable_text(resource["valueCodeableConcept"]);
+        } else if (resource.contains("valueString") && resource["valueString"].is_string()) {
+            value = resource["valueString"].get<std::string>();
+        } else if (resource.contains("valueBoolean") && resource["valueBoolean"].is_boolean()) {
+            value = resource["valueBoolean"].get<bool>() ? "yes" : "no";
+        }
     }
+    if (name.empty() || value.empty()) {
+        return name + value;
+    }
+    return name + " " + value;
+}
 
-    const auto& first_choice = (*choices_it)[0];
-    if (!first_choice.is_object()) {
-        return {};
+// "MedicationAdministration" read out as "medication administrations".
+std::string spoken_resource_type(const std::string& type, size_t count) {
+    std::string spoken;
+    for (char c : type) {
+        if (std::isupper(static_cast<unsigned char>(c)) && !spoken.empty()) {
+            spoken.push_back(' ');
+        }
+        spoken.push_back(static_cast<char>(std::tolower(static_cast<unsigned char>(c))));
     }
+    return count == 1 ? spoken : spoken + "s";
+}
 
-    const auto message_it = first_choice.find("message");
-    if (message_it == first_choice.end() || !message_it->is_object()) {
-        return {};
+// Reads out a FHIR Bundle as resource counts per type followed by their key
+// values. Returns an empty string when bundle is not a Bundle with entries.
+std::string summarize_bundle(const json& bundle, size_t max_items) {
+    if (!bundle.is_object() || bundle.value("resourceType", "") != "Bundle" ||
+        !bundle.contains("entry") || !bundle["entry"].is_array() || bundle["entry"].empty()) {
+        return "";
+    }
+    std::vector<std::string> order;  // types in order of first appearance
+    std::map<std::string, std::vector<std::string>> values;
+    std::map<std::string, size_t> counts;
+    size_t total = 0;
+    for (const auto& entry : bundle["entry"]) {
+        if (!entry.is_object() || !entry.contains("resource") || !entry["resource"].is_object()) {
+            continue;
+        }
+        const json& resource = entry["resource"];
+        const std::string type = resource.value("resourceType", "");
+        if (type.empty()) {
+            continue;
+        }
+        if (counts[type]++ == 0) {
+            order.push_back(type);
+        }
+        ++total;
+        const std::string value = resource_key_value(type, resource);
+        auto& listed = values[type];
+        if (!value.empty() && std::find(listed.begin(), listed.end(), value) == listed.end()) {
+            listed.push_back(value);
+        }
+    }
+    if (total == 0) {
+        return "";
     }
 
-    const auto content_it = message_it->find("content");
-    if (content_it == message_it->end()) {
-        return {};
+    std::ostringstream oss;
+    oss << total << (total == 1 ? " resource" : " resources") << " extracted.";
+    for (const auto& type : order) {
+        const auto& listed = values[type];
+        oss << " " << counts[type] << " " << spoken_resource_type(type, counts[type]);
+        for (size_t i = 0; i < listed.size() && i < max_items; ++i) {
+            oss << (i == 0 ? ": " : ", ") << listed[i];
+        }
+        if (listed.size() > max_items) {
+            oss << " and " << listed.size() - max_items << " more";
+        }
+        oss << ".";
     }
+    return oss.str();
+}
 
-    if (content_it->is_string()) {
-        return content_it->get<std::string>();
+// Splits Markdown-ish model output into sentences, dropping list markers,
+// emphasis and headings. A '.' only ends a sentence before a space, so that
+// decimals such as 38.5 stay whole.
+std::vector<std::string> split_sentences(const std::string& text) {
+    std::vector<std::string> sentences;
+    std::istringstream lines(text);
+    std::string line;
+    bool in_fence = false;
+    while (std::getline(lines, line)) {
+        const std::string stripped = trim(line);
+        if (stripped.compare(0, 3, "```") == 0) {
+            in_fence = !in_fence;
+            continue;
+        }
+        if (in_fence) {
+            continue;
+        }
+        size_t start = stripped.find_first_not_of("#*->| \t");
+        if (start == std::string::npos) {
+            continue;
+        }
+        // Ordered list markers such as "2." or "2)", but not a value like "2 doses".
+        const size_t digits_end = stripped.find_first_not_of("0123456789", start);
+        if (digits_end != start && digits_end != std::string::npos && digits_end + 1 < stripped.size() &&
+            (stripped[digits_end] == '.' || stripped[digits_end] == ')') && stripped[digits_end + 1] == ' ') {
+            start = digits_end + 2;
+        }
+        std::string current;
+        for (size_t i = start; i < stripped.size(); ++i) {
+            const char c = stripped[i];
+            if (c == '*' || c == '`' || c == '|') {
+                continue;
+            }
+            current.push_back(c);
+            const bool at_break = i + 1 == stripped.size() || std::isspace(static_cast<unsigned char>(stripped[i + 1]));
+            if ((c == '.' || c == '!' || c == '?') && at_break) {
+                sentences.push_back(trim(current));
+                current.clear();
+            }
+        }
+        if (!trim(current).empty()) {
+            sentences.push_back(trim(current));
+        }
     }
+    sentences.erase(std::remove_if(sentences.begin(), sentences.end(),
+                                   [](const std::string& s) { return fold_words(s).size() < 3; }),
+                    sentences.end());
+    return sentences;
+}
 
-    if (content_it->is_array()) {
-        std::string combined;
-        for (const auto& part : *content_it) {
-            if (!combined.empty()) {
-                combined.push_back('\n');
+// Extractive summary: TextRank over the TF-IDF cosine similarity of the
+// sentences, keeping the max_sentences best in their original order.
+std::string summarize_text(const std::string& text, size_t max_sentences) {
+    const std::vector<std::string> sentences = split_sentences(text);
+    const size_t n = sentences.size();
+    std::vector<size_t> chosen;
+    if (n <= max_sentences) {
+        for (size_t i = 0; i < n; ++i) {
+            chosen.push_back(i);
+        }
+    } else {
+        // Sparse TF-IDF vector per sentence, sorted by term index.
+        std::map<std::u32string, size_t> vocabulary;
+        std::vector<std::map<size_t, double>> counts(n);
+        for (size_t i = 0; i < n; ++i) {
+            for (const auto& word : fold_words(sentences[i])) {
+                if (word.size() > 2 && !is_stop_word(word)) {
+                    const size_t term = vocabulary.emplace(word, vocabulary.size()).first->second;
+                    counts[i][term] += 1.0;
+                }
             }
-            combined += part.is_string() ? part.get<std::string>() : part.dump();
         }
-        return combined;
+        std::vector<size_t> document_frequency(vocabulary.size(), 0);
+        for (const auto& sentence : counts) {
+            for (const auto& [term, count] : sentence) {
+                ++document_frequency[term];
+            }
+        }
+        std::vector<std::vector<std::pair<size_t, double>>> vectors(n);
+        for (size_t i = 0; i < n; ++i) {
+            double norm = 0.0;
+            for (const auto& [term, count] : counts[i]) {
+                const double weight = count * std::log(1.0 + static_cast<double>(n) / document_frequency[term]);
+                vectors[i].emplace_back(term, weight);
+                norm += weight * weight;
+            }
+            for (auto& entry : vectors[i]) {
+                entry.second /= norm > 0.0 ? std::sqrt(norm) : 1.0;
+            }
+        }
+
+        std::vector<std::vector<double>> similarity(n, std::vector<double>(n, 0.0));
+        std::vector<double> out_weight(n, 0.0);
+        for (size_t i = 0; i < n; ++i) {
+            for (size_t j = i + 1; j < n; ++j) {
+                double dot = 0.0;
+                auto a = vectors[i].begin();
+                auto b = vectors[j].begin();
+                while (a != vectors[i].end() && b != vectors[j].end()) {
+                    if (a->first < b->first) {
+                        ++a;
+                    } else if (b->first < a->first) {
+                        ++b;
+                    } else {
+                        dot += (a++)->second * (b++)->second;
+                    }
+                }
+                similarity[i][j] = similarity[j][i] = dot;
+                out_weight[i] += dot;
+                out_weight[j] += dot;
+            }
+        }
+
+        constexpr double damping = 0.85;
+        std::vector<double> score(n, 1.0);
+        for (int iteration = 0; iteration < 50; ++iteration) {
+            std::vector<double> next(n, 1.0 - damping);
+            double change = 0.0;
+            for (size_t i = 0; i < n; ++i) {
+                for (size_t j = 0; j < n; ++j) {
+                    if (similarity[j][i] > 0.0) {
+                        next[i] += damping * similarity[j][i] / out_weight[j] * score[j];
+                    }
+                }
+                change += std::fabs(next[i] - score[i]);
+            }
+            score.swap(next);
+            if (change < 1e-6 * n) {
+                break;
+            }
+        }
+
+        std::vector<size_t> ranked(n);
+        for (size_t i = 0; i < n; ++i) {
+            ranked[i] = i;
+        }
+        // Ties go to the earlier sentence, which usually states the finding.
+        std::stable_sort(ranked.begin(), ranked.end(), [&score](size_t a, size_t b) { return score[a] > score[b]; });
+        chosen.assign(ranked.begin(), ranked.begin() + static_cast<std::ptrdiff_t>(max_sentences));
+        std::sort(chosen.begin(), chosen.end());
     }
 
-    return {};
+    std::string summary;
+    for (size_t i : chosen) {
+        summary += (summary.empty() ? "" : " ") + sentences[i];
+    }
+    return summary;
+}
+
+// Local replacement for the summary round-trip: a FHIR Bundle answer is read out
+// by resource, anything else is summarised extractively.
+std::string extractive_summary(const std::string& response, const json& bundle = json()) {
+    std::string summary = summarize_bundle(bundle, SUMMARY_MAX_ITEMS);
+    if (summary.empty()) {
+        summary = summarize_bundle(parse_json_answer(response), SUMMARY_MAX_ITEMS);
+    }
+    if (summary.empty()) {
+        summary = summarize_text(response, SUMMARY_SENTENCES);
+    }
+    return summary;
 }
 
-// AI analysis with fresh context for each request
-void analyze_text(const std::string& text) {
-    AnalysisSession session(analysis_mutex, active_analyses);
-    const int analysis_id = ++counter_value;
-    temp_counter_value = 0; // Reset temp counter for each main analysis
+// AI analysis with fresh context for each request. With speculative passes on
+// record only the transcript they did not cover is analysed before merging;
+// with prefetched protocol passages the request carries them instead of
+// asking the server to search the knowledge bases.
+void analyze_text(LlmClient& client, const TranscriptSnapshot& text, int analysis_id,
+                  const std::shared_ptr<SpeculativeState>& speculative = nullptr,
+                  const std::shared_ptr<PrefetchState>& prefetched = nullptr,
+                  const NormalizationStats& normalization = {}) {
     say_info("Analysis of Recording[" + std::to_string(analysis_id) + "] Started ------------------->>>\n");
 
     const std::string filename = "results_analysis" + std::to_string(analysis_id) + ".txt";
-    std::ofstream file(filename);
-    if (!file.is_open()) {
-        say_error("[ERROR] Unable to open results file: " + filename + "\n");
-        say_info("Analysis of Recording[" + std::to_string(analysis_id) + "] Finished ------------------->>>\n");
-        return;
-    }
+    ResultsFile file(filename);
 
-    file << "Using model: " << MODEL_NAME << "\n";
-    file << "Endpoint: " << OPENWEBUI_URL << "\n";
+    file << "Route: " << client.describe_route(RequestClass::Analysis) << "\n";
     file << "Prompt: " << PROMPT << "\n" << text << "\n";
 
-    if (!file) {
-        say_error("[ERROR] Failed to write analysis header to " + filename + "\n");
-    }
+    const std::string transcript = text.str();
+    json record = {
+        {"session", SESSION_ID},
+        {"kind", "analysis"},
+        {"recording", analysis_id},
+        {"analysis_id", std::to_string(analysis_id)},
+        {"time", iso_time_now()},
+        {"prompt_hash", to_hex(fnv1a_64(transcript, fnv1a_64(PROMPT)))},
+        {"transcript_chars", transcript.size()},
+        {"status", "ok"}
+    };
+    report_normalization(file, "Analysis[" + std::to_string(analysis_id) + "]", normalization, record);
 
     std::string response_string;
+    std::unique_ptr<FhirBundleCollector> fhir;
+    if (FHIR_VALIDATE) {
+        fhir = std::make_unique<FhirBundleCollector>(client, analysis_id);
+    }
+    json validated_bundle;
 
     try {
-        openai::start({
-            API_KEY
-        });
-
-        json body = {
-            {"model", MODEL_NAME},
-            {"messages", {
-                {{"role", "system"}, {"content", "You are a helpful assistant."}},
-                {{"role", "user"}, {"content", PROMPT + "\n" + text}}
-            }},
-            {"stream", false},
-            {"enable_websearch", true}
-        };
-
-        if (!KNOWLEDGE_BASE_IDS.empty()) {
-            body["knowledge_base_ids"] = json::array({KNOWLEDGE_BASE_IDS});
+        std::vector<std::string> speculative_parts;
+        size_t covered_chars = 0;
+        if (speculative) {
+            std::tie(speculative_parts, covered_chars) = speculative->settle();
+            if (covered_chars > transcript.size()) {
+                speculative_parts.clear();
+                covered_chars = 0;
+            }
         }
+        if (!speculative_parts.empty() ||
+            (ANALYSIS_CHUNK_TOKENS > 0 && estimate_tokens(transcript.size()) > ANALYSIS_CHUNK_TOKENS)) {
+            response_string = analyze_in_windows(client, transcript, analysis_id, file, record, prefetched,
+                                                 speculative_parts, covered_chars);
+            file << "\n\nFull response received:\n" << response_string << "\n";
+            record["response"] = response_string;
+            if (fhir) {
+                fhir->feed(response_string);
+            }
+        } else {
+            const RetrievedContext protocols = recording_protocols(transcript, prefetched, true);
+            report_retrieval(file, "Analysis[" + std::to_string(analysis_id) + "]", protocols, record);
+            json body = {
+                {"messages", build_messages(PROMPT, protocols.text + transcript)},
+                {"stream", STREAM_RESPONSES},
+                {"enable_websearch", true}
+            };
+            apply_cache_hints(body, analysis_id);
+            apply_response_format(body);
+            apply_knowledge_bases(body, protocols);
 
-        auto chat = openai::chat().create(body);
-        response_string = extract_message_content(chat);
-        if (response_string.empty()) {
-            file << "\n[WARN] No textual content found in primary response. Full payload:\n"
-                 << chat.dump(2) << "\n";
-            say_error(std::string{"[WARN] Analysis["} + std::to_string(analysis_id) +
-                      "] returned no text content; see results file.\n");
+            file << "\n\nFull response received:\n" << std::flush;
+            const ChatResult chat = client.chat(RequestClass::Analysis, body, [&file, &fhir](const std::string& delta) {
+                file << delta << std::flush;
+                if (fhir) {
+                    fhir->feed(delta);
+                }
+            });
+            response_string = chat.content;
+            file << "\n";
+            report_timing(file, "Analysis[" + std::to_string(analysis_id) + "]", chat);
+            file << "Tokens: " << describe_usage(chat) << "\n";
+            std::cout << "[tokens] Analysis[" << analysis_id << "]: " << describe_usage(chat) << "\n";
+            record["response"] = response_string;
+            record["timings"] = chat_record(chat);
+            if (response_string.empty()) {
+                file << "\n[WARN] No textual content found in primary response. Full payload:\n"
+                     << chat.payload.dump(2) << "\n";
+                say_error(std::string{"[WARN] Analysis["} + std::to_string(analysis_id) +
+                          "] returned no text content; see results file.\n");
+            }
         }
 
-        file << "\n\nFull response received:\n" << response_string << "\n";
+        // The valid Bundle is stored as its own artefact for downstream consumers.
+        if (fhir && !response_string.empty()) {
+            json report;
+            const json bundle = fhir->finish(file, report);
+            if (!bundle["entry"].empty()) {
+                validated_bundle = bundle;
+                const std::string bundle_path = "results_analysis" + std::to_string(analysis_id) + ".fhir.json";
+                ResultsFile artefact(bundle_path);
+                artefact << bundle.dump(2) << "\n";
+                report["artefact"] = bundle_path;
+            }
+            record["fhir"] = report;
+        }
     } catch (const std::exception& e) {
-        file << "\n[ERROR] Analysis[" << analysis_id << "] failed: " << e.what() << "\n";
-        say_error(std::string{"[ERROR] Analysis["} + std::to_string(analysis_id) + "] failed: " + e.what() + "\n");
+        if (!job_cancelled()) {
+            file << "\n[ERROR] Analysis[" << analysis_id << "] failed: " << e.what() << "\n";
+            say_error(std::string{"[ERROR] Analysis["} + std::to_string(analysis_id) + "] failed: " + e.what() + "\n");
+            record["status"] = "error";
+            record["error"] = e.what();
+        }
+    }
+
+    if (job_cancelled()) {
+        file << "\n[CANCELLED] Analysis[" << analysis_id << "] was cancelled\n";
+        say_info("Analysis[" + std::to_string(analysis_id) + "] cancelled\n");
+        record["status"] = "cancelled";
+        response_string.clear();  // nothing to summarise
     }
 
     if (!response_string.empty()) {
         try {
-            json summary_body = {
-                {"model", MODEL_NAME},
-                {"messages", {
-                    {{"role", "system"}, {"content", "You are a helpful assistant."}},
-                    {{"role", "user"}, {"content", "Provide a concise summary of the following text, Keep it short and informative.\n" + response_string + "\n\n"}}
-                }},
-                {"stream", false},
-                {"enable_websearch", false}
-            };
+            std::string summary_string;
+            if (SUMMARY_MODE == "extractive") {
+                const auto started = std::chrono::steady_clock::now();
+                summary_string = extractive_summary(response_string, validated_bundle);
+                const double elapsed_ms = std::chrono::duration<double, std::milli>(
+                    std::chrono::steady_clock::now() - started).count();
+                if (summary_string.empty()) {
+                    file << "\n[WARN] No sentences found to summarise.\n";
+                    say_error(std::string{"[WARN] Summary extraction found no text for Analysis["} +
+                              std::to_string(analysis_id) + "]; see results file.\n");
+                }
+                std::ostringstream timing;
+                timing << std::fixed << std::setprecision(2) << elapsed_ms;
+                file << "Summary extracted locally in " << timing.str() << " ms\n";
+                std::cout << "[timing] Summary[" << analysis_id << "]: extracted in " << timing.str() << " ms\n";
+                record["summary_timings"] = {{"mode", "extractive"}, {"total_ms", elapsed_ms}};
+            } else {
+                json summary_body = {
+                    {"messages", build_messages("Provide a concise summary of the following text, Keep it short and informative.",
+                                                response_string + "\n\n")},
+                    {"stream", STREAM_RESPONSES},
+                    {"enable_websearch", false}
+                };
+                apply_cache_hints(summary_body, analysis_id);
 
-            auto summary_chat = openai::chat().create(summary_body);
-            const std::string summary_string = extract_message_content(summary_chat);
-            if (summary_string.empty()) {
-                file << "\n[WARN] No textual summary returned. Full payload:\n"
-                     << summary_chat.dump(2) << "\n";
-                say_error(std::string{"[WARN] Summary generation returned no text for Analysis["} +
-                          std::to_string(analysis_id) + "]; see results file.\n");
+                const ChatResult summary_chat = client.chat(RequestClass::Summary, summary_body, nullptr);
+                summary_string = summary_chat.content;
+                if (summary_string.empty()) {
+                    file << "\n[WARN] No textual summary returned. Full payload:\n"
+                         << summary_chat.payload.dump(2) << "\n";
+                    say_error(std::string{"[WARN] Summary generation returned no text for Analysis["} +
+                              std::to_string(analysis_id) + "]; see results file.\n");
+                }
+                record["summary_timings"] = chat_record(summary_chat);
+                record["summary_timings"]["mode"] = "llm";
             }
 
             file << "\nShort summary of response:\n" << summary_string << "\n";
-            speak_text("Analysis[" + std::to_string(analysis_id) + "] completed. Summary: " + summary_string);
+            record["summary"] = summary_string;
+            speak_text("Analysis[" + std::to_string(analysis_id) + "] completed. Summary: " + summary_string,
+                       TtsPriority::Result);
         } catch (const std::exception& e) {
             file << "\n[ERROR] Summary generation failed: " << e.what() << "\n";
+            record["summary_error"] = e.what();
             say_error(std::string{"[ERROR] Summary generation failed for Analysis["} + std::to_string(analysis_id) + "]: " + e.what() + "\n");
         }
     }
 
-    if (!file) {
-        say_error("[ERROR] Writing to results file failed for Analysis[" + std::to_string(analysis_id) + "]\n");
-    }
-
+    results_writer.record(record);
     say_info("Analysis of Recording[" + std::to_string(analysis_id) + "] Finished ------------------->>>\n");
 }
 
-void temp_analyze_text(const std::string& text) {
-    AnalysisSession session(analysis_mutex, active_analyses);
-    const int analysis_id = ++temp_counter_value;
-    const std::string analysis_id_str = std::to_string(counter_value + 1) + "." + std::to_string(analysis_id); 
+// Spoken answers of one recording's temporary checks share this supersede key.
+std::string temp_speech_key(int recording_id) {
+    return "temp:" + std::to_string(recording_id);
+}
+
+void temp_analyze_text(LlmClient& client, const TranscriptSnapshot& text, int check_id,
+                       const std::shared_ptr<TempCheckState>& state,
+                       const std::shared_ptr<PrefetchState>& prefetched = nullptr,
+                       const NormalizationStats& normalization = {}) {
+    const std::string analysis_id_str = std::to_string(state->recording_id) + "." + std::to_string(check_id);
+    // A newer check of the same recording supersedes this one's spoken answer.
+    const std::string speech_key = temp_speech_key(state->recording_id);
     say_info("Temporary_Analysis of Recording[" + analysis_id_str + "] Started ------------------->>>\n");
 
     const std::string filename = "tmp_results_analysis" + analysis_id_str + ".txt";
-    std::ofstream file(filename);
-    if (!file.is_open()) {
-        say_error("[ERROR] Unable to open results file: " + filename + "\n");
-        say_info("Temporary Analysis of Recording[" + analysis_id_str + "] Finished ------------------->>>\n");
-        return;
+    ResultsFile file(filename);
+
+    // With a previous answer on record only the new part of the transcript is sent.
+    std::string content;
+    size_t cursor = 0;
+    {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        if (INCREMENTAL_TEMP_CHECKS && !state->last_answer.empty() && state->cursor <= text.size()) {
+            cursor = state->cursor;
+            content = "Your previous assessment of this recording:\n" + state->last_answer +
+                      "\n\nTranscript added since that assessment:\n" + text.substr(cursor);
+        }
+    }
+    if (cursor == 0) {
+        content = text.str();
     }
+    const size_t request_chars = TEMP_PROMPT.size() + 1 + content.size();
 
-    file << "Using model: " << MODEL_NAME << "\n";
-    file << "Endpoint: " << OPENWEBUI_URL << "\n";
-    file << "Prompt: " << TEMP_PROMPT << "\n" << text << "\n";
+    file << "Route: " << client.describe_route(RequestClass::TempCheck) << "\n";
+    file << "Prompt: " << TEMP_PROMPT << "\n" << content << "\n";
 
-    if (!file) {
-        say_error("[ERROR] Failed to write analysis header to " + filename + "\n");
-    }
+    json record = {
+        {"session", SESSION_ID},
+        {"kind", "temp_check"},
+        {"recording", state->recording_id},
+        {"analysis_id", analysis_id_str},
+        {"time", iso_time_now()},
+        {"prompt_hash", to_hex(fnv1a_64(content, fnv1a_64(TEMP_PROMPT)))},
+        {"transcript_chars", text.size()},
+        {"incremental", cursor > 0},
+        {"status", "ok"}
+    };
+    report_normalization(file, "Temporary Analysis[" + analysis_id_str + "]", normalization, record);
 
     std::string response_string;
 
     try {
-        openai::start({
-            API_KEY
-        });
-
+        const RetrievedContext protocols = recording_protocols(text.str(), prefetched, false);
+        report_retrieval(file, "Temporary Analysis[" + analysis_id_str + "]", protocols, record);
         json body = {
-            {"model", MODEL_NAME},
-            {"messages", {
-                {{"role", "system"}, {"content", "You are a helpful assistant."}},
-                {{"role", "user"}, {"content", TEMP_PROMPT + "\n" + text}}
-            }},
-            {"stream", false},
+            {"messages", build_messages(TEMP_PROMPT, protocols.text + content)},
+            {"stream", STREAM_RESPONSES},
             {"enable_websearch", true}
         };
+        apply_cache_hints(body, state->recording_id);
+        apply_knowledge_bases(body, protocols);
+
+        // Speak the first complete sentence as soon as it has streamed in and the
+        // rest of the answer once the response is complete.
+        size_t spoken_length = 0;
+        file << "\n\nTemporary response received:\n" << std::flush;
+        const ChatResult chat = client.chat(RequestClass::TempCheck, body, [&](const std::string& delta) {
+            file << delta << std::flush;
+            response_string += delta;
+            if (spoken_length == 0 && STREAM_RESPONSES) {
+                const size_t sentence_end = find_sentence_end(response_string);
+                if (sentence_end != std::string::npos) {
+                    spoken_length = sentence_end;
+                    speak_text("Temporary Analysis[" + analysis_id_str + "] Response: " +
+                               response_string.substr(0, sentence_end),
+                               TtsPriority::Result, speech_key, check_id);
+                }
+            }
+        });
+        response_string = chat.content;
+        file << "\n";
+        report_timing(file, "Temporary Analysis[" + analysis_id_str + "]", chat);
+
+        std::ostringstream tokens;
+        const size_t sent_chars = request_chars + protocols.text.size();
+        tokens << (cursor > 0 ? "incremental" : "full") << " request of " << sent_chars
+               << " chars (~" << estimate_tokens(sent_chars) << " tokens) for "
+               << text.size() - cursor << " of " << text.size() << " transcript chars; usage "
+               << describe_usage(chat) << "\n";
+        file << "Tokens: " << tokens.str();
+        std::cout << "[tokens] Temporary Analysis[" << analysis_id_str << "]: " << tokens.str();
+        record["response"] = response_string;
+        record["timings"] = chat_record(chat);
 
-        if (!KNOWLEDGE_BASE_IDS.empty()) {
-            body["knowledge_base_ids"] = json::array({KNOWLEDGE_BASE_IDS});
+        if (!response_string.empty()) {
+            std::lock_guard<std::mutex> lock(state->mutex);
+            if (text.size() >= state->cursor) {
+                state->cursor = text.size();
+                state->last_answer = response_string;
+            }
         }
 
-        auto chat = openai::chat().create(body);
-        response_string = extract_message_content(chat);
         if (response_string.empty()) {
             file << "\n[WARN] No textual content found in temporary response. Full payload:\n"
-                 << chat.dump(2) << "\n";
+                 << chat.payload.dump(2) << "\n";
             say_error(std::string{"[WARN] Analysis["} + analysis_id_str +
                       "] returned no text content; see results file.\n");
         }
 
-        file << "\n\nTemporary response received:\n" << response_string << "\n";
-        speak_text("Temporary Analysis[" + analysis_id_str + "] completed. Response: " + response_string);
+        if (spoken_length == 0) {
+            speak_text("Temporary Analysis[" + analysis_id_str + "] completed. Response: " + response_string,
+                       TtsPriority::Result, speech_key, check_id);
+        } else if (spoken_length < response_string.size()) {
+            speak_text(response_string.substr(spoken_length), TtsPriority::Result, speech_key, check_id);
+        }
     } catch (const std::exception& e) {
-        file << "\n[ERROR] Analysis[" << analysis_id_str << "] failed: " << e.what() << "\n";
-        say_error(std::string{"[ERROR] Analysis["} + analysis_id_str + "] failed: " + e.what() + "\n");
+        if (job_cancelled()) {
+            file << "\n[CANCELLED] Temporary Analysis[" << analysis_id_str << "] was cancelled\n";
+            say_info("Temporary Analysis[" + analysis_id_str + "] cancelled\n");
+            record["status"] = "cancelled";
+        } else {
+            file << "\n[ERROR] Analysis[" << analysis_id_str << "] failed: " << e.what() << "\n";
+            say_error(std::string{"[ERROR] Analysis["} + analysis_id_str + "] failed: " + e.what() + "\n");
+            record["status"] = "error";
+            record["error"] = e.what();
+        }
     }
 
-    if (!file) {
-        say_error("[ERROR] Writing to results file failed for Analysis[" + analysis_id_str + "]\n");
-    }
+    results_writer.record(record);
 
     say_info("Temporary Analysis of Recording[" + analysis_id_str + "] Finished ------------------->>>\n");
 }
 
+// Queued temporary checks of one recording share this key, so a burst of
+// triggers collapses into one check of the latest transcript.
+std::string temp_check_key(int recording_id) {
+    return "temp_check:" + std::to_string(recording_id);
+}
+
+std::string analysis_key(int recording_id) {
+    return "analysis:" + std::to_string(recording_id);
+}
+
+// Tell the user how far back in the queue a freshly triggered analysis is.
+void report_queue_position(const AnalysisQueue& queue) {
+    const size_t ahead = queue.depth() + queue.busy();
+    if (ahead >= ANALYSIS_WORKERS) {
+        say_info(Announcements::ANALYSIS_QUEUED);
+        std::cout << "[queue] " << ahead << " analyses ahead of this one\n";
+    }
+}
+
 // Main loop
-int main() {
+// Usage: analyze_text.exe [--lookup-recording N | --lookup-since YYYY-MM-DDTHH:MM:SS | --build-index DIR]
+// Without arguments the analyzer reads the transcript from stdin; the lookup
+// options print stored result records and exit, --build-index indexes the
+// protocols under DIR into retrieval.index (default protocols.idx) and exits.
+int main(int argc, char** argv) {
     if (!load_config("./config.ini")) {
         say_error("Failed to load config.ini\n");
+        if (!TTS_COMMAND.empty()) {
+            tts_worker.start();
+            tts_worker.shutdown();
+        }
         return 1;
     }
 
-    say_info("Listening for input...\n");
+    if (argc == 3 && (std::string(argv[1]) == "--lookup-recording" || std::string(argv[1]) == "--lookup-since")) {
+        const bool by_recording = std::string(argv[1]) == "--lookup-recording";
+        ResultsWriter::lookup(by_recording ? std::atoi(argv[2]) : 0, by_recording ? std::string{} : argv[2], std::cout);
+        return 0;
+    }
+    if (argc == 3 && std::string(argv[1]) == "--build-index") {
+        const std::string path = RETRIEVAL_INDEX.empty() ? "protocols.idx" : RETRIEVAL_INDEX;
+        return build_protocol_index(argv[2], path, RETRIEVAL_DIMENSIONS, RETRIEVAL_CHUNK_CHARS) ? 0 : 1;
+    }
+
+    if (!RETRIEVAL_INDEX.empty()) {
+        std::string error;
+        if (protocol_index.open(RETRIEVAL_INDEX, error)) {
+            std::cout << "[retrieval] " << RETRIEVAL_INDEX << ": " << protocol_index.chunks() << " protocol chunks\n";
+        } else {
+            say_error("Warning: unable to load retrieval.index " + RETRIEVAL_INDEX + " (" + error +
+                      "); using the remote knowledge bases.\n");
+        }
+    }
+
+    std::signal(SIGPIPE, SIG_IGN);  // a dead TTS worker must not kill the analyzer
+    tts_worker.start();
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+    HttpEngine http_engine;
+    std::unique_ptr<ResponseCache> response_cache;
+    if (RESPONSE_CACHE) {
+        response_cache = std::make_unique<ResponseCache>(RESPONSE_CACHE_ON_DISK ? RESPONSE_CACHE_DIR : "",
+                                                         RESPONSE_CACHE_MEMORY_ENTRIES, RESPONSE_CACHE_DISK_ENTRIES,
+                                                         RESPONSE_CACHE_TTL_S);
+    }
+    std::unique_ptr<LocalLlm> local_llm;
+    if (!LOCAL_LLM_MODEL.empty()) {
+        try {
+            local_llm = std::make_unique<LocalLlm>(http_engine, LOCAL_LLM_MODEL);
+        } catch (const std::exception& e) {
+            say_error(std::string("Failed to start the local LLM: ") + e.what() + "\n");
+            tts_worker.shutdown();
+            return 1;
+        }
+    }
+    LlmClient llm_client(http_engine, response_cache.get(), local_llm.get());
+    AnalysisQueue analysis_queue(llm_client, ANALYSIS_WORKERS, ANALYSIS_QUEUE_CAPACITY);
+
+    const std::vector<std::string> known_commands = {"start", "stop", "temp_check", "cancel"};
+    TriggerMatcher trigger_matcher(TRIGGER_MAX_EDITS);
+    for (const auto& [command, phrases] : TRIGGERS) {
+        if (std::find(known_commands.begin(), known_commands.end(), command) == known_commands.end()) {
+            say_error("Warning: unknown trigger command triggers." + command + " is ignored.\n");
+            continue;
+        }
+        const auto edits = TRIGGER_COMMAND_MAX_EDITS.find(command);
+        trigger_matcher.add_phrases(command, phrases,
+                                    edits != TRIGGER_COMMAND_MAX_EDITS.end() ? edits->second : TRIGGER_MAX_EDITS);
+    }
+
+    say_info(Announcements::LISTENING);
 
     std::string line;
-    std::string collected_text;
+    TranscriptBuffer transcript;
+    std::mutex transcript_mutex;  // the speculative analyzer snapshots the running transcript
+    auto snapshot_transcript = [&transcript, &transcript_mutex] {
+        std::lock_guard<std::mutex> lock(transcript_mutex);
+        return transcript.snapshot();
+    };
+    std::unique_ptr<SpeculativeAnalyzer> speculative;
+    if (SPECULATIVE_ANALYSIS) {
+        speculative = std::make_unique<SpeculativeAnalyzer>(llm_client, snapshot_transcript);
+    }
+    std::unique_ptr<RetrievalPrefetcher> prefetcher;
+    if (RETRIEVAL_PREFETCH && !protocol_index.loaded() && !KNOWLEDGE_BASE_IDS.empty()) {
+        prefetcher = std::make_unique<RetrievalPrefetcher>(http_engine, snapshot_transcript);
+    }
     bool collect_text = false;
+    {
+        std::ostringstream session;
+        session << iso_time_now() << "-" << getpid();
+        SESSION_ID = session.str();
+    }
+    TranscriptNormalizer normalizer;
+    int recording_id = results_writer.start();
+    int temp_check_id = 0;
+    auto temp_state = std::make_shared<TempCheckState>(recording_id);
 
     while (std::getline(std::cin, line)) {
         std::cout << line << std::endl;
 
-        std::string lower_line = line;
-        std::transform(lower_line.begin(), lower_line.end(), lower_line.begin(), ::tolower);
+        const std::vector<std::string> commands = trigger_matcher.feed(line);
+        auto matched = [&commands](const char* command) {
+            return std::find(commands.begin(), commands.end(), command) != commands.end();
+        };
+        const bool line_contains_start = matched("start");
+        const bool line_contains_stop = matched("stop");
+        const bool line_contains_temp_check = matched("temp_check");
+        const bool line_contains_cancel = matched("cancel");
 
-        const bool line_contains_start = contains_substring(lower_line, TRIGGER_START);
-        const bool line_contains_stop = contains_substring(lower_line, TRIGGER_STOP);
-        const bool line_contains_temp_check = contains_substring(lower_line, TRIGGER_TEMP_CHECK);
+        // A trigger phrase begun at the end of the previous line is not transcript.
+        if (TRANSCRIPT_NORMALIZE && TRANSCRIPT_TRIGGER_FRAGMENTS && collect_text && !commands.empty()) {
+            const size_t old_length = normalizer.last_line().size() + 1;
+            if (auto shortened = normalizer.drop_trailing_words(trigger_matcher.carried_words())) {
+                size_t size = 0;
+                {
+                    std::lock_guard<std::mutex> lock(transcript_mutex);
+                    transcript.truncate(transcript.size() - old_length);
+                    if (!shortened->empty()) {
+                        transcript.append_line(*shortened);
+                    }
+                    size = transcript.size();
+                }
+                // The background passes assumed the transcript only grows.
+                if (speculative) {
+                    speculative->truncate(size);
+                }
+                if (prefetcher) {
+                    prefetcher->truncate(size);
+                }
+            }
+        }
+        if (!commands.empty()) {
+            normalizer.skip_line();
+        }
 
         if (line_contains_start) {
             if (collect_text) {
-                say_info("Recording has already been started ------------------->>>\n");
+                say_command(Announcements::RECORDING_ALREADY_STARTED);
             } else {
-                say_info("Recording started ------------------->>>\n");
-                collected_text.clear();
+                say_command(Announcements::RECORDING_STARTED);
+                // Answers to the previous recording's checks no longer need ordering.
+                tts_worker.forget(temp_speech_key(recording_id));
+                ++recording_id;
+                {
+                    std::lock_guard<std::mutex> lock(transcript_mutex);
+                    transcript.clear(recording_id);
+                }
                 collect_text = true;
+                normalizer.reset();
+                temp_check_id = 0;
+                temp_state = std::make_shared<TempCheckState>(recording_id);
+                if (prefetcher) {
+                    prefetcher->start_recording(recording_id);
+                }
+                if (speculative) {
+                    speculative->start_recording(recording_id, prefetcher ? prefetcher->current() : nullptr);
+                }
             }
         }
 
         if (line_contains_stop) {
             if (!collect_text) {
-                say_info("No recording is currently running ------------------->>>\n");
+                say_command(Announcements::NO_RECORDING);
             } else {
-                say_info("Recording stopped ------------------->>>\n");
-                std::string text_to_analyze = collected_text;
-                collected_text.clear();
+                say_command(Announcements::RECORDING_STOPPED);
+                TranscriptSnapshot text_to_analyze = snapshot_transcript();
+                {
+                    std::lock_guard<std::mutex> lock(transcript_mutex);
+                    transcript.clear();
+                }
                 collect_text = false;
-                if (active_analyses.load() > 0) {
-                    say_info("Another analysis is running; this one will start once it finishes ------------------->>>\n");
+                std::shared_ptr<SpeculativeState> speculative_state = speculative ? speculative->stop_recording() : nullptr;
+                std::shared_ptr<PrefetchState> prefetched =
+                    prefetcher ? prefetcher->stop_recording(text_to_analyze) : nullptr;
+                // The final analysis supersedes the temporary checks of the recording.
+                analysis_queue.cancel(temp_check_key(recording_id), PREEMPT_TEMP_CHECKS);
+                report_queue_position(analysis_queue);
+                const int id = recording_id;
+                const bool queued = analysis_queue.submit(
+                    "Analysis of Recording[" + std::to_string(id) + "]",
+                    [text = std::move(text_to_analyze), id, speculative_state, prefetched,
+                     normalization = normalizer.stats()](LlmClient& client) {
+                        analyze_text(client, text, id, speculative_state, prefetched, normalization);
+                    },
+                    analysis_key(id));
+                if (!queued) {
+                    say_error("[ERROR] Analysis queue is full; Recording[" + std::to_string(id) + "] was not analysed\n");
                 }
-                std::thread(analyze_text, std::move(text_to_analyze)).detach();
             }
         }
 
         if (line_contains_temp_check) {
             if (!collect_text) {
-                say_info("No recording is currently running ------------------->>>\n");
+                say_command(Announcements::NO_RECORDING);
             } else {
-                say_info("Temporary check requested ------------------->>>\n");
-                if (active_analyses.load() > 0) {
-                    say_info("Another analysis is running; this one will start once it finishes ------------------->>>\n");
+                say_command(Announcements::TEMP_CHECK_REQUESTED);
+                report_queue_position(analysis_queue);
+                const int check_id = ++temp_check_id;
+                const std::string id = std::to_string(recording_id) + "." + std::to_string(check_id);
+                const bool queued = analysis_queue.submit(
+                    "Temporary Analysis of Recording[" + id + "]",
+                    [snapshot = snapshot_transcript(), check_id, temp_state,
+                     prefetched = prefetcher ? prefetcher->current() : nullptr,
+                     normalization = normalizer.stats()](LlmClient& client) {
+                        temp_analyze_text(client, snapshot, check_id, temp_state, prefetched, normalization);
+                    },
+                    temp_check_key(recording_id));
+                if (!queued) {
+                    say_error("[ERROR] Analysis queue is full; temporary check " + id + " was dropped\n");
                 }
-                std::string snapshot = collected_text;
-                std::thread(temp_analyze_text, std::move(snapshot)).detach();
             }
         }
 
-        if (collect_text && !line_contains_start && !line_contains_stop && !line_contains_temp_check) {
-            collected_text += line + "\n";
+        if (line_contains_cancel) {
+            // The running recording's temporary checks, or everything of the last one stopped.
+            const size_t cancelled = analysis_queue.cancel(temp_check_key(recording_id), true) +
+                                     analysis_queue.cancel(analysis_key(recording_id), true);
+            say_command(cancelled > 0 ? Announcements::ANALYSIS_CANCELLED : Announcements::NOTHING_TO_CANCEL);
+        }
+
+        if (collect_text && !line_contains_start && !line_contains_stop && !line_contains_temp_check &&
+            !line_contains_cancel) {
+            const std::string kept = TRANSCRIPT_NORMALIZE ? normalizer.normalize(line) : line;
+            if (!kept.empty() || !TRANSCRIPT_NORMALIZE) {
+                {
+                    std::lock_guard<std::mutex> lock(transcript_mutex);
+                    transcript.append_line(kept);
+                }
+                if (speculative) {
+                    speculative->note_line(kept.size() + 1);
+                }
+                if (prefetcher) {
+                    prefetcher->note_line(kept.size() + 1);
+                }
+            }
         }
     }
 
+    const size_t pending = analysis_queue.depth() + analysis_queue.busy();
+    if (pending > 0) {
+        std::cout << "Input closed; waiting for " << pending << " analyses to finish\n";
+    }
+    if (speculative) {
+        speculative->shutdown();
+    }
+    analysis_queue.shutdown();
+    if (local_llm) {
+        local_llm->shutdown();
+    }
+    http_engine.shutdown();
+    std::cout << analysis_queue.stats();
+    std::cout << http_engine.stats();
+    std::cout << llm_client.stats();
+    if (local_llm) {
+        std::cout << local_llm->stats();
+    }
+    if (response_cache) {
+        std::cout << response_cache->stats();
+    }
+    if (speculative) {
+        std::cout << speculative->stats();
+    }
+    if (prefetcher) {
+        std::cout << prefetcher->stats();
+    }
+    curl_global_cleanup();
+    results_writer.shutdown();
+    std::cout << results_writer.stats();
+    tts_worker.shutdown();
+    std::cout << tts_worker.stats();
+
     return 0;
 }
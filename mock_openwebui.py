@@ -0,0 +1,276 @@
+# -*- coding: utf-8 -*-
+#
+# This file is part of the Spazio IT Speech-to-Data project.
+#
+# Copyright (C) 2025 Spazio IT
+# Spazio - IT Soluzioni Informatiche s.a.s.
+# via Manzoni 40
+# 46051 San Giorgio Bigarello
+# https://spazioit.com
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program. If not, see https://www.gnu.org/licenses/.
+#
+"""Local stand-in for the OpenWebUI/OpenAI chat completions and retrieval APIs.
+
+Lets analyze_text be exercised and benchmarked offline. Point
+openai.base_url at http://HOST:PORT/api and run, for example:
+
+    python3 mock_openwebui.py --port 8080 --latency lognormal:400:0.5 \\
+        --tokens-per-second 40 --failure-rate 0.05
+"""
+import argparse
+import json
+import math
+import random
+import sys
+import threading
+import time
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+DEFAULT_RESPONSE = (
+    "The patient is stable. Heart rate and blood pressure are within the expected range. "
+    "No deviation from the treatment protocol was detected so far."
+)
+
+
+def parse_latency(spec):
+    """Return a function sampling a latency in seconds from a distribution spec.
+
+    Specs are in milliseconds: "fixed:MS", "uniform:LOW:HIGH" or
+    "lognormal:MEDIAN:SIGMA".
+    """
+    kind, _, params = spec.partition(":")
+    values = [float(v) for v in params.split(":")] if params else []
+    if kind == "fixed" and len(values) == 1:
+        return lambda: values[0] / 1000.0
+    if kind == "uniform" and len(values) == 2:
+        return lambda: random.uniform(values[0], values[1]) / 1000.0
+    if kind == "lognormal" and len(values) == 2:
+        mu = math.log(values[0])
+        return lambda: random.lognormvariate(mu, values[1]) / 1000.0
+    raise argparse.ArgumentTypeError(f"invalid latency distribution: {spec}")
+
+
+class Stats:
+    """Thread-safe request counters printed on shutdown."""
+
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.counts = {"requests": 0, "streamed": 0, "failed": 0, "hung": 0, "kb_lookups": 0,
+                       "retrieval_queries": 0}
+
+    def add(self, key, amount=1):
+        """Increment one counter."""
+        with self.lock:
+            self.counts[key] += amount
+
+    def summary(self):
+        """Return the counters as a single line."""
+        with self.lock:
+            return " ".join(f"{k}={v}" for k, v in self.counts.items())
+
+
+class MockHandler(BaseHTTPRequestHandler):
+    """Serves POST .../chat/completions, streamed (SSE) or not, and
+    POST .../retrieval/query/doc."""
+
+    protocol_version = "HTTP/1.1"
+    options = None
+    stats = Stats()
+
+    def log_message(self, format, *args):  # pylint: disable=redefined-builtin
+        if self.options.verbose:
+            super().log_message(format, *args)
+
+    def do_POST(self):  # pylint: disable=invalid-name
+        """Dispatch POST requests by path."""
+        length = int(self.headers.get("Content-Length", 0))
+        try:
+            body = json.loads(self.rfile.read(length) or b"{}")
+        except json.JSONDecodeError:
+            self.send_json(400, {"error": {"message": "invalid JSON body"}})
+            return
+
+        path = self.path.rstrip("/")
+        if path.endswith("/retrieval/query/doc"):
+            self.query_doc(body)
+        elif path.endswith("/chat/completions"):
+            self.chat_completions(body)
+        else:
+            self.send_json(404, {"error": {"message": f"unknown path {self.path}"}})
+
+    def query_doc(self, body):
+        """Answer a knowledge base query with k made-up passages."""
+        options = self.options
+        self.stats.add("retrieval_queries")
+        collection = str(body.get("collection_name", ""))
+        if options.require_known_kb and collection not in options.known_kb:
+            self.send_json(404, {"error": {"message": "unknown knowledge base"}})
+            return
+        time.sleep(options.kb_latency_ms / 1000.0)
+        count = max(0, int(body.get("k", 4)))
+        self.send_json(200, {
+            "documents": [[f"Passage {i + 1} of {collection}." for i in range(count)]],
+            "metadatas": [[{"source": f"{collection}/protocol.txt"} for _ in range(count)]],
+            "distances": [[round(1.0 - 0.1 * i, 2) for i in range(count)]],
+        })
+
+    def send_json(self, status, payload):
+        """Send a complete JSON response."""
+        data = json.dumps(payload).encode("utf-8")
+        self.send_response(status)
+        self.send_header("Content-Type", "application/json")
+        self.send_header("Content-Length", str(len(data)))
+        self.end_headers()
+        self.wfile.write(data)
+
+    def send_chunk(self, text):
+        """Send one chunk of a chunked transfer-encoded response."""
+        data = text.encode("utf-8")
+        self.wfile.write(b"%x\r\n%s\r\n" % (len(data), data))
+        self.wfile.flush()
+
+    def response_tokens(self, body):
+        """Build the response text, split into tokens, for a request."""
+        text = self.options.response_text
+        kb_ids = body.get("knowledge_base_ids") or []
+        if kb_ids and self.options.echo_knowledge_bases:
+            text += " Protocols consulted: " + ", ".join(str(k) for k in kb_ids) + "."
+        return [word + " " for word in text.split(" ") if word]
+
+    def chat_completions(self, body):
+        """Answer a chat completion after the configured delays and failures."""
+        options = self.options
+        self.stats.add("requests")
+        model = body.get("model", "mock")
+        prompt_chars = sum(len(str(m.get("content", ""))) for m in body.get("messages", []))
+
+        kb_ids = body.get("knowledge_base_ids") or []
+        if kb_ids:
+            self.stats.add("kb_lookups", len(kb_ids))
+            if options.require_known_kb and any(k not in options.known_kb for k in kb_ids):
+                self.send_json(404, {"error": {"message": "unknown knowledge base"}})
+                return
+
+        delay = options.latency() + options.kb_latency_ms / 1000.0 * len(kb_ids)
+        delay += prompt_chars / 4.0 / options.prefill_tokens_per_second
+        time.sleep(delay)
+
+        roll = random.random()
+        if roll < options.hang_rate:
+            self.stats.add("hung")
+            time.sleep(options.hang_seconds)
+            self.close_connection = True
+            return
+        if roll < options.hang_rate + options.failure_rate:
+            self.stats.add("failed")
+            self.send_json(options.failure_status, {"error": {"message": "injected failure"}})
+            return
+
+        tokens = self.response_tokens(body)
+        usage = {
+            "prompt_tokens": prompt_chars // 4,
+            "completion_tokens": len(tokens),
+            "total_tokens": prompt_chars // 4 + len(tokens),
+        }
+        interval = 1.0 / options.tokens_per_second if options.tokens_per_second > 0 else 0.0
+
+        if not body.get("stream"):
+            time.sleep(interval * len(tokens))
+            self.send_json(200, {
+                "id": "mock-completion",
+                "object": "chat.completion",
+                "model": model,
+                "choices": [{"index": 0, "finish_reason": "stop",
+                             "message": {"role": "assistant", "content": "".join(tokens)}}],
+                "usage": usage,
+            })
+            return
+
+        self.stats.add("streamed")
+        self.send_response(200)
+        self.send_header("Content-Type", "text/event-stream")
+        self.send_header("Transfer-Encoding", "chunked")
+        self.end_headers()
+        try:
+            for token in tokens:
+                chunk = {"object": "chat.completion.chunk", "model": model,
+                         "choices": [{"index": 0, "delta": {"content": token}}]}
+                self.send_chunk("data: " + json.dumps(chunk) + "\n\n")
+                time.sleep(interval)
+            final = {"object": "chat.completion.chunk", "model": model,
+                     "choices": [{"index": 0, "delta": {}, "finish_reason": "stop"}]}
+            self.send_chunk("data: " + json.dumps(final) + "\n\n")
+            if (body.get("stream_options") or {}).get("include_usage"):
+                self.send_chunk("data: " + json.dumps({"choices": [], "usage": usage}) + "\n\n")
+            self.send_chunk("data: [DONE]\n\n")
+            self.wfile.write(b"0\r\n\r\n")
+        except (BrokenPipeError, ConnectionResetError):
+            pass  # the client cancelled the request
+
+
+def main():
+    """Parse the command line and serve until interrupted."""
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--host", default="127.0.0.1")
+    parser.add_argument("--port", type=int, default=8080)
+    parser.add_argument("--latency", type=parse_latency, default=parse_latency("fixed:200"),
+                        help="time to first token: fixed:MS, uniform:LOW:HIGH or "
+                        "lognormal:MEDIAN:SIGMA")
+    parser.add_argument("--tokens-per-second", type=float, default=50.0,
+                        help="generation speed; 0 sends all tokens at once")
+    parser.add_argument("--prefill-tokens-per-second", type=float, default=2000.0,
+                        help="prompt processing speed, estimated at 4 chars per token")
+    parser.add_argument("--response-file", help="file with the response text to return")
+    parser.add_argument("--failure-rate", type=float, default=0.0,
+                        help="fraction of requests answered with --failure-status")
+    parser.add_argument("--failure-status", type=int, default=500)
+    parser.add_argument("--hang-rate", type=float, default=0.0,
+                        help="fraction of requests that never answer")
+    parser.add_argument("--hang-seconds", type=float, default=600.0)
+    parser.add_argument("--kb-latency-ms", type=float, default=0.0,
+                        help="extra latency per entry of knowledge_base_ids and per "
+                        "retrieval query")
+    parser.add_argument("--known-kb", action="append", default=[],
+                        help="accepted knowledge base ID (repeatable)")
+    parser.add_argument("--echo-knowledge-bases", action="store_true",
+                        help="mention the consulted knowledge bases in the response")
+    parser.add_argument("--seed", type=int, help="random seed for reproducible runs")
+    parser.add_argument("--verbose", action="store_true")
+    options = parser.parse_args()
+
+    if options.seed is not None:
+        random.seed(options.seed)
+    options.require_known_kb = bool(options.known_kb)
+    options.response_text = DEFAULT_RESPONSE
+    if options.response_file:
+        with open(options.response_file, "r", encoding="utf-8") as response_file:
+            options.response_text = response_file.read().strip()
+
+    MockHandler.options = options
+    server = ThreadingHTTPServer((options.host, options.port), MockHandler)
+    server.daemon_threads = True
+    print(f"Mock OpenWebUI listening on http://{options.host}:{options.port}/api", flush=True)
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+    finally:
+        server.server_close()
+        print(MockHandler.stats.summary(), file=sys.stderr)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,242 @@
+# -*- coding: utf-8 -*-
+#
+# This file is part of the Spazio IT Speech-to-Data project.
+#
+# Copyright (C) 2025 Spazio IT
+# Spazio - IT Soluzioni Informatiche s.a.s.
+# via Manzoni 40
+# 46051 San Giorgio Bigarello
+# https://spazioit.com
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program. If not, see https://www.gnu.org/licenses/.
+#
+"""Replay recorded transcripts through analyze_text and report latencies.
+
+Each transcript is a text file with one transcribed line per line, including
+the spoken trigger phrases. Every run uses a fresh working directory with a
+generated config.ini that points at --base-url (normally mock_openwebui.py)
+and sends speech to this script in --tts-sink mode, so that spoken output can
+be timestamped. Two latencies are reported per analysis kind:
+
+  trigger -> first spoken word   the first utterance about that analysis
+  trigger -> file complete       the "... Finished" line on stdout
+
+Example:
+
+    python3 mock_openwebui.py --port 8080 &
+    python3 replay_transcript.py --analyzer ./analyze_text.exe \\
+        --base-url http://127.0.0.1:8080/api --runs 5 session.txt \\
+        --set analysis.workers=2 --set openai.stream=true
+"""
+import argparse
+import json
+import os
+import re
+import shlex
+import shutil
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+START_PHRASE = "start recording"
+STOP_PHRASE = "stop recording"
+TEMP_CHECK_PHRASE = "temp check"
+
+FINISHED_PATTERN = re.compile(r"(Temporary )?Analysis of Recording\[([0-9.]+)\] Finished")
+SPOKEN_PATTERN = re.compile(r"(Temporary )?Analysis\[([0-9.]+)\]")
+
+
+def tts_sink(log_path):
+    """Stand-in TTS worker: timestamp every utterance read from stdin."""
+    with open(log_path, "a", encoding="utf-8") as log:
+        for line in sys.stdin:
+            log.write(json.dumps({"time": time.time(), "text": line.rstrip("\n")}) + "\n")
+            log.flush()
+
+
+def write_config(workdir, options, tts_log):
+    """Write the config.ini used by one run."""
+    sink = " ".join(shlex.quote(part) for part in
+                    [sys.executable, os.path.abspath(__file__), "--tts-sink", tts_log])
+    sections = {
+        "openai": {"base_url": options.base_url, "api_key": "mock", "model_name": options.model},
+        "prompts": {
+            "prompt": "Extract the clinical data as a FHIR Bundle.",
+            "temp_prompt": "Check the transcript against the protocol.",
+        },
+        "triggers": {"start": START_PHRASE, "stop": STOP_PHRASE, "temp_check": TEMP_CHECK_PHRASE},
+        "tts": {"command": sink, "mode": "pipe", "worker_command": sink},
+    }
+    for setting in options.set:
+        key, _, value = setting.partition("=")
+        section, _, name = key.partition(".")
+        if not name:
+            raise SystemExit(f"--set expects SECTION.KEY=VALUE, got {setting}")
+        sections.setdefault(section, {})[name] = value
+
+    with open(os.path.join(workdir, "config.ini"), "w", encoding="utf-8") as config:
+        for section, values in sections.items():
+            config.write(f"[{section}]\n")
+            for name, value in values.items():
+                config.write(f"{name} = {value}\n")
+
+
+class Run:
+    """One replay of a transcript through a fresh analyzer process."""
+
+    def __init__(self, options, transcript):
+        self.options = options
+        self.transcript = transcript
+        self.triggers = {}   # analysis id -> (kind, time the trigger line was sent)
+        self.finished = {}   # analysis id -> time the Finished line was printed
+        self.spoken = {}     # analysis id -> time of the first utterance about it
+
+    def read_stdout(self, stream):
+        """Timestamp the Finished lines printed by the analyzer."""
+        for line in stream:
+            now = time.time()
+            if self.options.verbose:
+                sys.stdout.write(line)
+            match = FINISHED_PATTERN.search(line)
+            if match:
+                self.finished.setdefault(match.group(2), now)
+
+    def read_tts_log(self, tts_log):
+        """Collect the first utterance mentioning each analysis."""
+        if not os.path.exists(tts_log):
+            return
+        with open(tts_log, "r", encoding="utf-8") as log:
+            for line in log:
+                entry = json.loads(line)
+                match = SPOKEN_PATTERN.search(entry["text"])
+                if match:
+                    self.spoken.setdefault(match.group(2), entry["time"])
+
+    def execute(self):
+        """Feed the transcript, wait for every analysis and collect timings."""
+        with tempfile.TemporaryDirectory(prefix="replay_") as workdir:
+            tts_log = os.path.join(workdir, "tts.jsonl")
+            write_config(workdir, self.options, tts_log)
+            command = [os.path.abspath(self.options.analyzer)]
+            if shutil.which("stdbuf"):
+                command = ["stdbuf", "-oL"] + command  # timestamp lines as they are printed
+            with subprocess.Popen(command, cwd=workdir,
+                                  stdin=subprocess.PIPE, stdout=subprocess.PIPE,
+                                  stderr=subprocess.STDOUT, text=True, bufsize=1) as process:
+                reader = threading.Thread(target=self.read_stdout, args=(process.stdout,))
+                reader.start()
+                self.feed(process.stdin)
+                deadline = time.time() + self.options.timeout
+                while len(self.finished) < len(self.triggers) and time.time() < deadline:
+                    time.sleep(0.05)
+                process.stdin.close()
+                try:
+                    process.wait(timeout=self.options.timeout)
+                except subprocess.TimeoutExpired:
+                    process.kill()
+                reader.join()
+            self.read_tts_log(tts_log)
+            if self.options.keep_logs:
+                with open(tts_log, "r", encoding="utf-8") as log:
+                    sys.stdout.write(log.read())
+
+    def feed(self, stdin):
+        """Write the transcript lines, numbering analyses as the analyzer does."""
+        recording = 0
+        temp_checks = 0
+        with open(self.transcript, "r", encoding="utf-8") as transcript:
+            for line in transcript:
+                lowered = line.lower()
+                now = time.time()
+                if START_PHRASE in lowered:
+                    recording += 1
+                    temp_checks = 0
+                elif STOP_PHRASE in lowered and recording:
+                    self.triggers[str(recording)] = ("final", now)
+                elif TEMP_CHECK_PHRASE in lowered and recording:
+                    temp_checks += 1
+                    self.triggers[f"{recording}.{temp_checks}"] = ("temp_check", now)
+                stdin.write(line if line.endswith("\n") else line + "\n")
+                stdin.flush()
+                time.sleep(self.options.line_delay)
+
+    def latencies(self):
+        """Yield (kind, metric, milliseconds) for every measured analysis."""
+        for analysis_id, (kind, sent) in self.triggers.items():
+            if analysis_id in self.spoken:
+                yield kind, "first_spoken_word", (self.spoken[analysis_id] - sent) * 1000.0
+            if analysis_id in self.finished:
+                yield kind, "file_complete", (self.finished[analysis_id] - sent) * 1000.0
+            else:
+                yield kind, "missing", 0.0
+
+
+def percentile(values, fraction):
+    """Nearest-rank percentile of a non-empty list."""
+    ordered = sorted(values)
+    index = max(0, min(len(ordered) - 1, int(round(fraction * len(ordered) + 0.5)) - 1))
+    return ordered[index]
+
+
+def main():
+    """Parse the command line, replay the transcripts and print the report."""
+    if len(sys.argv) == 3 and sys.argv[1] == "--tts-sink":
+        tts_sink(sys.argv[2])
+        return
+
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("transcripts", nargs="+", help="transcript files to replay")
+    parser.add_argument("--analyzer", default="./analyze_text.exe")
+    parser.add_argument("--base-url", default="http://127.0.0.1:8080/api")
+    parser.add_argument("--model", default="mock")
+    parser.add_argument("--runs", type=int, default=1, help="replays per transcript")
+    parser.add_argument("--line-delay", type=float, default=0.2,
+                        help="seconds between transcript lines")
+    parser.add_argument("--timeout", type=float, default=300.0,
+                        help="seconds to wait for outstanding analyses")
+    parser.add_argument("--set", action="append", default=[], metavar="SECTION.KEY=VALUE",
+                        help="extra config.ini setting (repeatable)")
+    parser.add_argument("--json", help="also write the raw latencies to this file")
+    parser.add_argument("--keep-logs", action="store_true", help="print the spoken utterances")
+    parser.add_argument("--verbose", action="store_true", help="echo the analyzer output")
+    options = parser.parse_args()
+
+    samples = {}
+    for transcript in options.transcripts:
+        for _ in range(options.runs):
+            run = Run(options, transcript)
+            run.execute()
+            for kind, metric, value in run.latencies():
+                samples.setdefault((kind, metric), []).append(value)
+
+    print(f"{'analysis':<12}{'metric':<20}{'n':>5}{'p50':>10}{'p90':>10}{'p99':>10}{'max':>10}")
+    for (kind, metric), values in sorted(samples.items()):
+        if metric == "missing":
+            print(f"{kind:<12}{'missing':<20}{len(values):>5}")
+            continue
+        print(f"{kind:<12}{metric:<20}{len(values):>5}"
+              f"{percentile(values, 0.5):>10.0f}{percentile(values, 0.9):>10.0f}"
+              f"{percentile(values, 0.99):>10.0f}{max(values):>10.0f}")
+
+    if options.json:
+        with open(options.json, "w", encoding="utf-8") as output:
+            json.dump({f"{kind}.{metric}": values for (kind, metric), values in samples.items()},
+                      output, indent=2)
+
+
+if __name__ == "__main__":
+    main()